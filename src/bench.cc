@@ -0,0 +1,259 @@
+// Microbenchmarks for the receive and symbolization hot paths.
+//
+//   bench [--kallsyms FIXTURE] [--filter NAME]
+//
+// Without --kallsyms a synthetic table of kernel size is generated, so runs
+// are comparable across machines. Reports ns/op and heap allocations/op.
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <linux/genetlink.h>
+#include <linux/net_dropmon.h>
+#include <linux/netlink.h>
+
+#include "common.hh"
+#include "genl_message.hh"
+#include "kallsyms_lookup.hh"
+#include "latency_histogram.hh"
+#include "netlink_dropmon.hh"
+#include "receiver.hh"
+#include "string_pool.hh"
+
+static std::atomic<uint64_t> allocations{0};
+
+void *operator new(size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void *p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    std::free(p);
+}
+
+static const char *filter;
+
+// Runs f(iters) and reports per-op cost; f returns the number of ops done.
+template<typename F>
+static void run(const char *name, F f)
+{
+    if (filter && !std::strstr(name, filter))
+        return;
+    using clock = std::chrono::steady_clock;
+    f(); // warm up caches and lazily built state
+    const uint64_t allocs0 = allocations.load(std::memory_order_relaxed);
+    const auto t0 = clock::now();
+    const uint64_t ops = f();
+    const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - t0).count();
+    const uint64_t allocs = allocations.load(std::memory_order_relaxed) - allocs0;
+    printf("%-32s %12" PRIu64 " ops %14.1f ns/op %10.3f allocs/op\n", name, ops,
+           double(ns) / ops, double(allocs) / ops);
+    fflush(stdout);
+}
+
+// Kernel-sized table: ~120k symbols, some duplicate addresses, module tail.
+static std::vector<char> synthetic_kallsyms()
+{
+    std::vector<char> text;
+    std::mt19937_64 rng(1);
+    uint64_t addr = 0xffffffff81000000ull;
+    char line[96];
+    for (unsigned i = 0; i < 120000; i++) {
+        const int len = snprintf(line, sizeof line, "%016" PRIx64 " %c sym_%u%s\n", addr,
+                                 i % 7 ? 't' : 'T', i, i >= 110000 ? "\t[mod]" : "");
+        text.insert(text.end(), line, line + len);
+        if (i % 50)
+            addr += 16 + rng() % 512;
+        if (i == 110000)
+            addr = 0xffffffffc0000000ull;
+    }
+    return text;
+}
+
+// One datagram holding `alerts` NET_DM_CMD_ALERT messages of `points` each.
+static std::vector<unsigned char> synthetic_alerts(int family, size_t alerts, size_t points,
+                                                   const std::vector<uint64_t> &pcs)
+{
+    std::vector<unsigned char> buf;
+    for (size_t a = 0; a < alerts; a++) {
+        genl_message m(family, NET_DM_CMD_ALERT);
+        m.alert_msg(points, [&pcs, a, points](uint32_t i) {
+            return std::make_pair(pcs[(a * points + i) % pcs.size()], 1u);
+        });
+        buf.insert(buf.end(), m.buf.begin(), m.buf.end());
+    }
+    return buf;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *fixture = nullptr;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--kallsyms") == 0 && i + 1 < argc) {
+            fixture = argv[++i];
+        } else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            filter = argv[++i];
+        } else {
+            printf("%s: [--kallsyms FIXTURE] [--filter NAME]\n", argv[0]);
+            return strcmp(argv[i], "--help") == 0 ? 0 : -1;
+        }
+    }
+
+    std::vector<char> text;
+    if (fixture) {
+        if (!read_file(fixture, text))
+            return -1;
+    } else {
+        text = synthetic_kallsyms();
+    }
+
+    const size_t builds = 10;
+    run("kallsyms build, 1 thread", [&text, builds]() {
+        for (size_t i = 0; i < builds; i++)
+            kallsyms_cache k(text.data(), text.size(), 1);
+        return uint64_t(builds);
+    });
+    run("kallsyms build, auto threads", [&text, builds]() {
+        for (size_t i = 0; i < builds; i++)
+            kallsyms_cache k(text.data(), text.size());
+        return uint64_t(builds);
+    });
+
+    auto kcache = make_unique<kallsyms_cache>(text.data(), text.size());
+    if (!*kcache) {
+        fprintf(stderr, "empty kallsyms fixture\n");
+        return -1;
+    }
+    auto last = kcache->end();
+    --last;
+    const uint64_t lo = (*kcache->begin()).first;
+    const uint64_t hi = (*last).first + 4096;
+
+    std::mt19937_64 rng(2);
+    std::vector<uint64_t> random_pcs(1 << 20);
+    for (auto &pc: random_pcs)
+        pc = lo + rng() % (hi - lo);
+    const std::vector<uint64_t> hot_pcs(random_pcs.begin(), random_pcs.begin() + 64);
+
+    volatile size_t sink = 0;
+    run("lookup_symbol, random", [&]() {
+        for (auto pc: random_pcs)
+            sink += kcache->lookup_symbol(pc).second;
+        return uint64_t(random_pcs.size());
+    });
+    run("lookup_symbol, hot set of 64", [&]() {
+        const size_t n = 1 << 20;
+        for (size_t i = 0; i < n; i++)
+            sink += kcache->lookup_symbol(hot_pcs[i & 63]).second;
+        return uint64_t(n);
+    });
+
+    // resolver entries intern their locations; most are repeats
+    std::vector<std::string> locations(4096);
+    for (size_t i = 0; i < locations.size(); i++)
+        locations[i] = "net/core/subsys_" + std::to_string(i % 512) + "/file.c:" + std::to_string(rng() % 4000);
+    string_pool pool;
+    run("string_pool intern, 4k strings", [&]() {
+        const size_t n = 1 << 20;
+        for (size_t i = 0; i < n; i++)
+            sink += pool.intern(locations[i & 4095]);
+        return uint64_t(n);
+    });
+
+    // parse path behind try_rx(), through std::function and an inlined handler
+    uint64_t points = 0;
+    auto sum = [&points](const drop_points &alert) {
+        for (const auto p: alert)
+            points += p.pc ^ p.count;
+    };
+    drop_mon_t parser(sum, GENL_MIN_ID);
+    auto datagram = synthetic_alerts(GENL_MIN_ID, 16, 8, hot_pcs);
+    run("parse datagram, 16x8 points", [&]() {
+        const size_t n = 100000;
+        for (size_t i = 0; i < n; i++)
+            parser.feed(datagram.data(), datagram.size());
+        return uint64_t(n);
+    });
+    run("parse datagram, 16x8, inlined", [&]() {
+        const size_t n = 100000;
+        for (size_t i = 0; i < n; i++)
+            parser.feed(datagram.data(), datagram.size(), sum);
+        return uint64_t(n);
+    });
+    // --stats adds two clock reads and one record() per datagram
+    std::unique_ptr<latency_histogram> parse_timing(new latency_histogram);
+    parser.set_timing(nullptr, parse_timing.get());
+    run("parse datagram, 16x8, timed", [&]() {
+        const size_t n = 100000;
+        for (size_t i = 0; i < n; i++)
+            parser.feed(datagram.data(), datagram.size(), sum);
+        return uint64_t(n);
+    });
+    parser.set_timing(nullptr, nullptr);
+    run("latency_histogram record", [&]() {
+        const size_t n = 1 << 22;
+        for (size_t i = 0; i < n; i++)
+            parse_timing->record(rng() & 0xfffff);
+        return uint64_t(n);
+    });
+    auto large = synthetic_alerts(GENL_MIN_ID, 1, 512, random_pcs);
+    run("parse per point, 1x512, inlined", [&]() {
+        const size_t n = 10000;
+        for (size_t i = 0; i < n; i++)
+            parser.feed(large.data(), large.size(), sum);
+        return uint64_t(n * 512);
+    });
+
+    // rx_callback: resolve and format one record per drop into /dev/null
+    const kernel_layout layout;
+    receiver_options opts;
+    opts.layout = &layout;
+    opts.output_fd = open("/dev/null", O_WRONLY);
+    struct {
+        const char *name;
+        output_format format;
+    } formats[] = {
+        {"rx_callback table", output_format::table},
+        {"rx_callback ndjson", output_format::ndjson},
+        {"rx_callback csv", output_format::csv},
+        {"rx_callback binary", output_format::binary},
+    };
+    for (const auto &f: formats) {
+        opts.format = f.format;
+        receiver_ctx rx(opts);
+        rx.resolver.set_kallsyms(kcache.get());
+        auto format = [&rx](const std::vector<uint64_t> &pcs, size_t n) {
+            return [&rx, &pcs, n]() {
+                for (size_t i = 0; i < n; i++)
+                    rx.rx_callback(drop_record{i, pcs[i % pcs.size()], 1});
+                rx.out.flush();
+                return uint64_t(n);
+            };
+        };
+        std::string name = f.name;
+        run((name + ", hot set").c_str(), format(hot_pcs, 200000));
+        run((name + ", random").c_str(), format(random_pcs, 200000));
+    }
+    close(opts.output_fd);
+    return 0;
+}
@@ -0,0 +1,152 @@
+#include "capture.hh"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <vector>
+
+#include "kallsyms_lookup.hh"
+#include "kernel_layout.hh"
+
+static const char capture_magic[8] = {'D', 'M', 'C', 'A', 'P', 'T', '\n', '\0'};
+static const uint32_t capture_version = 1;
+static const size_t capture_iobuf = 1024 * 1024;
+
+static uint64_t monotonic_ns()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+capture_writer::~capture_writer()
+{
+    close();
+}
+
+bool capture_writer::open(const char *path, int family)
+{
+    std::vector<char> kallsyms;
+    if (!read_file("/proc/kallsyms", kallsyms))
+        return false;
+    const std::string layout = kernel_layout::read().serialize();
+
+    file = fopen(path, "wbe");
+    if (!file) {
+        perror("fopen");
+        return false;
+    }
+    // large stdio buffer: the receive path only memcpy()s
+    iobuf = static_cast<char *>(malloc(capture_iobuf));
+    if (iobuf)
+        setvbuf(file, iobuf, _IOFBF, capture_iobuf);
+
+    capture_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, capture_magic, sizeof(hdr.magic));
+    hdr.version = capture_version;
+    hdr.family = family;
+    hdr.start_ns = monotonic_ns();
+    hdr.layout_size = layout.size();
+    hdr.kallsyms_size = kallsyms.size();
+    if (fwrite(&hdr, sizeof(hdr), 1, file) != 1 ||
+        fwrite(layout.data(), 1, layout.size(), file) != layout.size() ||
+        fwrite(kallsyms.data(), 1, kallsyms.size(), file) != kallsyms.size()) {
+        perror("fwrite");
+        close();
+        return false;
+    }
+    return true;
+}
+
+void capture_writer::write(const void *buf, size_t len)
+{
+    if (!file || error)
+        return;
+    capture_record rec;
+    rec.timestamp_ns = monotonic_ns();
+    rec.len = len;
+    rec.reserved = 0;
+    if (fwrite(&rec, sizeof(rec), 1, file) != 1 || fwrite(buf, 1, len, file) != len) {
+        perror("capture");
+        error = true;
+        return;
+    }
+    count++;
+}
+
+void capture_writer::close()
+{
+    if (file && fclose(file) != 0)
+        perror("fclose");
+    file = nullptr;
+    free(iobuf);
+    iobuf = nullptr;
+}
+
+capture_reader::~capture_reader()
+{
+    if (map)
+        munmap(map, map_size);
+}
+
+bool capture_reader::open(const char *path)
+{
+    int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        perror("open");
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror("fstat");
+        ::close(fd);
+        return false;
+    }
+    map_size = st.st_size;
+    if (map_size < sizeof(capture_header)) {
+        fprintf(stderr, "%s: not a capture file\n", path);
+        ::close(fd);
+        return false;
+    }
+    map = mmap(nullptr, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        map = nullptr;
+        return false;
+    }
+    madvise(map, map_size, MADV_SEQUENTIAL);
+
+    hdr = static_cast<const capture_header *>(map);
+    if (memcmp(hdr->magic, capture_magic, sizeof(capture_magic)) != 0 ||
+        hdr->version != capture_version ||
+        sizeof(capture_header) + hdr->layout_size + hdr->kallsyms_size > map_size) {
+        fprintf(stderr, "%s: not a capture file or wrong version\n", path);
+        return false;
+    }
+    const char *base = static_cast<const char *>(map);
+    layout_text = base + sizeof(capture_header);
+    kallsyms_text = layout_text + hdr->layout_size;
+    pos = sizeof(capture_header) + hdr->layout_size + hdr->kallsyms_size;
+    return true;
+}
+
+bool capture_reader::next(capture_record &rec, const unsigned char *&payload)
+{
+    if (pos + sizeof(rec) > map_size)
+        return false;
+    const unsigned char *base = static_cast<const unsigned char *>(map);
+    memcpy(&rec, base + pos, sizeof(rec));
+    if (pos + sizeof(rec) + rec.len > map_size)
+        return false;
+    payload = base + pos + sizeof(rec);
+    pos += sizeof(rec) + rec.len;
+    return true;
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+// Append-only binary capture of raw NET_DM datagrams.
+//
+// File layout, native endianness:
+//   capture_header
+//   char layout[layout_size]       kernel_layout::serialize()
+//   char kallsyms[kallsyms_size]   verbatim /proc/kallsyms
+//   { capture_record, payload[len] }...
+//
+// The header snapshots everything needed to symbolize the stream on
+// another machine. Records carry the CLOCK_MONOTONIC receive time.
+struct capture_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t family;            // NET_DM generic netlink family id
+    uint64_t start_ns;          // CLOCK_MONOTONIC at open
+    uint64_t layout_size;
+    uint64_t kallsyms_size;
+};
+
+struct capture_record {
+    uint64_t timestamp_ns;
+    uint32_t len;
+    uint32_t reserved;
+};
+
+struct capture_writer {
+    capture_writer() = default;
+    ~capture_writer();
+    capture_writer(const capture_writer &) = delete;
+    capture_writer &operator=(const capture_writer &) = delete;
+
+    // Writes the header with a snapshot of the running kernel.
+    bool open(const char *path, int family);
+    operator bool() const { return file != nullptr; }
+
+    // Called on the receive path: one timestamp and one buffered append.
+    void write(const void *buf, size_t len);
+    void close();
+
+    uint64_t records() const { return count; }
+    bool failed() const { return error; }
+
+private:
+    FILE *file = nullptr;
+    char *iobuf = nullptr;
+    uint64_t count = 0;
+    bool error = false;
+};
+
+struct capture_reader {
+    capture_reader() = default;
+    ~capture_reader();
+    capture_reader(const capture_reader &) = delete;
+    capture_reader &operator=(const capture_reader &) = delete;
+
+    // Maps path read-only and validates the header.
+    bool open(const char *path);
+
+    int family() const { return hdr->family; }
+    uint64_t start_ns() const { return hdr->start_ns; }
+    const char *layout() const { return layout_text; }
+    size_t layout_size() const { return hdr->layout_size; }
+    const char *kallsyms() const { return kallsyms_text; }
+    size_t kallsyms_size() const { return hdr->kallsyms_size; }
+
+    // Iterates records; returns false at the end or on a torn tail.
+    // payload stays valid while the reader lives.
+    bool next(capture_record &rec, const unsigned char *&payload);
+
+private:
+    void *map = nullptr;
+    size_t map_size = 0;
+    const capture_header *hdr = nullptr;
+    const char *layout_text = nullptr;
+    const char *kallsyms_text = nullptr;
+    size_t pos = 0;
+};
@@ -0,0 +1,219 @@
+#include "collector.hh"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "unix_socket.hh"
+
+static const size_t max_subscribers = 64;
+
+collector_server::~collector_server()
+{
+    for (const auto &sub: subs)
+        close(sub.fd);
+    if (listen_fd != -1)
+        close(listen_fd);
+    if (!unix_path.empty())
+        unlink(unix_path.c_str());
+}
+
+bool collector_server::listen(const char *path, size_t buffer_size)
+{
+    listen_fd = unix_listen("collector", path, max_subscribers);
+    if (listen_fd == -1)
+        return false;
+    unix_path = path;
+
+    this->buffer_size = 64 * 1024;
+    while (this->buffer_size < buffer_size)
+        this->buffer_size <<= 1;
+    return true;
+}
+
+void collector_server::set_session(int family, const drop_mon_config &config)
+{
+    memset(&hello, 0, sizeof(hello));
+    memcpy(hello.magic, collector_magic, sizeof(hello.magic));
+    hello.version = collector_version;
+    hello.family = family;
+    hello.flags = (config.packet_mode ? COLLECTOR_PACKET_MODE : 0) | (config.hw_drops ? COLLECTOR_HW_DROPS : 0);
+}
+
+void collector_server::append(subscriber &sub, const void *data, size_t len)
+{
+    const size_t at = sub.head & (buffer_size - 1);
+    const size_t first = std::min(len, buffer_size - at);
+    memcpy(sub.buf.get() + at, data, first);
+    memcpy(sub.buf.get(), static_cast<const char *>(data) + first, len - first);
+    sub.head += len;
+}
+
+void collector_server::publish(uint64_t timestamp, const void *buf, size_t len)
+{
+    collector_record rec{timestamp, static_cast<uint32_t>(len), 0};
+    for (auto &sub: subs) {
+        const size_t room = buffer_size - (sub.head - sub.tail);
+        const size_t need = sizeof(rec) + len + (sub.lost ? sizeof(rec) : 0);
+        if (need > room) {
+            sub.lost++;
+            total_lost++;
+            continue;
+        }
+        if (sub.lost) {
+            const collector_record report{timestamp, 0, sub.lost};
+            append(sub, &report, sizeof(report));
+            sub.lost = 0;
+        }
+        append(sub, &rec, sizeof(rec));
+        append(sub, buf, len);
+    }
+}
+
+void collector_server::add_pollfds(std::vector<pollfd> &fds) const
+{
+    fds.push_back(pollfd{listen_fd, POLLIN, 0});
+    for (const auto &sub: subs)
+        fds.push_back(pollfd{sub.fd, static_cast<short>(sub.head != sub.tail ? POLLIN | POLLOUT : POLLIN), 0});
+}
+
+void collector_server::handle(const pollfd *fds, size_t count)
+{
+    // subs is in the order add_pollfds() saw it; new subscribers come last
+    size_t kept = 0;
+    for (size_t i = 0; i < subs.size(); i++) {
+        subscriber &sub = subs[i];
+        const short revents = i + 1 < count ? fds[i + 1].revents : 0;
+        bool open = !(revents & (POLLHUP | POLLERR));
+        if (open && (revents & POLLIN)) {
+            // subscribers do not talk; this is EOF or noise
+            char discard[256];
+            const ssize_t n = recv(sub.fd, discard, sizeof(discard), 0);
+            open = n > 0 || (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR));
+        }
+        // datagrams published since poll() are sent right away unless
+        // the socket was full
+        if (revents & POLLOUT)
+            sub.blocked = false;
+        if (open && sub.head != sub.tail && !sub.blocked)
+            open = write_pending(sub);
+        if (!open) {
+            close(sub.fd);
+            continue;
+        }
+        if (kept != i)
+            subs[kept] = std::move(sub);
+        kept++;
+    }
+    subs.resize(kept);
+
+    if (count && (fds[0].revents & POLLIN))
+        accept_all();
+}
+
+void collector_server::accept_all()
+{
+    while (subs.size() < max_subscribers) {
+        const int fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED && errno != EINTR)
+                perror("collector: accept");
+            return;
+        }
+        subscriber sub;
+        sub.fd = fd;
+        sub.buf.reset(new char[buffer_size]);
+        append(sub, &hello, sizeof(hello));
+        subs.push_back(std::move(sub));
+        total_accepted++;
+    }
+}
+
+bool collector_server::write_pending(subscriber &sub)
+{
+    while (sub.head != sub.tail) {
+        const size_t at = sub.tail & (buffer_size - 1);
+        const size_t pending = sub.head - sub.tail;
+        const size_t first = std::min(pending, buffer_size - at);
+        iovec iov[2] = {{sub.buf.get() + at, first}, {sub.buf.get(), pending - first}};
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = pending > first ? 2 : 1;
+        const ssize_t n = sendmsg(sub.fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n == -1) {
+            sub.blocked = errno == EAGAIN || errno == EWOULDBLOCK;
+            return sub.blocked || errno == EINTR;
+        }
+        sub.tail += n;
+    }
+    return true;
+}
+
+collector_client::~collector_client()
+{
+    if (fd != -1)
+        close(fd);
+}
+
+bool collector_client::connect(const char *path)
+{
+    sockaddr_un sun;
+    if (!unix_address("collector", path, sun))
+        return false;
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        perror("socket");
+        return false;
+    }
+    if (::connect(fd, reinterpret_cast<sockaddr *>(&sun), sizeof(sun)) == -1) {
+        fprintf(stderr, "collector: connect %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    size_t got = 0;
+    while (got < sizeof(hello)) {
+        const ssize_t n = recv(fd, reinterpret_cast<char *>(&hello) + got, sizeof(hello) - got, 0);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            fprintf(stderr, "collector at %s closed the connection\n", path);
+            return false;
+        }
+        got += n;
+    }
+    if (memcmp(hello.magic, collector_magic, sizeof(collector_magic)) != 0 || hello.version != collector_version) {
+        fprintf(stderr, "%s: not a drop_monitor collector or wrong version\n", path);
+        return false;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    buf.resize(256 * 1024);
+    return true;
+}
+
+bool collector_client::read_some()
+{
+    // only full when a record is larger than the buffer
+    if (fill == buf.size())
+        buf.resize(buf.size() * 2);
+    for (;;) {
+        const ssize_t n = recv(fd, buf.data() + fill, buf.size() - fill, 0);
+        if (n == 0)
+            return false;
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return true;
+            perror("collector: recv");
+            return false;
+        }
+        fill += n;
+        return true;
+    }
+}
@@ -0,0 +1,151 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <poll.h>
+
+#include "netlink_dropmon.hh"
+
+// Shares one NET_DM session between local consumers.
+//
+// NET_DM is global: a second drop_monitor that starts and stops tracing
+// also stops it for the first one. A collector (--serve) owns the session
+// and forwards the raw datagrams it receives to any number of subscribers
+// (--subscribe) over a UNIX stream socket; subscribers parse and
+// symbolize them as if they came from their own socket.
+//
+// Stream to a subscriber, native endianness (same host):
+//   collector_hello
+//   { collector_record, payload[len] }...
+// A record with len 0 carries no datagram but reports datagrams the
+// collector dropped for this subscriber because it did not keep up.
+
+static const char collector_magic[8] = {'D', 'M', 'C', 'O', 'L', 'L', '\n', '\0'};
+static const uint32_t collector_version = 1;
+
+enum collector_flags : uint32_t {
+    COLLECTOR_PACKET_MODE = 1,
+    COLLECTOR_HW_DROPS = 2,
+};
+
+struct collector_hello {
+    char magic[8];
+    uint32_t version;
+    uint32_t family;        // NET_DM generic netlink family id
+    uint32_t flags;         // collector_flags of the collector's session
+    uint32_t reserved;
+};
+
+struct collector_record {
+    uint64_t timestamp_ns;  // CLOCK_MONOTONIC at receive
+    uint32_t len;           // payload bytes, 0 for a loss report
+    uint32_t lost;          // loss report: datagrams dropped since the last one
+};
+
+// Collector side.
+//
+// publish() copies a datagram into a bounded ring per subscriber and never
+// blocks; a subscriber whose ring is full loses the datagram and is told
+// so later. Rings are drained with non-blocking writes from the caller's
+// poll loop (add_pollfds() before poll(), handle() after it), so a stalled
+// subscriber costs the others nothing.
+struct collector_server {
+    collector_server() = default;
+    ~collector_server();
+    collector_server(const collector_server &) = delete;
+    collector_server &operator=(const collector_server &) = delete;
+
+    // Listens on a UNIX socket at path; buffer_size bytes per subscriber.
+    bool listen(const char *path, size_t buffer_size = 4 * 1024 * 1024);
+    // The session subscribers are told about; set once tracing started.
+    void set_session(int family, const drop_mon_config &config);
+
+    // receive path
+    void publish(uint64_t timestamp, const void *buf, size_t len);
+
+    void add_pollfds(std::vector<pollfd> &fds) const;
+    void handle(const pollfd *fds, size_t count);
+
+    uint64_t accepted() const { return total_accepted; }
+    // datagrams dropped for slow subscribers, summed over all of them
+    uint64_t lost() const { return total_lost; }
+
+private:
+    struct subscriber {
+        int fd;
+        std::unique_ptr<char[]> buf;    // ring of buffer_size bytes
+        uint64_t head = 0;              // bytes queued, ever
+        uint64_t tail = 0;              // bytes sent, ever
+        uint32_t lost = 0;              // not reported yet
+        bool blocked = false;           // socket full, wait for POLLOUT
+    };
+
+    void accept_all();
+    void append(subscriber &sub, const void *data, size_t len);
+    // false when the subscriber is gone
+    bool write_pending(subscriber &sub);
+
+    int listen_fd = -1;
+    std::string unix_path;
+    size_t buffer_size = 0;         // power of 2
+    collector_hello hello;
+    std::vector<subscriber> subs;
+    uint64_t total_accepted = 0;
+    uint64_t total_lost = 0;
+};
+
+// Subscriber side.
+struct collector_client {
+    collector_client() = default;
+    ~collector_client();
+    collector_client(const collector_client &) = delete;
+    collector_client &operator=(const collector_client &) = delete;
+
+    // Connects and reads the hello.
+    bool connect(const char *path);
+
+    int get_fd() const { return fd; }
+    int family() const { return hello.family; }
+    uint32_t flags() const { return hello.flags; }
+    // datagrams the collector dropped for us
+    uint64_t lost() const { return total_lost; }
+
+    // Reads what the socket has and calls f(timestamp, payload, len) for
+    // every complete datagram; payload may be modified. Returns false once
+    // the collector is gone.
+    template<typename F>
+    bool receive(F f)
+    {
+        if (!read_some())
+            return false;
+        size_t pos = 0;
+        collector_record rec;
+        while (fill - pos >= sizeof(rec)) {
+            memcpy(&rec, buf.data() + pos, sizeof(rec));
+            if (fill - pos - sizeof(rec) < rec.len)
+                break;
+            if (rec.len)
+                f(rec.timestamp_ns, buf.data() + pos + sizeof(rec), static_cast<size_t>(rec.len));
+            else
+                total_lost += rec.lost;
+            pos += sizeof(rec) + rec.len;
+        }
+        memmove(buf.data(), buf.data() + pos, fill - pos);
+        fill -= pos;
+        return true;
+    }
+
+private:
+    bool read_some();
+
+    int fd = -1;
+    collector_hello hello;
+    std::vector<unsigned char> buf;
+    size_t fill = 0;
+    uint64_t total_lost = 0;
+};
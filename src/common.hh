@@ -1,5 +1,7 @@
 #pragma once
 
+#include <cstdint>
+#include <ctime>
 #include <memory>
 
 template<typename T, typename... Args>
@@ -10,3 +12,10 @@ std::unique_ptr<T> make_unique(Args&&... args)
 
 template<typename T>
 using unique_ptr = std::unique_ptr<T, void(*)(T*)>;
+
+inline uint64_t monotonic_ns()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
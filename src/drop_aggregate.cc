@@ -0,0 +1,45 @@
+#include "drop_aggregate.hh"
+
+#include <algorithm>
+
+drop_aggregate::drop_aggregate(size_t top_n)
+    : top_n(top_n), start(std::chrono::steady_clock::now())
+{}
+
+double drop_aggregate::interval::rate(uint64_t count) const
+{
+    const double secs = std::chrono::duration<double>(length).count();
+    return secs > 0 ? count / secs : 0;
+}
+
+drop_aggregate::interval drop_aggregate::rotate()
+{
+    const auto now = std::chrono::steady_clock::now();
+    interval result;
+    result.length = now - start;
+    result.drops = drops;
+    result.sites = 0;
+    result.top.reserve(std::min(sites.size(), top_n));
+
+    std::vector<row> rows;
+    rows.reserve(sites.size());
+    sites.for_each([&rows](uint64_t pc, site &s) {
+        if (s.count)
+            rows.push_back(row{pc, s.count, s.previous, s.total + s.count});
+        s.total += s.count;
+        s.previous = s.count;
+        s.count = 0;
+    });
+    result.sites = rows.size();
+
+    const auto by_count = [](const row &a, const row &b) {
+        return a.count != b.count ? a.count > b.count : a.pc < b.pc;
+    };
+    const size_t n = std::min(rows.size(), top_n);
+    std::partial_sort(std::begin(rows), std::begin(rows) + n, std::end(rows), by_count);
+    result.top.assign(std::begin(rows), std::begin(rows) + n);
+
+    drops = 0;
+    start = now;
+    return result;
+}
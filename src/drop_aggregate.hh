@@ -0,0 +1,53 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "pc_map.hh"
+
+// Per-PC drop counters for interval reports.
+//
+// add() is the hot path: a single hash probe per drop point. Once per
+// interval, rotate() returns the busiest sites and starts the next interval.
+struct drop_aggregate {
+    struct row {
+        uint64_t pc;
+        uint64_t count;     // drops in this interval
+        uint64_t previous;  // drops in the interval before
+        uint64_t total;     // drops since start
+    };
+
+    struct interval {
+        std::chrono::steady_clock::duration length;
+        uint64_t drops;     // all sites, this interval
+        size_t sites;       // sites with drops, this interval
+        std::vector<row> top;
+
+        double rate(uint64_t count) const;
+    };
+
+    explicit drop_aggregate(size_t top_n);
+
+    void add(uint64_t pc, size_t count)
+    {
+        auto &site = sites[pc];
+        site.count += count;
+        drops += count;
+    }
+
+    interval rotate();
+
+private:
+    struct site {
+        uint64_t count = 0;
+        uint64_t previous = 0;
+        uint64_t total = 0;
+    };
+
+    pc_map<site> sites;
+    size_t top_n;
+    uint64_t drops = 0;
+    std::chrono::steady_clock::time_point start;
+};
@@ -0,0 +1,123 @@
+#include "drop_filter.hh"
+
+#include <fnmatch.h>
+
+#include <cstdio>
+#include <cstring>
+
+drop_filter::~drop_filter()
+{
+    for (auto &r: rules)
+        if (r.re)
+            regfree(r.re.get());
+}
+
+bool drop_filter::add(bool include, const char *spec)
+{
+    rule r;
+    r.include = include;
+    r.what = SYMBOL;
+    const char *pattern = spec;
+    if (strncmp(spec, "sym:", 4) == 0) {
+        pattern = spec + 4;
+    } else if (strncmp(spec, "module:", 7) == 0) {
+        r.what = MODULE;
+        pattern = spec + 7;
+    } else if (strncmp(spec, "file:", 5) == 0) {
+        r.what = FILE;
+        pattern = spec + 5;
+    }
+
+    const size_t len = strlen(pattern);
+    if (len == 0) {
+        fprintf(stderr, "empty filter pattern in \"%s\"\n", spec);
+        return false;
+    }
+    if (len >= 2 && pattern[0] == '/' && pattern[len - 1] == '/') {
+        const std::string expr(pattern + 1, len - 2);
+        r.re.reset(new regex_t);
+        const int err = regcomp(r.re.get(), expr.c_str(), REG_EXTENDED | REG_NOSUB);
+        if (err) {
+            char msg[256];
+            regerror(err, r.re.get(), msg, sizeof(msg));
+            fprintf(stderr, "invalid filter regex \"%s\": %s\n", expr.c_str(), msg);
+            r.re.reset();
+            return false;
+        }
+    } else {
+        r.glob = pattern;
+    }
+
+    has_includes |= include;
+    need_location |= r.what == FILE;
+    rules.push_back(std::move(r));
+    decisions.clear();
+    return true;
+}
+
+bool drop_filter::matches(const rule &r, const char *text, size_t len)
+{
+    const std::string s(text, len);
+    if (r.re)
+        return regexec(r.re.get(), s.c_str(), 0, nullptr, 0) == 0;
+    return fnmatch(r.glob.c_str(), s.c_str(), 0) == 0;
+}
+
+bool drop_filter::matches(const rule &r, const subject &s)
+{
+    switch (r.what) {
+    case SYMBOL: {
+        if (!s.symbol)
+            return false;
+        // "a/b" for symbols sharing an address
+        for (const char *p = s.symbol;;) {
+            const char *slash = strchr(p, '/');
+            const size_t len = slash ? slash - p : strlen(p);
+            if (matches(r, p, len))
+                return true;
+            if (!slash)
+                return false;
+            p = slash + 1;
+        }
+    }
+    case MODULE:
+        return s.module && matches(r, s.module, strlen(s.module));
+    case FILE: {
+        if (!s.location)
+            return false;
+        // without ":line[:col]"
+        const char *end = s.location + strlen(s.location);
+        for (int i = 0; i < 2; i++) {
+            const char *colon = static_cast<const char *>(memrchr(s.location, ':', end - s.location));
+            if (!colon || colon[1] < '0' || colon[1] > '9')
+                break;
+            end = colon;
+        }
+        // "net/core/*" also matches "/build/linux/net/core/dev.c"
+        for (const char *p = s.location; p; ) {
+            if (matches(r, p, end - p))
+                return true;
+            p = static_cast<const char *>(memchr(p, '/', end - p));
+            if (p)
+                p++;
+        }
+        return false;
+    }
+    }
+    return false;
+}
+
+bool drop_filter::evaluate(const subject &s) const
+{
+    bool included = !has_includes;
+    for (const auto &r: rules) {
+        if (r.include && included)
+            continue;
+        if (!matches(r, s))
+            continue;
+        if (!r.include)
+            return false;
+        included = true;
+    }
+    return included;
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <regex.h>
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "pc_map.hh"
+
+// --include/--exclude rules over drop sites.
+//
+// A rule is "[sym:|module:|file:]PATTERN" (sym if no field is given);
+// PATTERN is a shell glob, or an extended regex written between slashes.
+// Symbols match if any of their aliases does, files if the path or any
+// tail of it after a '/' does. A site is kept if it matches an include
+// rule (or there are none) and no exclude rule. Rules on a field the site
+// lacks, such as file without DWARF, do not match.
+//
+// Patterns are evaluated once per PC; the decision is cached, so a drop
+// costs one hash probe after that.
+struct drop_filter {
+    // What a rule is matched against; nullptr for unknown fields.
+    struct subject {
+        const char *symbol;     // kallsyms name, aliases joined by '/'
+        const char *module;     // "vmlinux" for the core kernel
+        const char *location;   // file:line[:col]
+        // false while a symbol source is still loading: the decision is
+        // used but not cached
+        bool complete;
+    };
+
+    drop_filter() = default;
+    ~drop_filter();
+    drop_filter(const drop_filter &) = delete;
+    drop_filter &operator=(const drop_filter &) = delete;
+
+    // Prints the error and returns false on a bad rule.
+    bool add(bool include, const char *spec);
+
+    bool empty() const { return rules.empty(); }
+    bool uses_locations() const { return need_location; }
+
+    // describe(pc) returns the subject; it is only called on a cache miss.
+    template<typename F>
+    bool accept(uint64_t pc, F describe)
+    {
+        if (const uint8_t *d = decisions.find(pc))
+            return *d;
+        const subject s = describe(pc);
+        const bool keep = evaluate(s);
+        if (s.complete)
+            decisions[pc] = keep;
+        return keep;
+    }
+
+    // Forgets decisions, e.g. after modules were reloaded.
+    void reset() { decisions.clear(); }
+
+private:
+    enum field { SYMBOL, MODULE, FILE };
+
+    struct rule {
+        bool include;
+        field what;
+        std::string glob;               // empty for a regex
+        std::unique_ptr<regex_t> re;
+    };
+
+    bool evaluate(const subject &s) const;
+    static bool matches(const rule &r, const char *text, size_t len);
+    static bool matches(const rule &r, const subject &s);
+
+    std::vector<rule> rules;
+    bool has_includes = false;
+    bool need_location = false;
+    pc_map<uint8_t> decisions;
+};
@@ -1,13 +1,27 @@
 
+#include <cerrno>
+#include <cinttypes>
+#include <climits>
 #include <csignal>
+#include <cstdlib>
 #include <cstring>
+#include <ctime>
 #include <future>
 #include <poll.h>
+#include <thread>
+#include <vector>
 
+#include "capture.hh"
+#include "collector.hh"
 #include "common.hh"
-#include "dwarf_lookup.hh"
+#include "drop_filter.hh"
 #include "kallsyms_lookup.hh"
+#include "kernel_layout.hh"
+#include "metrics.hh"
 #include "netlink_dropmon.hh"
+#include "receiver.hh"
+#include "self_stats.hh"
+#include "shm_stats.hh"
 
 volatile bool sigint;
 void sighandler(int)
@@ -15,69 +29,427 @@ void sighandler(int)
     sigint = true;
 }
 
-struct receiver_ctx {
-    receiver_ctx(const char *debuginfo_path)
-        : dwarf(debuginfo_path)
-    {
-        dwarf_ok = dwarf;
-        if (!dwarf_ok)
-            fprintf(stderr, "dwarf_lookup disabled\n");
-    }
-
-    void rx_callback(void *loc, size_t count)
-    {
-        const auto loc64 = reinterpret_cast<uint64_t>(loc);
-        const auto kallsym = kcache ? kcache->lookup_symbol(loc64) : std::make_pair(nullptr, 0);
-
-        auto dwarf_sym_it = dwarf_cache.find(loc64);
-        if (dwarf_sym_it == std::end(dwarf_cache)) {
-            auto sym = dwarf.lookup(loc64);
-            if (sym.second.empty()) {
-                dwarf_ok = false;
-            } else {
-                const auto insert = dwarf_cache.insert(std::make_pair(loc64, std::move(sym)));
-                if (!insert.second)
-                    dwarf_sym_it == std::end(dwarf_cache);
-                else
-                    dwarf_sym_it = insert.first;
+// Accepts "250ms", "2s" or plain seconds.
+static bool parse_duration(const char *arg, std::chrono::milliseconds &out)
+{
+    char *end = nullptr;
+    errno = 0;
+    const double value = std::strtod(arg, &end);
+    if (errno || end == arg || value <= 0)
+        return false;
+    if (std::strcmp(end, "ms") == 0)
+        out = std::chrono::milliseconds(static_cast<int64_t>(value));
+    else if (*end == '\0' || std::strcmp(end, "s") == 0)
+        out = std::chrono::milliseconds(static_cast<int64_t>(value * 1000));
+    else
+        return false;
+    return out.count() > 0;
+}
+
+static void print_stats(const drop_mon_t &dropmon, const receiver_ctx &rx_ctx)
+{
+    const auto &stats = dropmon.stats();
+    fprintf(stderr, "received %" PRIu64 " alerts with %" PRIu64 " drop points "
+            "in %" PRIu64 " datagrams (%" PRIu64 " bytes, %" PRIu64 " recvmmsg calls), "
+            "%" PRIu64 " overruns, %" PRIu64 " truncated, %" PRIu64 " lost in output queue\n",
+            stats.alerts, stats.drop_points, stats.datagrams, stats.bytes, stats.rx_calls,
+            stats.overruns, stats.truncated, rx_ctx.ring_full.load());
+    if (stats.malformed)
+        fprintf(stderr, "%" PRIu64 " malformed alerts ignored\n", stats.malformed);
+    if (stats.packets || stats.hw_drops)
+        fprintf(stderr, "%" PRIu64 " packet alerts, %" PRIu64 " hardware drops\n",
+                stats.packets, stats.hw_drops);
+}
+
+static void publish_receive_stats(shm_stats_writer &shm, const drop_mon_t &dropmon, const receiver_ctx &rx_ctx)
+{
+    const auto &stats = dropmon.stats();
+    shm_stats_receive receive;
+    receive.datagrams = stats.datagrams;
+    receive.bytes = stats.bytes;
+    receive.alerts = stats.alerts;
+    receive.drop_points = stats.drop_points;
+    receive.packets = stats.packets;
+    receive.hw_drops = stats.hw_drops;
+    receive.overruns = rx_ctx.overruns.load(std::memory_order_relaxed);
+    receive.queue_lost = rx_ctx.ring_full.load(std::memory_order_relaxed);
+    shm.set_receive(receive);
+}
+
+// Symbols from the .symtab of vmlinux and the module files. live: layout
+// is the running kernel, so section addresses may be read from sysfs.
+static std::unique_ptr<kallsyms_cache> load_elf_symbols(const kernel_layout &layout, const char *vmlinux, bool live)
+{
+    const std::string path = vmlinux ? vmlinux : find_vmlinux(layout);
+    if (path.empty()) {
+        fprintf(stderr, "no vmlinux found for %s, try --vmlinux\n", layout.kernel.name.c_str());
+        return make_unique<kallsyms_cache>("", 0);
+    }
+    if (!layout.kernel.base)
+        fprintf(stderr, "kernel text address unknown, assuming no KASLR offset\n");
+    const auto modules = find_module_files(layout, live);
+    auto kcache = kallsyms_cache::from_elf(path.c_str(), layout.kernel.base, modules);
+    const auto &stats = kcache->stats();
+    fprintf(stderr, "%zu symbols from %s and %zu of %zu modules in %.1f ms\n", kcache->size(), path.c_str(),
+            stats.segments_built ? stats.segments_built - 1 : 0, layout.modules.size(),
+            std::chrono::duration<double, std::milli>(stats.parse_time + stats.index_time).count());
+    return kcache;
+}
+
+// serve_path: also forward the session to subscribers. subscribe_path:
+// take drops from a collector instead of a NET_DM session of our own.
+static int run_live(receiver_options opts, const drop_mon_config &config, int rcvbuf,
+                    const char *record_path, const char *metrics_address, const char *shm_path,
+                    const char *vmlinux, const char *serve_path, const char *subscribe_path)
+{
+    shm_stats_writer shm;
+    if (shm_path) {
+        if (!shm.open(shm_path))
+            return -1;
+        opts.shm = &shm;
+    }
+
+    metrics_page page;
+    metrics_server metrics(page);
+    if (metrics_address) {
+        if (!metrics.listen(metrics_address))
+            return -1;
+        opts.metrics = &page;
+    }
+
+    collector_client upstream;
+    if (subscribe_path) {
+        if (!upstream.connect(subscribe_path))
+            return -1;
+        if (opts.top_flows && !(upstream.flags() & COLLECTOR_PACKET_MODE))
+            fprintf(stderr, "the collector is not in packet mode, no flows will be seen\n");
+    }
+    collector_server collector;
+    if (serve_path && !collector.listen(serve_path))
+        return -1;
+
+    auto kcache_future = std::async(std::launch::async, [vmlinux]() {
+        if (!vmlinux) {
+            auto kcache = make_unique<kallsyms_cache>();
+            if (!kcache->stats().hidden)
+                return kcache;
+        }
+        return load_elf_symbols(kernel_layout::read(), vmlinux, true);
+    });
+    receiver_ctx rx_ctx(opts);
+
+    // a subscriber only parses what the collector forwards
+    std::unique_ptr<drop_mon_t> dropmon;
+    if (subscribe_path) {
+        dropmon = ::make_unique<drop_mon_t>(drop_mon_t::callback_t(), upstream.family());
+    } else {
+        dropmon = make_unique<drop_mon_t>();
+        if (dropmon->get_fd() == -1)
+            return -1;
+        if (rcvbuf > 0) {
+            const int effective = dropmon->set_rcvbuf(rcvbuf);
+            if (effective < rcvbuf)
+                fprintf(stderr, "receive buffer limited to %d bytes\n", effective);
+        }
+    }
+
+    capture_writer capture;
+    if (record_path && !capture.open(record_path, dropmon->get_family()))
+        return -1;
+    uint64_t rx_time = 0;
+    if (!subscribe_path && (record_path || serve_path)) {
+        dropmon->set_rx_hook([&capture, &collector, &rx_time, serve_path](const void *buf, size_t len) {
+            if (capture)
+                capture.write(buf, len);
+            if (serve_path)
+                collector.publish(rx_time, buf, len);
+        });
+    }
+
+    if (opts.stats)
+        dropmon->set_timing(&opts.stats->receive, &opts.stats->parse);
+
+    if (!subscribe_path) {
+        if (!dropmon->start(config))
+            return -1;
+        collector.set_session(dropmon->get_family(), dropmon->config());
+    }
+
+    std::thread output(&receiver_ctx::run, &rx_ctx, std::move(kcache_future));
+
+    // the netlink (or collector) socket first, then the exporter's and
+    // the subscribers' sockets
+    std::vector<pollfd> pfd;
+    while (!sigint && !rx_ctx.failed.load(std::memory_order_acquire)) {
+        pfd.clear();
+        pfd.push_back(pollfd{subscribe_path ? upstream.get_fd() : dropmon->get_fd(), POLLIN, 0});
+        const size_t metrics_at = pfd.size();
+        if (metrics_address)
+            metrics.add_pollfds(pfd);
+        const size_t collector_at = pfd.size();
+        if (serve_path)
+            collector.add_pollfds(pfd);
+        const auto mux = poll(pfd.data(), pfd.size(), 250);
+        if (mux == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            break;
+        }
+
+        if (pfd[0].revents) {
+            rx_time = monotonic_ns();
+            auto push = [&rx_ctx, &rx_time](const drop_points &points) { rx_ctx.push(rx_time, points); };
+            if (subscribe_path) {
+                // keeps the collector's receive times
+                auto forwarded = [&](uint64_t timestamp, unsigned char *buf, size_t len) {
+                    if (capture)
+                        capture.write(buf, len);
+                    rx_time = timestamp;
+                    dropmon->feed(buf, len, push);
+                };
+                if (!upstream.receive(forwarded)) {
+                    fprintf(stderr, "collector closed the connection\n");
+                    sigint = true;
+                }
+            } else if (!dropmon->try_rx(push)) {
+                sigint = true;
             }
+            // what the collector dropped for us was lost before we saw it
+            rx_ctx.overruns.store(dropmon->stats().overruns + upstream.lost(), std::memory_order_relaxed);
+            if (shm)
+                publish_receive_stats(shm, *dropmon, rx_ctx);
+            if (opts.stats)
+                opts.stats->set_receive(dropmon->stats(), rx_ctx.overruns.load(std::memory_order_relaxed));
         }
+        // also on timeout, to expire stalled connections
+        if (metrics_address)
+            metrics.handle(pfd.data() + metrics_at, collector_at - metrics_at);
+        if (serve_path)
+            collector.handle(pfd.data() + collector_at, pfd.size() - collector_at);
+    }
+
+    // NET_DM is only ours to stop if we started it
+    if (!subscribe_path)
+        dropmon->stop();
+    rx_ctx.stop();
+    output.join();
+    if (shm)
+        publish_receive_stats(shm, *dropmon, rx_ctx);
 
-        if (!kallsym.first)
-            printf("%*zu  %*p%*s", 3, count, 20, loc, 32,
-                   dwarf_sym_it == std::end(dwarf_cache) ||
-                   dwarf_sym_it->second.second.empty() ? "n/a" :
-                   dwarf_sym_it->second.second.c_str());
-        else
-            printf("%*zu  %*p%*s+%zu", 3, count, 20, loc,
-                   32, kallsym.first, kallsym.second);
+    print_stats(*dropmon, rx_ctx);
+    if (subscribe_path && upstream.lost())
+        fprintf(stderr, "%" PRIu64 " datagrams dropped by the collector, this subscriber fell behind\n",
+                upstream.lost());
+    if (serve_path)
+        fprintf(stderr, "served %" PRIu64 " subscribers, %" PRIu64 " datagrams dropped for slow subscribers\n",
+                collector.accepted(), collector.lost());
+    if (metrics_address)
+        fprintf(stderr, "served %" PRIu64 " metrics scrapes\n", metrics.scrapes());
+    if (capture) {
+        capture.close();
+        fprintf(stderr, "recorded %" PRIu64 " datagrams to %s%s\n", capture.records(), record_path,
+                capture.failed() ? " (write error, capture is incomplete)" : "");
+    }
+    return 0;
+}
 
-        if (dwarf_sym_it == std::end(dwarf_cache))
-            printf("%*s", 32, "n/a");
-        else
-            printf("%*s", 32, dwarf_sym_it->second.first.c_str());
-        printf("\n");
+// Feeds a capture through the normal parse/symbolize/print path. Symbols
+// come from the kallsyms snapshot in the capture and the symbol cache;
+// DWARF of the replaying machine would not match the captured kernel.
+static int run_replay(receiver_options opts, const char *path, bool realtime, const char *shm_path,
+                      const char *vmlinux)
+{
+    capture_reader reader;
+    if (!reader.open(path))
+        return -1;
+    shm_stats_writer shm;
+    if (shm_path) {
+        if (!shm.open(shm_path))
+            return -1;
+        opts.shm = &shm;
     }
 
-    std::map<uint64_t, std::pair<std::string, std::string> > dwarf_cache;
-    dwarf_lookup dwarf;
-    std::unique_ptr<kallsyms_cache> kcache;
-    bool dwarf_ok = dwarf;
-};
+    const auto layout = kernel_layout::parse(reader.layout(), reader.layout_size());
+    opts.layout = &layout;
+    // built up front: replay outruns a background load
+    std::promise<std::unique_ptr<kallsyms_cache>> kcache;
+    std::unique_ptr<kallsyms_cache> symbols;
+    if (!vmlinux)
+        symbols = make_unique<kallsyms_cache>(reader.kallsyms(), reader.kallsyms_size());
+    if (vmlinux || symbols->stats().hidden)
+        symbols = load_elf_symbols(layout, vmlinux, false);
+    kcache.set_value(std::move(symbols));
+    receiver_ctx rx_ctx(opts);
+
+    drop_mon_t dropmon(drop_mon_t::callback_t(), reader.family());
+    if (opts.stats)
+        dropmon.set_timing(nullptr, &opts.stats->parse);
+
+    std::thread output(&receiver_ctx::run, &rx_ctx, kcache.get_future());
+
+    // parse() rewrites headers in place and the mapping is read-only
+    std::vector<unsigned char> buf;
+    capture_record rec;
+    const unsigned char *payload;
+    const uint64_t replay_start = monotonic_ns();
+    while (!sigint && !rx_ctx.failed.load(std::memory_order_acquire) && reader.next(rec, payload)) {
+        if (realtime) {
+            const uint64_t due = replay_start + (rec.timestamp_ns - reader.start_ns());
+            const uint64_t now = monotonic_ns();
+            if (due > now)
+                std::this_thread::sleep_for(std::chrono::nanoseconds(due - now));
+        }
+        buf.assign(payload, payload + rec.len);
+        dropmon.feed(buf.data(), buf.size(), [&rx_ctx, &rec](const drop_points &points) {
+            // the output thread drains at its own pace; wait rather than drop
+            for (const auto p: points)
+                while (!rx_ctx.try_push(rec.timestamp_ns, reinterpret_cast<void *>(p.pc), p.count) && !sigint)
+                    std::this_thread::sleep_for(std::chrono::microseconds(100));
+            if (points.packet)
+                while (!rx_ctx.try_push(*points.packet) && !sigint)
+                    std::this_thread::sleep_for(std::chrono::microseconds(100));
+        });
+        if (shm)
+            publish_receive_stats(shm, dropmon, rx_ctx);
+        if (opts.stats)
+            opts.stats->set_receive(dropmon.stats(), 0);
+    }
+
+    rx_ctx.stop();
+    output.join();
+    if (shm)
+        publish_receive_stats(shm, dropmon, rx_ctx);
+
+    print_stats(dropmon, rx_ctx);
+    return 0;
+}
 
 int main(int argc, char *argv[])
 {
-    const char *debuginfo_path = nullptr;
+    receiver_options opts;
+    drop_filter filter;
+    std::unique_ptr<self_stats> stats;
+    const char *record_path = nullptr;
+    const char *replay_path = nullptr;
+    const char *metrics_address = nullptr;
+    const char *shm_path = nullptr;
+    const char *vmlinux = nullptr;
+    const char *serve_path = nullptr;
+    const char *subscribe_path = nullptr;
+    bool replay_realtime = false;
+    drop_mon_config config;
+    int rcvbuf = 4 * 1024 * 1024;
     if(argc > 1) {
         for(int i = 1; i < argc; i++) {
             if(strcmp(argv[i], "--help") == 0) {
-                printf("%s: [--debuginfo-path PATH] [--help]\n", argv[0]);
+                printf("%s: [--debuginfo-path PATH] [--interval DURATION] [--top N] [--top-flows N [--flow-capacity K]] [--rcvbuf BYTES] [--symbol-cache FILE] [--vmlinux FILE] [--include RULE] [--exclude RULE] [--format FORMAT] "
+                       "[--packet-mode [--trunc-len BYTES] [--queue-len N]] [--hw-drops] [--metrics ADDRESS [--quiet]] [--shm-stats FILE] [--stats] "
+                       "[--serve SOCKET | --subscribe SOCKET] [--record FILE | --replay FILE [--replay-realtime]] [--help]\n", argv[0]);
                 return 0;
             } else if(strcmp(argv[i], "--debuginfo-path") == 0 && argc >= (++i)) {
-                debuginfo_path = argv[i];
+                opts.debuginfo_path = argv[i];
+            } else if(strcmp(argv[i], "--interval") == 0 && i + 1 < argc) {
+                if (!parse_duration(argv[++i], opts.interval)) {
+                    fprintf(stderr, "invalid interval \"%s\"\n", argv[i]);
+                    return -1;
+                }
+            } else if(strcmp(argv[i], "--top") == 0 && i + 1 < argc) {
+                opts.top_n = std::strtoul(argv[++i], nullptr, 0);
+                if (!opts.top_n) {
+                    fprintf(stderr, "invalid top count \"%s\"\n", argv[i]);
+                    return -1;
+                }
+            } else if(strcmp(argv[i], "--top-flows") == 0 && i + 1 < argc) {
+                opts.top_flows = std::strtoul(argv[++i], nullptr, 0);
+                if (!opts.top_flows) {
+                    fprintf(stderr, "invalid top flow count \"%s\"\n", argv[i]);
+                    return -1;
+                }
+                // flows come from the packet headers
+                config.packet_mode = true;
+            } else if(strcmp(argv[i], "--flow-capacity") == 0 && i + 1 < argc) {
+                opts.flow_capacity = std::strtoul(argv[++i], nullptr, 0);
+                if (!opts.flow_capacity) {
+                    fprintf(stderr, "invalid flow capacity \"%s\"\n", argv[i]);
+                    return -1;
+                }
+            } else if(strcmp(argv[i], "--rcvbuf") == 0 && i + 1 < argc) {
+                char *end;
+                const long bytes = std::strtol(argv[++i], &end, 0);
+                if (end == argv[i] || *end || bytes <= 0 || bytes > INT_MAX) {
+                    fprintf(stderr, "invalid receive buffer size \"%s\"\n", argv[i]);
+                    return -1;
+                }
+                rcvbuf = bytes;
+            } else if(strcmp(argv[i], "--symbol-cache") == 0 && i + 1 < argc) {
+                opts.symcache_path = argv[++i];
+            } else if(strcmp(argv[i], "--vmlinux") == 0 && i + 1 < argc) {
+                vmlinux = argv[++i];
+            } else if((strcmp(argv[i], "--include") == 0 || strcmp(argv[i], "--exclude") == 0) && i + 1 < argc) {
+                const bool include = strcmp(argv[i], "--include") == 0;
+                if (!filter.add(include, argv[++i]))
+                    return -1;
+                opts.filter = &filter;
+            } else if(strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+                if (!parse_output_format(argv[++i], opts.format)) {
+                    fprintf(stderr, "invalid format \"%s\", expected table, ndjson, csv or binary\n", argv[i]);
+                    return -1;
+                }
+            } else if(strcmp(argv[i], "--packet-mode") == 0) {
+                config.packet_mode = true;
+            } else if(strcmp(argv[i], "--trunc-len") == 0 && i + 1 < argc) {
+                config.trunc_len = std::strtoul(argv[++i], nullptr, 0);
+            } else if(strcmp(argv[i], "--queue-len") == 0 && i + 1 < argc) {
+                config.queue_len = std::strtoul(argv[++i], nullptr, 0);
+            } else if(strcmp(argv[i], "--hw-drops") == 0) {
+                config.hw_drops = true;
+            } else if(strcmp(argv[i], "--metrics") == 0 && i + 1 < argc) {
+                metrics_address = argv[++i];
+            } else if(strcmp(argv[i], "--shm-stats") == 0 && i + 1 < argc) {
+                shm_path = argv[++i];
+            } else if(strcmp(argv[i], "--stats") == 0) {
+                if (!stats)
+                    stats = make_unique<self_stats>();
+                opts.stats = stats.get();
+            } else if(strcmp(argv[i], "--quiet") == 0) {
+                opts.quiet = true;
+            } else if(strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+                serve_path = argv[++i];
+            } else if(strcmp(argv[i], "--subscribe") == 0 && i + 1 < argc) {
+                subscribe_path = argv[++i];
+            } else if(strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+                record_path = argv[++i];
+            } else if(strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+                replay_path = argv[++i];
+            } else if(strcmp(argv[i], "--replay-realtime") == 0) {
+                replay_realtime = true;
             }
         }
     }
+    if (record_path && replay_path) {
+        fprintf(stderr, "--record and --replay are mutually exclusive\n");
+        return -1;
+    }
+    if (metrics_address && replay_path) {
+        fprintf(stderr, "--metrics is only available for live monitoring\n");
+        return -1;
+    }
+    if (serve_path && subscribe_path) {
+        fprintf(stderr, "--serve and --subscribe are mutually exclusive\n");
+        return -1;
+    }
+    if ((serve_path || subscribe_path) && replay_path) {
+        fprintf(stderr, "--serve and --subscribe are only available for live monitoring\n");
+        return -1;
+    }
+    // only the PC and headers are used, keep packet copies small unless asked otherwise
+    if (config.packet_mode && !config.trunc_len)
+        config.trunc_len = 128;
+    if (opts.interval.count() && !opts.top_n)
+        opts.top_n = 20;
+    else if ((opts.top_n || opts.top_flows) && !opts.interval.count())
+        opts.interval = std::chrono::seconds(1);
     struct sigaction sa;
     sigemptyset(&sa.sa_mask);
     sa.sa_handler = sighandler;
@@ -85,41 +457,8 @@ int main(int argc, char *argv[])
     if (sigaction(SIGINT, &sa, NULL) == -1)
         perror("sigaction");
 
-    auto kcache_future = std::async(std::launch::async, []() { return make_unique<kallsyms_cache>(); });
-    receiver_ctx rx_ctx(debuginfo_path);
-
-    drop_mon_t dropmon(std::bind(&receiver_ctx::rx_callback, &rx_ctx, std::placeholders::_1, std::placeholders::_2));
-    if (dropmon.get_fd() == -1)
-        return -1;
-    if (!dropmon.start())
-        return -1;
-    pollfd pfd[1];
-    pfd[0].events = POLLIN;
-    pfd[0].fd = dropmon.get_fd();
-    printf("%*s%*s%*s%*s\n", 3, "#", 20, "ip", 32, "sym+off", 32, "location");
-    while (!sigint) {
-        const auto mux = poll(pfd, 1, 250);
-        if (mux == 0) {
-            continue;
-        } else if (mux == -1) {
-            if (errno == EINTR)
-                continue;
-            perror("poll");
-            break;
-        }
-
-        if (!rx_ctx.kcache && kcache_future.valid()
-            && kcache_future.wait_for(std::chrono::milliseconds(0)) == std::future_status::ready) {
-            rx_ctx.kcache = std::move(kcache_future.get());
-            if ((!rx_ctx.kcache || !*rx_ctx.kcache) && !rx_ctx.dwarf) {
-                fprintf(stderr, "kallsyms and dwarf lookup not available. Terminating.");
-                break;
-            }
-        }
-
-        if (!dropmon.try_rx())
-            sigint = true;
-    }
-
-    dropmon.stop();
+    if (replay_path)
+        return run_replay(opts, replay_path, replay_realtime, shm_path, vmlinux);
+    return run_live(opts, config, rcvbuf, record_path, metrics_address, shm_path, vmlinux, serve_path,
+                    subscribe_path);
 }
@@ -0,0 +1,116 @@
+#include "shm_stats.hh"
+
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+
+#include <signal.h>
+
+#include "common.hh"
+
+static void usage(const char *comm)
+{
+    fprintf(stderr, "USAGE:\n"
+            "  %s [-i SECONDS] [-n SITES] [FILE]\n"
+            "print the counters drop_monitor --shm-stats FILE publishes (default %s)\n"
+            "options:\n"
+            "  -i SECONDS     repeat, printing what changed in each interval\n"
+            "  -n SITES       sites listed, busiest first (default 20)\n", comm, "/dev/shm/drop_monitor");
+}
+
+static void print(const shm_stats_reader::snapshot &cur, const shm_stats_reader::snapshot *prev, size_t top)
+{
+    const auto &r = cur.receive;
+    const shm_stats_receive zero = {};
+    const auto &p = prev ? prev->receive : zero;
+    printf("--- %" PRIu64 " drop points in %" PRIu64 " alerts, %" PRIu64 " datagrams, %" PRIu64 " bytes, "
+           "%" PRIu64 " packets, %" PRIu64 " hw drops, lost %" PRIu64 " in socket, %" PRIu64 " in queue%s ---\n",
+           r.drop_points - p.drop_points, r.alerts - p.alerts, r.datagrams - p.datagrams, r.bytes - p.bytes,
+           r.packets - p.packets, r.hw_drops - p.hw_drops, r.overruns - p.overruns,
+           r.queue_lost - p.queue_lost, cur.writer_pid ? "" : " (writer exited)");
+
+    // sites only ever grow, so the previous snapshot is a prefix
+    std::vector<std::pair<uint64_t, size_t>> order;
+    order.reserve(cur.sites.size());
+    for (size_t i = 0; i < cur.sites.size(); i++) {
+        const uint64_t before = prev && i < prev->sites.size() ? prev->sites[i].count : 0;
+        if (cur.sites[i].count != before)
+            order.emplace_back(cur.sites[i].count - before, i);
+    }
+    const size_t n = std::min(top, order.size());
+    std::partial_sort(order.begin(), order.begin() + n, order.end(),
+                      [](const std::pair<uint64_t, size_t> &a, const std::pair<uint64_t, size_t> &b) {
+                          return a.first > b.first;
+                      });
+    if (n)
+        printf("%10s %20s %40s %s\n", "#", "ip", "sym+off", "location");
+    for (size_t i = 0; i < n; i++) {
+        const auto &site = cur.sites[order[i].second];
+        printf("%10" PRIu64 " %#20" PRIx64 " %40s %s%s%s\n", order[i].first, site.pc,
+               *site.symbol ? site.symbol : "n/a", *site.location ? site.location : "n/a",
+               *site.function ? " in " : "", site.function);
+    }
+    if (cur.sites_full)
+        printf("%" PRIu64 " drops at sites beyond the region's capacity\n", cur.sites_full);
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *path = "/dev/shm/drop_monitor";
+    double interval = 0;
+    size_t top = 20;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
+            interval = strtod(argv[++i], nullptr);
+            if (interval <= 0) {
+                fprintf(stderr, "invalid interval \"%s\"\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            top = strtoul(argv[++i], nullptr, 0);
+        } else if (argv[i][0] == '-') {
+            usage(argv[0]);
+            return strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0 ? 0 : 1;
+        } else {
+            path = argv[i];
+        }
+    }
+
+    auto reader = make_unique<shm_stats_reader>();
+    if (!reader->open(path))
+        return 1;
+    shm_stats_reader::snapshot prev, cur;
+    if (!reader->read(cur)) {
+        fprintf(stderr, "%s: writer stopped in the middle of an update\n", path);
+        return 1;
+    }
+    if (interval <= 0) {
+        print(cur, nullptr, top);
+        return 0;
+    }
+
+    for (;;) {
+        std::this_thread::sleep_for(std::chrono::duration<double>(interval));
+        prev = std::move(cur);
+        const bool gone = !prev.writer_pid || kill(prev.writer_pid, 0) == -1;
+        if (gone) {
+            // a new drop_monitor replaces the file; counters start over
+            auto next = make_unique<shm_stats_reader>();
+            if (next->open(path) && next->read(cur) && cur.start_ns != prev.start_ns) {
+                reader = std::move(next);
+                print(cur, nullptr, top);
+                continue;
+            }
+        }
+        if (!reader->read(cur)) {
+            fprintf(stderr, "%s: writer stopped in the middle of an update\n", path);
+            return 1;
+        }
+        print(cur, &prev, top);
+    }
+}
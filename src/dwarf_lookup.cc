@@ -2,10 +2,14 @@
 
 #include <dwarf.h>
 #include <elfutils/libdwfl.h>
+#include <algorithm>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <iterator>
+#include <map>
 #include <string>
+#include <vector>
 
 #include "common.hh"
 
@@ -36,6 +40,25 @@ struct dwarf_lookup::dwarf_lookup_impl {
             fprintf(stderr, "dwfl_linux_kernel_report_modules FAILED\n");
     }
 
+    explicit dwarf_lookup_impl(int pid)
+        : debuginfo_path(nullptr), pid(pid)
+    {
+        memset(&callbacks, 0, sizeof(callbacks));
+        callbacks.find_debuginfo = dwfl_standard_find_debuginfo;
+        callbacks.debuginfo_path = const_cast<char **>(&debuginfo_path);
+        callbacks.find_elf = dwfl_linux_proc_find_elf;
+
+        dwfl = dwfl_begin(&callbacks);
+        if (!dwfl) {
+            fprintf(stderr, "dwfl_begin FAILED\n");
+            return;
+        }
+        if (!report_process()) {
+            dwfl_end(dwfl);
+            dwfl = nullptr;
+        }
+    }
+
     ~dwarf_lookup_impl()
     {
         free((void *)debuginfo_path);
@@ -53,98 +76,318 @@ struct dwarf_lookup::dwarf_lookup_impl {
             return std::make_pair(std::string(), std::string());
         }
 
-        auto func = parse_scopes(mod, addr);
-        if (!func.second.empty())
-            return std::move(func);
-        const char *sym = dwfl_module_addrname(mod, addr);
-        if (!sym) {
-            fprintf(stderr, "dwfl_module_addrname FAILED\n");
-            return std::make_pair(std::string(), std::string());
+        std::string location, function;
+        std::vector<dwarf_frame> chain;
+        if (lookup(mod, addr, chain)) {
+            const dwarf_frame &inner = chain.front();
+            location = inner.file;
+            if (inner.line) {
+                location.append(":");
+                location.append(std::to_string(inner.line));
+                if (inner.column) {
+                    location.append(":");
+                    location.append(std::to_string(inner.column));
+                }
+            }
+            for (auto it = chain.rbegin(); it != chain.rend(); ++it) {
+                if (it->function.empty())
+                    continue;
+                if (!function.empty())
+                    function.append(" -> ");
+                function.append(it->function);
+            }
         }
-        return std::make_pair(std::string(), sym);
+        if (function.empty()) {
+            const char *sym = dwfl_module_addrname(mod, addr);
+            if (!sym) {
+                fprintf(stderr, "dwfl_module_addrname FAILED\n");
+                return std::make_pair(std::string(), std::string());
+            }
+            function = sym;
+        }
+        return std::make_pair(std::move(location), std::move(function));
     }
 
-private:
-    static std::pair<std::string, std::string> parse_scopes(Dwfl_Module *mod, uint64_t addr)
+    bool lookup(uint64_t addr, std::vector<dwarf_frame> &chain)
     {
-        Dwarf_Addr bias = 0;
-        Dwarf_Die *cudie = dwfl_module_addrdie(mod, addr, &bias);
-        Dwarf_Die *scopes;
-        int nscopes = dwarf_getscopes(cudie, addr - bias, &scopes);
-        if (nscopes <= 0) {
-            fprintf(stderr, "dwarf_getscopes FAILED %d\n", nscopes);
+        Dwfl_Module *mod = dwfl_addrmodule(dwfl, addr);
+        return mod && lookup(mod, addr, chain);
+    }
 
-            // int nscopes_die = dwarf_getscopes_die(cudie, &scopes);
-            // fprintf(stderr, "dwarf_getscopes_die -> %d\n", nscopes_die);
+    size_t preload(uint64_t addr)
+    {
+        Dwfl_Module *mod = dwfl_addrmodule(dwfl, addr);
+        Dwarf_Addr bias;
+        return mod && dwfl_module_getdwarf(mod, &bias) ? 1 : 0;
+    }
 
-            return std::make_pair(std::string(), std::string());
-        }
+    size_t preload(const std::function<bool(const char *)> &filter)
+    {
+        struct selection {
+            const std::function<bool(const char *)> &filter;
+            std::vector<Dwfl_Module *> mods;
+        } sel{filter, {}};
+        dwfl_getmodules(dwfl, [](Dwfl_Module *mod, void **, const char *name, Dwarf_Addr, void *arg) {
+            auto sel = static_cast<selection *>(arg);
+            if (sel->filter(name))
+                sel->mods.push_back(mod);
+            return static_cast<int>(DWARF_CB_OK);
+        }, &sel, 0);
 
-        Dwfl_Line *line = dwfl_module_getsrc(mod, addr);
-        if (!line) {
-            fprintf(stderr, "dwfl_module_getsrc FAILED\n");
-            return std::make_pair(std::string(), std::string());
+        size_t loaded = 0;
+        for (auto mod: sel.mods) {
+            Dwarf_Addr bias;
+            if (dwfl_module_getdwarf(mod, &bias))
+                loaded++;
         }
+        return loaded;
+    }
 
-        std::string cu_result;
-        cu_result.reserve(512);
-        int lineno;
-        int linecol;
-        const char *src_file = dwfl_lineinfo(line, &addr, &lineno, &linecol, nullptr, nullptr);
-        if (src_file) {
-            cu_result.assign(src_file);
-            cu_result.append(":");
-            cu_result.append(std::to_string(lineno));
-            if (linecol) {
-                cu_result.append(":");
-                cu_result.append(std::to_string(linecol));
-            }
+    bool report_modules()
+    {
+        if (pid != -1) {
+            cus.clear();
+            return report_process();
         }
+        // modules not reported again before dwfl_report_end() are removed;
+        // those reported with the same name and addresses are kept as they are
+        dwfl_report_begin(dwfl);
+        bool ok = dwfl_linux_kernel_report_kernel(dwfl) == 0;
+        if (!ok)
+            fprintf(stderr, "dwfl_linux_kernel_report_kernel FAILED\n");
+        if (dwfl_linux_kernel_report_modules(dwfl) != 0) {
+            fprintf(stderr, "dwfl_linux_kernel_report_modules FAILED\n");
+            ok = false;
+        }
+        dwfl_report_end(dwfl, nullptr, nullptr);
+        // indexes point into the debuginfo of modules that may be gone now
+        cus.clear();
+        return ok;
+    }
+
+private:
+    static const uint32_t no_scope = ~0u;
+
+    bool report_process()
+    {
+        dwfl_report_begin(dwfl);
+        const bool ok = dwfl_linux_proc_report(dwfl, pid) == 0;
+        if (!ok)
+            fprintf(stderr, "dwfl_linux_proc_report FAILED\n");
+        dwfl_report_end(dwfl, nullptr, nullptr);
+        return ok;
+    }
 
-        std::string func_result;
-        func_result.reserve(512);
-        for (int i = nscopes - 1; i >= 0; i--) {
-            switch (dwarf_tag(&scopes[i])) {
+    // A row of the CU's line table. Addresses are DWARF addresses (no bias).
+    struct line_row {
+        Dwarf_Addr addr;
+        const char *file;       // nullptr for the end of a sequence
+        int line;
+        int column;
+    };
+
+    // A DW_TAG_subprogram or DW_TAG_inlined_subroutine with code.
+    struct scope {
+        const char *name;
+        uint32_t parent;        // scope this one is inlined into, no_scope for a subprogram
+        const char *call_file;  // call site in parent
+        int call_line;
+        int call_column;
+    };
+
+    // Innermost scope from addr up to the next run.
+    struct scope_run {
+        Dwarf_Addr addr;
+        uint32_t scope;
+    };
+
+    // Line table and scope ranges of one CU, built on the first lookup in
+    // it. Strings point into the module's debuginfo.
+    struct cu_index {
+        const char *name;
+        std::vector<line_row> lines;
+        std::vector<scope> scopes;
+        std::vector<scope_run> runs;
+    };
+
+    struct scope_range {
+        Dwarf_Addr low;
+        Dwarf_Addr high;
+        uint32_t depth;
+        uint32_t scope;
+    };
+
+    static int attr_int(Dwarf_Die *die, unsigned int name)
+    {
+        Dwarf_Attribute attr;
+        Dwarf_Word value;
+        return dwarf_attr(die, name, &attr) && dwarf_formudata(&attr, &value) == 0 ? static_cast<int>(value) : 0;
+    }
+
+    // Collects the function scopes below die. Only DIEs that may contain
+    // code are descended into. File numbers start at first_file: 1 before
+    // DWARF 5, 0 (the primary source file) since.
+    static void collect_scopes(Dwarf_Die *die, uint32_t parent, uint32_t depth, Dwarf_Files *files,
+                               size_t nfiles, int first_file, cu_index &idx, std::vector<scope_range> &ranges)
+    {
+        Dwarf_Die child;
+        if (dwarf_child(die, &child) != 0)
+            return;
+        do {
+            uint32_t inner = parent;
+            switch (dwarf_tag(&child)) {
             case DW_TAG_subprogram:
             case DW_TAG_inlined_subroutine: {
-                const char *name = dwarf_diename(&scopes[i]);
-                name = name ? name : "??";
-                func_result.append(name);
+                const bool inlined = dwarf_tag(&child) == DW_TAG_inlined_subroutine;
+                const size_t first = ranges.size();
+                Dwarf_Addr base, low, high;
+                for (ptrdiff_t off = 0; (off = dwarf_ranges(&child, off, &base, &low, &high)) > 0;)
+                    ranges.push_back(scope_range{low, high, depth, static_cast<uint32_t>(idx.scopes.size())});
+                if (ranges.size() == first)
+                    break;  // declaration or abstract instance
+                scope sc{dwarf_diename(&child), no_scope, nullptr, 0, 0};
+                if (inlined) {
+                    sc.parent = parent;
+                    const int file = dwarf_hasattr(&child, DW_AT_call_file) ? attr_int(&child, DW_AT_call_file) : -1;
+                    sc.call_file = file >= first_file && static_cast<size_t>(file) < nfiles
+                        ? dwarf_filesrc(files, file, nullptr, nullptr) : nullptr;
+                    sc.call_line = attr_int(&child, DW_AT_call_line);
+                    sc.call_column = attr_int(&child, DW_AT_call_column);
+                }
+                inner = idx.scopes.size();
+                idx.scopes.push_back(sc);
                 break;
             }
-            case DW_TAG_compile_unit: {
-                if (!cu_result.empty()) {
-                    // got compilation unit already from lineinfo lookup
-                    // fprintf(stderr, "ignoring CU-tag\n");
-                    break;
-                }
-                const char *name = dwarf_diename(&scopes[i]);
-                if (!name)
-                    break;
-                cu_result.assign(name);
-                cu_result.append(":");
-                cu_result.append(std::to_string(lineno));
-                if (linecol) {
-                    cu_result.append(":");
-                    cu_result.append(std::to_string(linecol));
-                }
+            case DW_TAG_lexical_block:
+            case DW_TAG_namespace:
                 break;
+            default:
+                continue;
+            }
+            collect_scopes(&child, inner, depth + 1, files, nfiles, first_file, idx, ranges);
+        } while (dwarf_siblingof(&child, &child) == 0);
+    }
+
+    static std::unique_ptr<cu_index> build_index(Dwarf_Die *cudie)
+    {
+        auto idx = make_unique<cu_index>();
+        idx->name = dwarf_diename(cudie);
+
+        // sorted by address, end-of-sequence rows before others at the same address
+        Dwarf_Lines *lines;
+        size_t nlines;
+        if (dwarf_getsrclines(cudie, &lines, &nlines) == 0) {
+            idx->lines.reserve(nlines);
+            for (size_t i = 0; i < nlines; i++) {
+                Dwarf_Line *line = dwarf_onesrcline(lines, i);
+                line_row row{0, nullptr, 0, 0};
+                bool end = false;
+                dwarf_lineaddr(line, &row.addr);
+                dwarf_lineendsequence(line, &end);
+                if (!end) {
+                    row.file = dwarf_linesrc(line, nullptr, nullptr);
+                    dwarf_lineno(line, &row.line);
+                    dwarf_linecol(line, &row.column);
+                }
+                idx->lines.push_back(row);
             }
         }
+
+        Dwarf_Files *files = nullptr;
+        size_t nfiles = 0;
+        dwarf_getsrcfiles(cudie, &files, &nfiles);
+        Dwarf_Half version = 0;
+        dwarf_cu_info(cudie, &version, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr);
+        std::vector<scope_range> ranges;
+        collect_scopes(cudie, no_scope, 0, files, nfiles, version >= 5 ? 0 : 1, *idx, ranges);
+
+        // paint the ranges outermost first, so every address ends up with
+        // the innermost scope covering it
+        std::stable_sort(ranges.begin(), ranges.end(),
+                         [](const scope_range &a, const scope_range &b) { return a.depth < b.depth; });
+        std::map<Dwarf_Addr, uint32_t> painted;
+        for (const auto &r: ranges) {
+            if (r.low >= r.high)
+                continue;
+            auto next = painted.upper_bound(r.high);
+            const uint32_t after = next == painted.begin() ? no_scope : std::prev(next)->second;
+            painted.erase(painted.lower_bound(r.low), next);
+            painted[r.low] = r.scope;
+            painted[r.high] = after;
         }
-        free(scopes);
+        for (const auto &p: painted)
+            if (idx->runs.empty() || idx->runs.back().scope != p.second)
+                idx->runs.push_back(scope_run{p.first, p.second});
+        return idx;
+    }
+
+    bool lookup(Dwfl_Module *mod, uint64_t addr, std::vector<dwarf_frame> &chain)
+    {
+        Dwarf_Addr bias = 0;
+        Dwarf_Die *cudie = dwfl_module_addrdie(mod, addr, &bias);
+        if (!cudie)
+            return false;
+        auto &idx = cus[std::make_pair(mod, dwarf_dieoffset(cudie))];
+        if (!idx)
+            idx = build_index(cudie);
+        const Dwarf_Addr pc = addr - bias;
+
+        const char *file = idx->name;
+        int line = 0, column = 0;
+        auto row = std::upper_bound(idx->lines.begin(), idx->lines.end(), pc,
+                                    [](Dwarf_Addr a, const line_row &r) { return a < r.addr; });
+        if (row != idx->lines.begin() && std::prev(row)->file) {
+            --row;
+            file = row->file;
+            line = row->line;
+            column = row->column;
+        }
+
+        uint32_t s = no_scope;
+        auto run = std::upper_bound(idx->runs.begin(), idx->runs.end(), pc,
+                                    [](Dwarf_Addr a, const scope_run &r) { return a < r.addr; });
+        if (run != idx->runs.begin())
+            s = std::prev(run)->scope;
 
-        return std::make_pair(std::move(cu_result), std::move(func_result));
+        chain.clear();
+        do {
+            dwarf_frame frame;
+            frame.file = file ? file : "";
+            frame.line = line;
+            frame.column = column;
+            if (s != no_scope) {
+                const scope &sc = idx->scopes[s];
+                frame.function = sc.name ? sc.name : "??";
+                file = sc.call_file;
+                line = sc.call_line;
+                column = sc.call_column;
+                s = sc.parent;
+            }
+            chain.push_back(std::move(frame));
+        } while (s != no_scope);
+        return !chain.front().file.empty() || !chain.front().function.empty();
     }
+
     const char *debuginfo_path;
+    int pid = -1;                   // -1: the kernel
     Dwfl_Callbacks callbacks;
     Dwfl *dwfl;
+    std::map<std::pair<Dwfl_Module *, Dwarf_Off>, std::unique_ptr<cu_index>> cus;
 };
 
 dwarf_lookup::dwarf_lookup(const char *debuginfo_path)
     : pimpl(make_unique<dwarf_lookup_impl>(debuginfo_path))
 {}
 
+dwarf_lookup::dwarf_lookup(std::unique_ptr<dwarf_lookup_impl> impl)
+    : pimpl(std::move(impl))
+{}
+
+std::unique_ptr<dwarf_lookup> dwarf_lookup::for_process(int pid)
+{
+    return std::unique_ptr<dwarf_lookup>(new dwarf_lookup(make_unique<dwarf_lookup_impl>(pid)));
+}
+
 dwarf_lookup::~dwarf_lookup() {}
 dwarf_lookup::operator bool() const { return *pimpl; }
 
@@ -152,3 +395,94 @@ std::pair<std::string, std::string> dwarf_lookup::lookup(uint64_t addr)
 {
     return pimpl->lookup(addr);
 }
+
+bool dwarf_lookup::lookup(uint64_t addr, std::vector<dwarf_frame> &chain)
+{
+    return *pimpl && pimpl->lookup(addr, chain);
+}
+
+size_t dwarf_lookup::preload(uint64_t addr)
+{
+    return *pimpl ? pimpl->preload(addr) : 0;
+}
+
+size_t dwarf_lookup::preload(const std::function<bool(const char *)> &filter)
+{
+    return *pimpl ? pimpl->preload(filter) : 0;
+}
+
+bool dwarf_lookup::report_modules()
+{
+    return *pimpl && pimpl->report_modules();
+}
+
+#ifdef TEST_DRIVER
+#include <cassert>
+#include <cinttypes>
+#include <unistd.h>
+
+// Build with -O2 -g: inner() and middle() are inlined into outer(), so the
+// return address of caller_pc() sits in a two-deep inline chain.
+__attribute__((noinline)) static void *caller_pc()
+{
+    return __builtin_return_address(0);
+}
+
+static const int inner_line = __LINE__ + 3;
+__attribute__((always_inline)) static inline void *inner()
+{
+    void *pc = caller_pc();
+    asm volatile("" ::: "memory");  // not a tail call
+    return pc;
+}
+
+static const int middle_line = __LINE__ + 3;
+__attribute__((always_inline)) static inline void *middle()
+{
+    return inner();
+}
+
+static const int outer_line = __LINE__ + 3;
+__attribute__((noinline)) static void *outer()
+{
+    return middle();
+}
+
+static bool ends_with(const std::string &s, const char *suffix)
+{
+    const size_t n = strlen(suffix);
+    return s.size() >= n && s.compare(s.size() - n, n, suffix) == 0;
+}
+
+int main()
+{
+    auto dwarf = dwarf_lookup::for_process(getpid());
+    assert(dwarf && *dwarf);
+
+    // the call instruction, not the one after it
+    const uint64_t pc = reinterpret_cast<uint64_t>(outer()) - 1;
+    std::vector<dwarf_frame> chain;
+    if (!dwarf->lookup(pc, chain) || chain.size() != 3) {
+        fprintf(stderr, "0x%" PRIx64 ": expected 3 frames, got %zu\n", pc, chain.size());
+        return 1;
+    }
+    const char *functions[] = { "inner", "middle", "outer" };
+    const int lines[] = { inner_line, middle_line, outer_line };
+    for (size_t i = 0; i < chain.size(); i++) {
+        const dwarf_frame &f = chain[i];
+        if (f.function != functions[i] || !ends_with(f.file, "dwarf_lookup.cc") || f.line != lines[i]) {
+            fprintf(stderr, "frame %zu: expected %s at dwarf_lookup.cc:%d, got %s at %s:%d\n",
+                    i, functions[i], lines[i], f.function.c_str(), f.file.c_str(), f.line);
+            return 1;
+        }
+    }
+
+    const auto r = dwarf->lookup(pc);
+    if (r.second != "outer -> middle -> inner") {
+        fprintf(stderr, "expected outer -> middle -> inner, got %s\n", r.second.c_str());
+        return 1;
+    }
+    printf("%s %s\n", r.first.c_str(), r.second.c_str());
+    return 0;
+}
+#endif
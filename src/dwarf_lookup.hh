@@ -1,15 +1,45 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
+#include <functional>
 #include <memory>
 #include <string>
+#include <vector>
+
+// One function of an inline chain.
+struct dwarf_frame {
+    std::string function;   // "??" for an unnamed DIE, empty outside any function
+    std::string file;       // position in function: the address itself for the
+    int line = 0;           // innermost frame, the call site of the frame inlined
+    int column = 0;         // into it for the others; 0 if unknown
+};
 
 struct dwarf_lookup {
     dwarf_lookup(const char *debuginfo_path = nullptr);
+    // The ELF files mapped into process pid instead of the kernel (tests).
+    static std::unique_ptr<dwarf_lookup> for_process(int pid);
     ~dwarf_lookup();
     operator bool() const;
 
+    // (file:line[:column], function). function is the inline chain from the
+    // outermost function in, joined by " -> ", or the ELF symbol if addr is
+    // in no function DIE.
     std::pair<std::string, std::string> lookup(uint64_t addr);
+    // Innermost frame first. False if addr has no DWARF.
+    bool lookup(uint64_t addr, std::vector<dwarf_frame> &chain);
+
+    // libdwfl reads a module's debuginfo on its first lookup. These load it
+    // up front: the module containing addr, or every module name accepted
+    // by filter ("kernel" for vmlinux). Return the number of modules loaded.
+    size_t preload(uint64_t addr);
+    size_t preload(const std::function<bool(const char *module)> &filter);
+
+    // Reports the kernel's modules again after /proc/modules changed.
+    // Unchanged modules keep their loaded debuginfo.
+    bool report_modules();
 private:
     struct dwarf_lookup_impl;
+    explicit dwarf_lookup(std::unique_ptr<dwarf_lookup_impl> impl);
     std::unique_ptr<dwarf_lookup_impl> pimpl;
 };
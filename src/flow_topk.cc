@@ -0,0 +1,214 @@
+#include "flow_topk.hh"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+static_assert(sizeof(flow_key) % sizeof(uint64_t) == 0, "flow_key is hashed word by word");
+
+bool flow_key::operator==(const flow_key &rhs) const
+{
+    return memcmp(this, &rhs, sizeof(*this)) == 0;
+}
+
+uint64_t flow_key::hash() const
+{
+    uint64_t words[sizeof(flow_key) / sizeof(uint64_t)];
+    memcpy(words, this, sizeof(words));
+    uint64_t h = 0;
+    for (const auto w: words)
+        h = (h ^ w) * 0x9e3779b97f4a7c15ull + (h >> 29);
+    return h ^ (h >> 32);
+}
+
+int flow_key::format(char *buf, size_t len) const
+{
+    char proto[8];
+    switch (l4proto) {
+    case IPPROTO_TCP: strcpy(proto, "tcp"); break;
+    case IPPROTO_UDP: strcpy(proto, "udp"); break;
+    case IPPROTO_ICMP: strcpy(proto, "icmp"); break;
+    case IPPROTO_ICMPV6: strcpy(proto, "icmp6"); break;
+    case IPPROTO_SCTP: strcpy(proto, "sctp"); break;
+    default: snprintf(proto, sizeof(proto), "%u", l4proto); break;
+    }
+    const int af = family == 6 ? AF_INET6 : AF_INET;
+    char s[INET6_ADDRSTRLEN], d[INET6_ADDRSTRLEN];
+    inet_ntop(af, src, s, sizeof(s));
+    inet_ntop(af, dst, d, sizeof(d));
+    if (!sport && !dport)
+        return snprintf(buf, len, "%s %s > %s", proto, s, d);
+    if (family == 6)
+        return snprintf(buf, len, "%s [%s]:%u > [%s]:%u", proto, s, sport, d, dport);
+    return snprintf(buf, len, "%s %s:%u > %s:%u", proto, s, sport, d, dport);
+}
+
+static inline uint16_t be16(const unsigned char *p)
+{
+    return p[0] << 8 | p[1];
+}
+
+static bool has_ports(uint8_t l4proto)
+{
+    return l4proto == IPPROTO_TCP || l4proto == IPPROTO_UDP || l4proto == IPPROTO_SCTP
+        || l4proto == IPPROTO_UDPLITE;
+}
+
+bool parse_flow(const drop_packet &pkt, flow_key &out)
+{
+    memset(&out, 0, sizeof(out));
+    out.pc = pkt.pc;
+    const unsigned char *p = pkt.payload;
+    size_t len = pkt.payload_len;
+    if (!p)
+        return false;
+
+    // MAC header if the ethertype (behind VLAN tags) is IP
+    if (len >= 14) {
+        size_t off = 12;
+        uint16_t type = be16(p + off);
+        while ((type == 0x8100 || type == 0x88a8) && len >= off + 6) {
+            off += 4;
+            type = be16(p + off);
+        }
+        if ((type == 0x0800 || type == 0x86dd) && (type == pkt.proto || be16(p + 12) == pkt.proto)) {
+            p += off + 2;
+            len -= off + 2;
+        }
+    }
+
+    size_t l4 = 0;
+    bool first_fragment = true;
+    if (len >= 20 && p[0] >> 4 == 4) {
+        const size_t ihl = (p[0] & 0xf) * 4;
+        if (ihl < 20)
+            return false;
+        out.family = 4;
+        out.l4proto = p[9];
+        memcpy(out.src, p + 12, 4);
+        memcpy(out.dst, p + 16, 4);
+        first_fragment = (be16(p + 6) & 0x1fff) == 0;
+        l4 = ihl;
+    } else if (len >= 40 && p[0] >> 4 == 6) {
+        out.family = 6;
+        memcpy(out.src, p + 8, 16);
+        memcpy(out.dst, p + 24, 16);
+        uint8_t next = p[6];
+        l4 = 40;
+        // extension headers, bounded
+        for (int i = 0; i < 8 && l4 + 8 <= len; i++) {
+            if (next == IPPROTO_HOPOPTS || next == IPPROTO_ROUTING || next == IPPROTO_DSTOPTS) {
+                next = p[l4];
+                l4 += (p[l4 + 1] + 1) * 8;
+            } else if (next == IPPROTO_FRAGMENT) {
+                first_fragment = (be16(p + l4 + 2) & 0xfff8) == 0;
+                next = p[l4];
+                l4 += 8;
+            } else if (next == IPPROTO_AH) {
+                next = p[l4];
+                l4 += (p[l4 + 1] + 2) * 4;
+            } else {
+                break;
+            }
+        }
+        out.l4proto = next;
+    } else {
+        return false;
+    }
+
+    // truncated or non-first fragments keep the addresses only
+    if (first_fragment && has_ports(out.l4proto) && l4 + 4 <= len) {
+        out.sport = be16(p + l4);
+        out.dport = be16(p + l4 + 2);
+    }
+    return true;
+}
+
+flow_topk::flow_topk(size_t capacity)
+    : capacity(std::max<size_t>(capacity, 1)), index(2 * capacity)
+{
+    heap.reserve(this->capacity);
+}
+
+void flow_topk::sift_down(size_t i)
+{
+    for (;;) {
+        size_t smallest = i;
+        const size_t l = 2 * i + 1, r = l + 1;
+        if (l < heap.size() && heap[l].count < heap[smallest].count)
+            smallest = l;
+        if (r < heap.size() && heap[r].count < heap[smallest].count)
+            smallest = r;
+        if (smallest == i)
+            return;
+        std::swap(heap[i], heap[smallest]);
+        index[heap[i].hash] = i;
+        index[heap[smallest].hash] = smallest;
+        i = smallest;
+    }
+}
+
+void flow_topk::add(const flow_key &key, uint64_t count)
+{
+    packets += count;
+    const uint64_t h = key.hash();
+    if (const uint32_t *slot = index.find(h)) {
+        heap[*slot].count += count;
+        sift_down(*slot);
+        return;
+    }
+    if (heap.size() < capacity) {
+        // counts only grow, so a new minimum belongs at the top
+        heap.push_back(counter{key, h, count, 0});
+        size_t i = heap.size() - 1;
+        index[h] = i;
+        while (i > 0) {
+            const size_t parent = (i - 1) / 2;
+            if (heap[parent].count <= heap[i].count)
+                break;
+            std::swap(heap[i], heap[parent]);
+            index[heap[i].hash] = i;
+            index[heap[parent].hash] = parent;
+            i = parent;
+        }
+        return;
+    }
+    // take over the smallest counter
+    counter &min = heap[0];
+    index.erase(min.hash);
+    min.error = min.count;
+    min.count += count;
+    min.key = key;
+    min.hash = h;
+    index[h] = 0;
+    sift_down(0);
+}
+
+flow_topk::interval flow_topk::rotate(size_t top_n)
+{
+    interval report;
+    report.packets = packets;
+    report.unparsed = unparsed;
+    report.capacity = capacity;
+    report.bound = heap.size() < capacity ? 0 : packets / capacity;
+
+    std::vector<const counter *> order;
+    order.reserve(heap.size());
+    for (const auto &c: heap)
+        order.push_back(&c);
+    const size_t n = std::min(top_n, order.size());
+    std::partial_sort(order.begin(), order.begin() + n, order.end(),
+                      [](const counter *a, const counter *b) { return a->count > b->count; });
+    report.top.reserve(n);
+    for (size_t i = 0; i < n; i++)
+        report.top.push_back(row{order[i]->key, order[i]->count, order[i]->error});
+
+    heap.clear();
+    index.clear();
+    packets = 0;
+    unparsed = 0;
+    return report;
+}
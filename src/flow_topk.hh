@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "netlink_dropmon.hh"
+#include "pc_map.hh"
+
+// A dropped packet's 5-tuple plus the drop site.
+struct flow_key {
+    uint64_t pc;
+    uint8_t src[16];        // IPv4 in the first 4 bytes
+    uint8_t dst[16];
+    uint16_t sport;         // host order, 0 without ports
+    uint16_t dport;
+    uint8_t family;         // 4 or 6
+    uint8_t l4proto;        // IPPROTO_*
+    uint8_t pad[10];        // zero; keeps the key a whole number of words
+
+    bool operator==(const flow_key &rhs) const;
+    uint64_t hash() const;
+    // "tcp 10.0.0.1:443 > 10.0.0.2:51234"
+    int format(char *buf, size_t len) const;
+};
+
+// Extracts the flow of a packet alert. The payload starts at the MAC
+// header; Ethernet (with VLAN tags) and bare IP are recognized.
+bool parse_flow(const drop_packet &pkt, flow_key &out);
+
+// Streaming top-K of (flow, drop site) with fixed memory: Space-Saving.
+//
+// capacity counters are kept in a min-heap. A new key takes over the
+// smallest counter and inherits its count as error, so counts are upper
+// bounds: the true count of a row lies in [count - error, count]. Every
+// key seen more than packets / capacity times in the interval is listed.
+struct flow_topk {
+    struct row {
+        flow_key key;
+        uint64_t count;
+        uint64_t error;
+    };
+
+    struct interval {
+        uint64_t packets;   // flows added this interval
+        uint64_t unparsed;  // packet alerts without a recognizable flow
+        size_t capacity;
+        uint64_t bound;     // packets / capacity: max error of any row
+        std::vector<row> top;
+    };
+
+    explicit flow_topk(size_t capacity = 4096);
+
+    void add(const flow_key &key, uint64_t count = 1);
+    void add_unparsed(uint64_t count = 1) { unparsed += count; }
+
+    // Returns the top_n rows of the interval and starts the next one.
+    interval rotate(size_t top_n);
+
+private:
+    struct counter {
+        flow_key key;
+        uint64_t hash;
+        uint64_t count;
+        uint64_t error;
+    };
+
+    void sift_down(size_t i);
+
+    size_t capacity;
+    std::vector<counter> heap;  // min-heap on count
+    pc_map<uint32_t> index;     // key hash -> heap slot; 64-bit collisions merge
+    uint64_t packets = 0;
+    uint64_t unparsed = 0;
+};
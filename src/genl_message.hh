@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+#include <linux/genetlink.h>
+#include <linux/net_dropmon.h>
+#include <linux/netlink.h>
+
+// Builds generic netlink messages, with nesting, the way NET_DM sends
+// them. For the tests, the benchmarks and the load generator.
+struct genl_message {
+    genl_message(uint16_t type, uint8_t cmd, uint32_t seq = 0)
+    {
+        buf.resize(NLMSG_LENGTH(GENL_HDRLEN));
+        auto nlh = hdr();
+        nlh->nlmsg_type = type;
+        nlh->nlmsg_seq = seq;
+        auto genl = static_cast<genlmsghdr *>(NLMSG_DATA(nlh));
+        genl->cmd = cmd;
+        genl->version = 2;
+        nlh->nlmsg_len = buf.size();
+    }
+
+    nlmsghdr *hdr() { return reinterpret_cast<nlmsghdr *>(buf.data()); }
+
+    size_t attr(uint16_t type, const void *data, size_t len)
+    {
+        const size_t at = buf.size();
+        buf.resize(at + NLA_ALIGN(NLA_HDRLEN + len));
+        auto nla = reinterpret_cast<nlattr *>(&buf[at]);
+        nla->nla_type = type;
+        nla->nla_len = NLA_HDRLEN + len;
+        if (len)
+            memcpy(&buf[at + NLA_HDRLEN], data, len);
+        hdr()->nlmsg_len = buf.size();
+        return at;
+    }
+    template<typename T>
+    void put(uint16_t type, T v) { attr(type, &v, sizeof(v)); }
+    void put(uint16_t type, const char *s) { attr(type, s, strlen(s) + 1); }
+
+    size_t nest() { return attr(NLA_F_NESTED, nullptr, 0); }
+    void nest(size_t at, uint16_t type)
+    {
+        auto nla = reinterpret_cast<nlattr *>(&buf[at]);
+        nla->nla_type = type | NLA_F_NESTED;
+        nla->nla_len = buf.size() - at;
+    }
+
+    // The body of a legacy summary NET_DM_CMD_ALERT: a net_dm_alert_msg
+    // of entries drop points, point(i) returning the (pc, count) of the
+    // i-th.
+    template<typename Point>
+    void alert_msg(uint32_t entries, Point &&point)
+    {
+        std::vector<unsigned char> payload(sizeof(net_dm_alert_msg) + entries * sizeof(net_dm_drop_point));
+        auto msg = reinterpret_cast<net_dm_alert_msg *>(payload.data());
+        msg->entries = entries;
+        for (uint32_t i = 0; i < entries; i++) {
+            auto &dp = reinterpret_cast<net_dm_drop_point *>(msg->points)[i];
+            const std::pair<uint64_t, uint32_t> p = point(i);
+            memcpy(dp.pc, &p.first, sizeof(p.first));
+            dp.count = p.second;
+        }
+        attr(0, payload.data(), payload.size());
+    }
+
+    std::vector<unsigned char> buf;
+};
@@ -1,31 +1,61 @@
 #include "kallsyms_lookup.hh"
 
+#include <cerrno>
 #include <climits>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include "common.hh"
 
 void usage(const char *comm)
 {
     fprintf(stderr, "USAGE:\n"
-            "lookup addresses given as arguments:\n  %s [addr]...\n"
-            "print kallsyms in sorted order:\n  %s\n", comm, comm);
+            "lookup addresses given as arguments:\n  %s [-t] [-j THREADS] [addr]...\n"
+            "print kallsyms in sorted order:\n  %s [-t] [-j THREADS]\n"
+            "options:\n"
+            "  -t, --time     report /proc/kallsyms load times on stderr\n"
+            "  -j THREADS     number of parser threads (default: auto)\n", comm, comm);
+}
+
+static double to_ms(std::chrono::nanoseconds d)
+{
+    return std::chrono::duration<double, std::milli>(d).count();
 }
 
 int main(int argc, char *argv[])
 {
-    if (argc == 2 &&
-       (std::strcmp("-h", argv[1]) == 0 ||
-        std::strcmp("--help", argv[1]) == 0)) {
-        usage(argv[0]);
-        return 0;
+    bool report_time = false;
+    unsigned threads = 0;
+    int first_addr = 1;
+    for (; first_addr < argc; first_addr++) {
+        if (std::strcmp("-h", argv[first_addr]) == 0 ||
+            std::strcmp("--help", argv[first_addr]) == 0) {
+            usage(argv[0]);
+            return 0;
+        } else if (std::strcmp("-t", argv[first_addr]) == 0 ||
+                   std::strcmp("--time", argv[first_addr]) == 0) {
+            report_time = true;
+        } else if (std::strcmp("-j", argv[first_addr]) == 0 && first_addr + 1 < argc) {
+            threads = std::strtoul(argv[++first_addr], nullptr, 0);
+        } else {
+            break;
+        }
     }
 
-    kallsyms_cache kcache;
+    kallsyms_cache kcache(threads);
     if (!kcache)
         return -1;
 
-    for (int i = 1; i < argc; i++) {
+    if (report_time) {
+        const auto &stats = kcache.stats();
+        fprintf(stderr, "have %zu + %zu = %zu symbols\n",
+                kcache.size(), stats.duplicates, stats.lines);
+        fprintf(stderr, "read %.3f ms, parse %.3f ms (%zu threads), index %.3f ms\n",
+                to_ms(stats.read_time), to_ms(stats.parse_time), stats.threads,
+                to_ms(stats.index_time));
+    }
+
+    for (int i = first_addr; i < argc; i++) {
         errno = 0;
         const auto addr = std::strtoul(argv[i], nullptr, 0);
         if ((addr == 0 && errno) || addr == ULONG_MAX) {
@@ -36,10 +66,10 @@ int main(int argc, char *argv[])
         const auto r = kcache.lookup_symbol(addr);
         printf("%s: %s+0x%lx\n", argv[i], r.first, r.second);
     }
-    if (argc != 1)
+    if (first_addr != argc)
         return 0;
 
     for (const auto cel: kcache)
-        printf("0x%lx %s\n", cel.first, cel.second.c_str());
+        printf("0x%lx %s\n", cel.first, cel.second);
 
 }
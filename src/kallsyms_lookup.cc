@@ -1,13 +1,25 @@
 #include "kallsyms_lookup.hh"
 
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <elf.h>
 #include <fcntl.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <cassert>
+#include <cerrno>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
-#include <functional>
+#include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
 int readall(int fd, void *buff, size_t len)
@@ -30,8 +42,7 @@ int readall(int fd, void *buff, size_t len)
     return nread;
 }
 
-template<typename lambda_t>
-bool foreach_blob(const char *filename, size_t blobsize, lambda_t lambda)
+bool read_file(const char *filename, std::vector<char> &out)
 {
     int fd = open(filename, O_RDONLY, NULL);
     if (fd == -1) {
@@ -39,172 +50,840 @@ bool foreach_blob(const char *filename, size_t blobsize, lambda_t lambda)
         return false;
     }
 
-    std::vector<char> buf(blobsize, 0);
-    int ret;
-    do {
-        ret = readall(fd, &buf[0], buf.size());
-        if (!lambda(buf, ret))
+    // /proc files report st_size 0, so grow until EOF
+    out.resize(4 * 1024 * 1024);
+    size_t fill = 0;
+    for (;;) {
+        const int ret = readall(fd, &out[fill], out.size() - fill);
+        if (ret == -1) {
+            perror("read");
+            close(fd);
+            return false;
+        }
+        fill += ret;
+        if (fill < out.size())
             break;
-    } while (ret > 0);
+        out.resize(out.size() * 2);
+    }
+    out.resize(fill);
 
     close(fd);
 
     return true;
 }
 
+// release from the "vmlinux <release>" pseudo module
+static std::string release_of(const kernel_layout &layout)
+{
+    const size_t space = layout.kernel.name.find(' ');
+    return space == std::string::npos ? std::string() : layout.kernel.name.substr(space + 1);
+}
 
-kallsyms_cache::kallsyms_cache()
-{
-    std::vector<char> old;
-    size_t dbg_dup = 0;
-    size_t line = 0;
-    auto lambda = [this, &old, &line, &dbg_dup](const std::vector<char> &buf, size_t fill) {
-        const char *data = buf.data();
-        size_t size = fill;
-        if (!old.empty()) {
-            old.insert(std::end(old), std::begin(buf), std::begin(buf) + fill);
-            data = old.data();
-            size = old.size();
-        }
-        for (const char *nl = static_cast<const char *>(memchr(data, '\n', size));
-            nl != nullptr; nl = static_cast<const char *>(memchr(data, '\n', size))) {
-
-            const size_t line_length = reinterpret_cast<uintptr_t>(nl) - reinterpret_cast<uintptr_t>(data);
-            auto get_sym = [](const char *line, size_t len) {
-                uint64_t addr = 0;
-                std::string symbol(1024, '\0');
-                const char *fmt = line[len - 1] == ']'
-                ? "%llx %*c %s\t[%*[^]]\n"
-                : "%llx %*c %s\n";
-                if (std::sscanf(line, fmt, &addr, &symbol[0]) != 2)
-                    return std::make_pair(uint64_t(0), std::string());
-                return std::make_pair(addr, std::move(symbol)); };
-
-            auto sym_data = get_sym(data, line_length);
-            if (sym_data.second.empty()) {
-                fprintf(stderr, "%zu: ERR \"%s\"\n", line, std::string(data, line_length).c_str());
-                cache.clear();
+std::string find_vmlinux(const kernel_layout &layout)
+{
+    const std::string release = release_of(layout);
+    if (release.empty())
+        return std::string();
+    const std::string candidates[] = {
+        "/usr/lib/debug/boot/vmlinux-" + release,
+        "/usr/lib/debug/lib/modules/" + release + "/vmlinux",
+        "/lib/modules/" + release + "/build/vmlinux",
+        "/boot/vmlinux-" + release,
+    };
+    for (const auto &path: candidates)
+        if (access(path.c_str(), R_OK) == 0)
+            return path;
+    return std::string();
+}
+
+// Section load addresses from /sys/module/NAME/sections, empty if they
+// are not readable or hidden.
+static std::vector<std::pair<std::string, uint64_t>> read_module_sections(const std::string &module)
+{
+    std::vector<std::pair<std::string, uint64_t>> sections;
+    const std::string dir_path = "/sys/module/" + module + "/sections";
+    DIR *dir = opendir(dir_path.c_str());
+    if (!dir)
+        return sections;
+    bool nonzero = false;
+    while (const dirent *de = readdir(dir)) {
+        if (de->d_name[0] != '.')
+            continue;
+        const std::string path = dir_path + "/" + de->d_name;
+        FILE *f = fopen(path.c_str(), "r");
+        if (!f)
+            continue;
+        unsigned long long addr;
+        if (fscanf(f, "%llx", &addr) == 1) {
+            sections.emplace_back(de->d_name, addr);
+            nonzero |= addr != 0;
+        }
+        fclose(f);
+    }
+    closedir(dir);
+    if (!nonzero)
+        sections.clear();
+    return sections;
+}
+
+std::vector<kallsyms_module_file> find_module_files(const kernel_layout &layout, bool read_sections)
+{
+    std::vector<kallsyms_module_file> files;
+    const std::string release = release_of(layout);
+    if (release.empty() || layout.modules.empty())
+        return files;
+    const std::string dir = "/lib/modules/" + release + "/";
+    FILE *dep = fopen((dir + "modules.dep").c_str(), "r");
+    if (!dep)
+        return files;
+
+    // "kernel/net/foo/bar-baz.ko[.xz]: deps"; the module is bar_baz
+    std::unordered_map<std::string, std::string> paths;
+    char line[4096];
+    size_t compressed = 0;
+    while (fgets(line, sizeof(line), dep)) {
+        char *colon = strchr(line, ':');
+        if (!colon)
+            continue;
+        *colon = '\0';
+        const char *base = strrchr(line, '/');
+        base = base ? base + 1 : line;
+        const char *ext = strstr(base, ".ko");
+        if (!ext)
+            continue;
+        std::string name(base, ext - base);
+        std::replace(std::begin(name), std::end(name), '-', '_');
+        paths[name] = ext[3] ? std::string() : dir + line;
+    }
+    fclose(dep);
+
+    for (const auto &m: layout.modules) {
+        const auto it = paths.find(m.name);
+        if (it == paths.end())
+            continue;
+        if (it->second.empty()) {
+            compressed++;
+            continue;
+        }
+        kallsyms_module_file file;
+        file.name = m.name;
+        file.path = it->second;
+        file.base = m.base;
+        if (read_sections)
+            file.sections = read_module_sections(m.name);
+        if (file.base || !file.sections.empty())
+            files.push_back(std::move(file));
+    }
+    if (compressed)
+        fprintf(stderr, "%zu compressed modules have no symbols\n", compressed);
+    return files;
+}
+
+static inline bool hex_digit(char c, uint64_t &v)
+{
+    if (c >= '0' && c <= '9')
+        v = c - '0';
+    else if (c >= 'a' && c <= 'f')
+        v = c - 'a' + 10;
+    else if (c >= 'A' && c <= 'F')
+        v = c - 'A' + 10;
+    else
+        return false;
+    return true;
+}
+
+// Collects symbols in file order and turns them into the flat index.
+// Names are not copied until finish(); entries point into the kallsyms text.
+struct kallsyms_builder {
+    struct entry {
+        uint64_t addr;
+        uint32_t offset;
+        uint32_t len;
+        uint32_t module;        // offset of the module name, len 0 for core
+        uint32_t module_len;
+    };
+
+    // Tokenizes "<hex> <type> <name>[\t[module]]\n" lines in [begin, end).
+    // Returns false and prints the line on a malformed entry.
+    static bool parse(const char *text, size_t begin, size_t end, std::vector<entry> &out)
+    {
+        size_t pos = begin;
+        while (pos < end) {
+            const size_t line = pos;
+            uint64_t addr = 0;
+            uint64_t digit;
+            while (pos < end && hex_digit(text[pos], digit)) {
+                addr = addr << 4 | digit;
+                pos++;
+            }
+            // "<addr> <type> "
+            const bool ok = pos != line && pos + 3 < end
+                && text[pos] == ' ' && text[pos + 1] != '\n' && text[pos + 2] == ' ';
+            pos += 3;
+            const size_t name = pos;
+            while (ok && pos < end && text[pos] != '\n' && text[pos] != '\t' && text[pos] != ' ')
+                pos++;
+            if (!ok || pos == name) {
+                const char *nl = static_cast<const char *>(memchr(&text[line], '\n', end - line));
+                const size_t len = nl ? nl - &text[line] : end - line;
+                fprintf(stderr, "ERR \"%s\"\n", std::string(&text[line], len).c_str());
                 return false;
             }
+            const size_t name_end = pos;
+
+            // "\t[module]"
+            size_t module = pos + 2, module_end = module;
+            if (pos + 1 < end && text[pos] == '\t' && text[pos + 1] == '[')
+                while (module_end < end && text[module_end] != ']' && text[module_end] != '\n')
+                    module_end++;
+            out.push_back(entry{addr, static_cast<uint32_t>(name), static_cast<uint32_t>(name_end - name),
+                                static_cast<uint32_t>(module), static_cast<uint32_t>(module_end - module)});
+
+            const char *nl = static_cast<const char *>(memchr(&text[pos], '\n', end - pos));
+            pos = nl ? nl - text + 1 : end;
+        }
+        return true;
+    }
+
+    // Splits text at newline boundaries and parses the chunks concurrently.
+    // Chunk results are concatenated in file order.
+    bool parse(unsigned threads)
+    {
+        const size_t size = text.size();
+        const size_t min_chunk = 256 * 1024;
+        if (threads == 0)
+            threads = std::max(1u, std::min(8u, std::thread::hardware_concurrency()));
+        threads = std::max<size_t>(1, std::min<size_t>(threads, size / min_chunk));
+
+        std::vector<size_t> bounds(1, 0);
+        for (unsigned i = 1; i < threads; i++) {
+            size_t pos = std::max(bounds.back(), size * i / threads);
+            const char *nl = static_cast<const char *>(memchr(&text[pos], '\n', size - pos));
+            if (!nl)
+                break;
+            bounds.push_back(nl - text.data() + 1);
+        }
+        bounds.push_back(size);
+        used_threads = bounds.size() - 1;
+
+        std::vector<std::vector<entry>> chunks(used_threads);
+        std::vector<char> ok(used_threads, 0);
+        auto worker = [this, &bounds, &chunks, &ok](size_t i) {
+            // ~40 bytes per kallsyms line
+            chunks[i].reserve((bounds[i + 1] - bounds[i]) / 32);
+            ok[i] = parse(text.data(), bounds[i], bounds[i + 1], chunks[i]);
+        };
+        std::vector<std::thread> workers;
+        for (size_t i = 1; i < used_threads; i++)
+            workers.emplace_back(worker, i);
+        worker(0);
+        for (auto &w: workers)
+            w.join();
+
+        size_t total = 0;
+        for (size_t i = 0; i < used_threads; i++) {
+            if (!ok[i])
+                return false;
+            total += chunks[i].size();
+        }
+        entries.reserve(total);
+        for (auto &chunk: chunks)
+            entries.insert(std::end(entries), std::begin(chunk), std::end(chunk));
+        return true;
+    }
 
-            auto insert = cache.insert(std::make_pair(sym_data.first, std::move(sym_data.second)));
-            if (!insert.second) {
-                // Symbol was moved, get again. Avoid copy in general(no duplicate) case.
-                sym_data = get_sym(data, line_length);
-                // printf("%zu: dup(\"%s\")\n", line, sym_data.second.c_str());
-                if(line >= 10 && cache.size() <= 1 && sym_data.first == 0) {
-                    fprintf(stderr, "reading /proc/kallsyms failed. kptr_restrict=1? Try again with root privileges\n");
-                    cache.clear();
+    // Parses only the lines of the named modules.
+    bool parse_modules(const std::vector<std::string> &modules)
+    {
+        used_threads = 1;
+        const size_t size = text.size();
+        size_t line = 0;
+        while (line < size) {
+            const char *nl = static_cast<const char *>(memchr(&text[line], '\n', size - line));
+            const size_t end = nl ? nl - text.data() : size;
+            // core symbols, the bulk of the file, have no "\t[module]"
+            if (end > line && text[end - 1] == ']') {
+                const char *open = static_cast<const char *>(memrchr(&text[line], '[', end - line));
+                const size_t name = open ? open - text.data() + 1 : end;
+                const size_t len = end - 1 - name;
+                const bool wanted = open && open > &text[line] && open[-1] == '\t'
+                    && std::any_of(std::begin(modules), std::end(modules), [&](const std::string &m) {
+                           return m.size() == len && memcmp(m.data(), &text[name], len) == 0;
+                       });
+                if (wanted && !parse(text.data(), line, std::min(end + 1, size), entries))
                     return false;
+            }
+            line = end + 1;
+        }
+        // addresses hidden by kptr_restrict; the module is better left out
+        entries.erase(std::remove_if(std::begin(entries), std::end(entries), [](const entry &e) { return e.addr == 0; }),
+                      std::end(entries));
+        return true;
+    }
+
+    // Appends one segment per module seen, plus the core kernel.
+    // Returns number of symbols merged into an already present address.
+    size_t finish(kallsyms_cache &cache)
+    {
+        // stable: keeps "first/second" order of duplicates as read from kallsyms
+        std::stable_sort(std::begin(entries), std::end(entries),
+                         [](const entry &a, const entry &b) { return a.addr < b.addr; });
+
+        std::vector<std::unique_ptr<kallsyms_cache::segment>> built;
+        std::unordered_map<std::string, size_t> by_module;
+        kallsyms_cache::segment *seg = nullptr;
+        size_t dup = 0;
+        for (const auto &e: entries) {
+            const char *module = &text[e.module];
+            // runs of the same module are the common case; skip the map
+            if (!seg || seg->module.size() != e.module_len || memcmp(seg->module.data(), module, e.module_len) != 0) {
+                std::string key(module, e.module_len);
+                auto it = by_module.find(key);
+                if (it == by_module.end()) {
+                    it = by_module.emplace(key, built.size()).first;
+                    built.emplace_back(new kallsyms_cache::segment);
+                    built.back()->module = std::move(key);
                 }
-                dbg_dup++;
-                auto &old_sym = insert.first->second;
-                old_sym.replace(old_sym.find('\0'), 1, 1, '/');
-                old_sym.replace(old_sym.find('\0'), sym_data.second.find('\0'), sym_data.second);
-                // printf("%zu: OK: %lx \"%s\" mod=%d\n", line, sym_data.first, old_sym.c_str(),
-                //        nl[line_length - 1] == ']' ? 1 : 0);
-            } else {
-                // printf("%zu: OK: %lx \"%s\" mod=%d\n", line, sym_data.first, insert.first->second.c_str(),
-                //        nl[line_length - 1] == ']' ? 1 : 0);
+                seg = built[it->second].get();
             }
-            ++line;
-            assert(size >= (line_length + 1));
-            size -= line_length + 1;
-            data += line_length + 1;
-        }
-        old.clear();
-        if (size)
-            old.insert(std::begin(old), data, data + size);
+            dup += append(*seg, e.addr, &text[e.offset], e.len);
+        }
+        for (auto &b: built) {
+            b->addrs.shrink_to_fit();
+            b->name_offsets.shrink_to_fit();
+            b->names.shrink_to_fit();
+            cache.segments.emplace_back(std::move(b));
+        }
+        cache.load.segments_built = built.size();
+
+        entries.clear();
+        entries.shrink_to_fit();
+        return dup;
+    }
+
+    // Adds a symbol in address order; one at the address of the previous
+    // symbol is joined to its name as "a/b". Returns true in that case.
+    static bool append(kallsyms_cache::segment &seg, uint64_t addr, const char *name, size_t len)
+    {
+        const bool dup = !seg.addrs.empty() && seg.addrs.back() == addr;
+        if (dup) {
+            seg.names.back() = '/';
+        } else {
+            seg.addrs.push_back(addr);
+            seg.name_offsets.push_back(static_cast<uint32_t>(seg.names.size()));
+        }
+        seg.names.insert(std::end(seg.names), name, name + len);
+        seg.names.push_back('\0');
+        return dup;
+    }
+
+    std::vector<char> text;
+    std::vector<entry> entries;
+    size_t used_threads = 0;
+};
+
+// A read-only mapping of an ELF64 file in the host's byte order.
+struct elf_image {
+    elf_image() = default;
+    ~elf_image()
+    {
+        if (data)
+            munmap(const_cast<char *>(data), size);
+    }
+    elf_image(const elf_image &) = delete;
+    elf_image &operator=(const elf_image &) = delete;
+
+    bool open(const char *path)
+    {
+        const int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            perror(path);
+            return false;
+        }
+        struct stat st;
+        void *map = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= sizeof(Elf64_Ehdr))
+            map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) {
+            fprintf(stderr, "%s: cannot map\n", path);
+            return false;
+        }
+        data = static_cast<const char *>(map);
+        size = st.st_size;
+
+        ehdr = reinterpret_cast<const Elf64_Ehdr *>(data);
+        const unsigned char host_order = htons(1) == 1 ? ELFDATA2MSB : ELFDATA2LSB;
+        if (memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0 || ehdr->e_ident[EI_CLASS] != ELFCLASS64
+            || ehdr->e_ident[EI_DATA] != host_order || ehdr->e_shentsize != sizeof(Elf64_Shdr)
+            || ehdr->e_shoff > size || ehdr->e_shnum > (size - ehdr->e_shoff) / sizeof(Elf64_Shdr)
+            || ehdr->e_shstrndx >= ehdr->e_shnum) {
+            fprintf(stderr, "%s: not a 64-bit ELF file of this machine\n", path);
+            return false;
+        }
+        shdrs = reinterpret_cast<const Elf64_Shdr *>(data + ehdr->e_shoff);
+        shnum = ehdr->e_shnum;
+        if (!contents(shdrs[ehdr->e_shstrndx], shstrtab, shstrtab_size))
+            return false;
+
+        for (size_t i = 0; i < shnum; i++) {
+            if (shdrs[i].sh_type != SHT_SYMTAB)
+                continue;
+            const char *syms;
+            size_t syms_size;
+            if (shdrs[i].sh_link >= shnum || !contents(shdrs[i], syms, syms_size)
+                || !contents(shdrs[shdrs[i].sh_link], strtab, strtab_size))
+                break;
+            symbols = reinterpret_cast<const Elf64_Sym *>(syms);
+            symbol_count = syms_size / sizeof(Elf64_Sym);
+            return true;
+        }
+        fprintf(stderr, "%s: no symbol table\n", path);
+        return false;
+    }
+
+    bool contents(const Elf64_Shdr &shdr, const char *&out, size_t &len) const
+    {
+        if (shdr.sh_type == SHT_NOBITS || shdr.sh_offset > size || shdr.sh_size > size - shdr.sh_offset)
+            return false;
+        out = data + shdr.sh_offset;
+        len = shdr.sh_size;
         return true;
+    }
+
+    // NUL-terminated within the table, nullptr otherwise
+    static const char *string(const char *table, size_t table_size, size_t offset)
+    {
+        if (offset >= table_size || !memchr(table + offset, '\0', table_size - offset))
+            return nullptr;
+        return table + offset;
+    }
+    const char *section_name(size_t idx) const { return string(shstrtab, shstrtab_size, shdrs[idx].sh_name); }
+    const char *symbol_name(const Elf64_Sym &sym) const { return string(strtab, strtab_size, sym.st_name); }
+
+    const char *data = nullptr;
+    size_t size = 0;
+    const Elf64_Ehdr *ehdr = nullptr;
+    const Elf64_Shdr *shdrs = nullptr;
+    size_t shnum = 0;
+    const char *shstrtab = nullptr;
+    size_t shstrtab_size = 0;
+    const Elf64_Sym *symbols = nullptr;
+    size_t symbol_count = 0;
+    const char *strtab = nullptr;
+    size_t strtab_size = 0;
+};
+
+// Builds segments from ELF symbol tables. Names stay in the mapping
+// until they are copied into the segment.
+struct kallsyms_elf {
+    struct symbol {
+        uint64_t addr;
+        const char *name;
+        size_t len;
     };
-    if (!foreach_blob("/proc/kallsyms", 32 * 1024, lambda))
+
+    // What kallsyms lists: named functions, objects and labels in
+    // allocated sections.
+    static bool wanted(const elf_image &elf, const Elf64_Sym &sym, const char *&name)
+    {
+        const unsigned type = ELF64_ST_TYPE(sym.st_info);
+        if (type != STT_FUNC && type != STT_OBJECT && type != STT_NOTYPE)
+            return false;
+        if (sym.st_shndx == SHN_UNDEF || sym.st_shndx >= elf.shnum)
+            return false;
+        if (!(elf.shdrs[sym.st_shndx].sh_flags & SHF_ALLOC))
+            return false;
+        name = elf.symbol_name(sym);
+        // local labels and ARM mapping symbols
+        return name && *name && *name != '$' && strncmp(name, ".L", 2) != 0;
+    }
+
+    static size_t add_segment(kallsyms_cache &cache, std::string module, std::vector<symbol> &syms)
+    {
+        if (syms.empty())
+            return 0;
+        std::stable_sort(std::begin(syms), std::end(syms),
+                         [](const symbol &a, const symbol &b) { return a.addr < b.addr; });
+        std::unique_ptr<kallsyms_cache::segment> seg(new kallsyms_cache::segment);
+        seg->module = std::move(module);
+        seg->addrs.reserve(syms.size());
+        seg->name_offsets.reserve(syms.size());
+        size_t dup = 0;
+        for (const auto &sym: syms)
+            dup += kallsyms_builder::append(*seg, sym.addr, sym.name, sym.len);
+        seg->names.shrink_to_fit();
+        cache.segments.emplace_back(std::move(seg));
+        cache.load.segments_built++;
+        return dup;
+    }
+
+    static bool add_vmlinux(kallsyms_cache &cache, const char *path, uint64_t text_base)
+    {
+        elf_image elf;
+        if (!elf.open(path))
+            return false;
+
+        const char *name;
+        uint64_t slide = 0;
+        if (text_base) {
+            bool anchored = false;
+            for (size_t i = 0; i < elf.symbol_count && !anchored; i++) {
+                if (wanted(elf, elf.symbols[i], name) && strcmp(name, "_text") == 0) {
+                    slide = text_base - elf.symbols[i].st_value;
+                    anchored = true;
+                }
+            }
+            if (!anchored)
+                fprintf(stderr, "%s: no _text symbol, KASLR offset not applied\n", path);
+        }
+
+        std::vector<symbol> syms;
+        syms.reserve(elf.symbol_count);
+        for (size_t i = 0; i < elf.symbol_count; i++) {
+            const Elf64_Sym &sym = elf.symbols[i];
+            // per-cpu symbols are offsets into the per-cpu area, not addresses
+            if (!wanted(elf, sym, name))
+                continue;
+            const char *section = elf.section_name(sym.st_shndx);
+            if (section && strcmp(section, ".data..percpu") == 0)
+                continue;
+            syms.push_back(symbol{sym.st_value + slide, name, strlen(name)});
+        }
+        cache.load.lines += syms.size();
+        cache.load.duplicates += add_segment(cache, std::string(), syms);
+        return true;
+    }
+
+    static bool add_module(kallsyms_cache &cache, const kallsyms_module_file &module)
+    {
+        elf_image elf;
+        if (!elf.open(module.path.c_str()))
+            return false;
+        if (elf.ehdr->e_type != ET_REL) {
+            fprintf(stderr, "%s: not a relocatable object\n", module.path.c_str());
+            return false;
+        }
+
+        // load address per section, 0 if not loaded
+        std::vector<uint64_t> placed(elf.shnum, 0);
+        if (!module.sections.empty()) {
+            for (size_t i = 0; i < elf.shnum; i++) {
+                const char *name = elf.section_name(i);
+                for (const auto &s: module.sections)
+                    if (name && s.first == name)
+                        placed[i] = s.second;
+            }
+        } else if (module.base) {
+            // the loader's core text: executable sections in file order,
+            // each aligned, init sections excluded
+            uint64_t offset = 0;
+            for (size_t i = 0; i < elf.shnum; i++) {
+                const Elf64_Shdr &shdr = elf.shdrs[i];
+                const char *name = elf.section_name(i);
+                if ((shdr.sh_flags & (SHF_ALLOC | SHF_EXECINSTR)) != (SHF_ALLOC | SHF_EXECINSTR)
+                    || !name || strncmp(name, ".init", 5) == 0)
+                    continue;
+                const uint64_t align = shdr.sh_addralign ? shdr.sh_addralign : 1;
+                offset = (offset + align - 1) / align * align;
+                placed[i] = module.base + offset;
+                offset += shdr.sh_size;
+            }
+        }
+
+        std::vector<symbol> syms;
+        const char *name;
+        for (size_t i = 0; i < elf.symbol_count; i++) {
+            const Elf64_Sym &sym = elf.symbols[i];
+            if (!wanted(elf, sym, name) || !placed[sym.st_shndx])
+                continue;
+            syms.push_back(symbol{placed[sym.st_shndx] + sym.st_value, name, strlen(name)});
+        }
+        cache.load.lines += syms.size();
+        cache.load.duplicates += add_segment(cache, module.name, syms);
+        return true;
+    }
+};
+
+kallsyms_cache::kallsyms_cache(unsigned threads)
+{
+    const auto t0 = std::chrono::steady_clock::now();
+    kallsyms_builder builder;
+    if (!read_file("/proc/kallsyms", builder.text))
+        return;
+    load.read_time = std::chrono::steady_clock::now() - t0;
+    build(builder, threads);
+}
+
+kallsyms_cache::kallsyms_cache(const char *text, size_t len, unsigned threads)
+{
+    kallsyms_builder builder;
+    builder.text.assign(text, text + len);
+    build(builder, threads);
+}
+
+kallsyms_cache::kallsyms_cache(const kallsyms_cache &prev, const std::vector<std::string> &modules,
+                               const char *path)
+{
+    using clock = std::chrono::steady_clock;
+    for (const auto &seg: prev.segments)
+        if (std::find(std::begin(modules), std::end(modules), seg->module) == std::end(modules))
+            segments.push_back(seg);
+
+    const auto t0 = clock::now();
+    kallsyms_builder builder;
+    if (read_file(path, builder.text)) {
+        const auto t1 = clock::now();
+        if (builder.parse_modules(modules)) {
+            const auto t2 = clock::now();
+            load.lines = builder.entries.size();
+            load.threads = builder.used_threads;
+            load.duplicates = builder.finish(*this);
+            load.index_time = clock::now() - t2;
+            load.parse_time = t2 - t1;
+        }
+        load.read_time = t1 - t0;
+    }
+    index();
+}
+
+std::unique_ptr<kallsyms_cache> kallsyms_cache::from_elf(const char *vmlinux, uint64_t text_base,
+                                                         const std::vector<kallsyms_module_file> &modules)
+{
+    return std::unique_ptr<kallsyms_cache>(new kallsyms_cache(elf_tag(), vmlinux, text_base, modules));
+}
+
+kallsyms_cache::kallsyms_cache(elf_tag, const char *vmlinux, uint64_t text_base,
+                               const std::vector<kallsyms_module_file> &modules)
+{
+    const auto t0 = std::chrono::steady_clock::now();
+    load.threads = 1;
+    if (kallsyms_elf::add_vmlinux(*this, vmlinux, text_base))
+        for (const auto &module: modules)
+            kallsyms_elf::add_module(*this, module);
+    const auto t1 = std::chrono::steady_clock::now();
+    index();
+    load.parse_time = t1 - t0;
+    load.index_time = std::chrono::steady_clock::now() - t1;
+}
+
+void kallsyms_cache::build(kallsyms_builder &builder, unsigned threads)
+{
+    using clock = std::chrono::steady_clock;
+    const auto t1 = clock::now();
+
+    if (!builder.parse(threads))
+        return;
+    const auto t2 = clock::now();
+
+    load.lines = builder.entries.size();
+    load.threads = builder.used_threads;
+    load.duplicates = builder.finish(*this);
+    index();
+    const auto t3 = clock::now();
+
+    load.parse_time = t2 - t1;
+    load.index_time = t3 - t2;
+
+    const bool all_zero = std::all_of(std::begin(segments), std::end(segments), [](const std::shared_ptr<const segment> &seg) {
+        return seg->addrs.size() == 1 && seg->addrs[0] == 0;
+    });
+    if (load.lines >= 10 && all_zero) {
+        fprintf(stderr, "kallsyms addresses are hidden (kptr_restrict); run as root or use ELF symbols\n");
+        load.hidden = true;
+        segments.clear();
+        index();
         return;
+    }
+}
 
-    //fprintf(stderr, "have %zu + %zu = %zu symbols\n", cache.size(), dbg_dup, cache.size() + dbg_dup);
+void kallsyms_cache::index()
+{
+    std::sort(std::begin(segments), std::end(segments),
+              [](const std::shared_ptr<const segment> &a, const std::shared_ptr<const segment> &b) {
+                  return a->addrs.front() < b->addrs.front();
+              });
+    firsts.clear();
+    starts.clear();
+    core = nullptr;
+    total = 0;
+    for (const auto &seg: segments) {
+        firsts.push_back(seg->addrs.front());
+        starts.push_back(total);
+        total += seg->addrs.size();
+        if (seg->module.empty())
+            core = seg.get();
+    }
 }
 
 kallsyms_cache::~kallsyms_cache() {}
 
-static const std::string EMPTY_STRING;
-std::pair<const char *, size_t> kallsyms_cache::lookup_symbol(uint64_t key)
+std::pair<uint64_t, const char *> kallsyms_cache::at(size_t idx) const
 {
-    auto it = cache.lower_bound(key);
-    if (it == std::end(cache)) {
-        assert(cache.size() == 1 || cache.empty());
-        if (cache.empty())
-            return std::make_pair(nullptr, 0);
-        it = std::begin(cache);
-    } else {
-        if (it->first == key)
-            return std::make_pair(it->second.c_str(), 0);
-        if (it == std::begin(cache))
-            return std::make_pair(nullptr, 0);
+    const size_t s = std::upper_bound(std::begin(starts), std::end(starts), idx) - std::begin(starts) - 1;
+    const segment &seg = *segments[s];
+    return std::make_pair(seg.addrs[idx - starts[s]], seg.name(idx - starts[s]));
+}
+
+size_t kallsyms_cache::segment::find(uint64_t key) const
+{
+    // branch-free search for the last address <= key
+    size_t n = addrs.size();
+    const uint64_t *base = addrs.data();
+    while (n > 1) {
+        const size_t half = n / 2;
+        base = base[half] <= key ? base + half : base;
+        n -= half;
+    }
+    assert(*base <= key);
+    return base - addrs.data();
+}
+
+std::pair<const char *, size_t> kallsyms_cache::lookup_symbol(uint64_t key) const
+{
+    const auto it = std::upper_bound(std::begin(firsts), std::end(firsts), key);
+    if (it == std::begin(firsts))
+        return std::make_pair(nullptr, 0);
+
+    const segment *seg = segments[it - std::begin(firsts) - 1].get();
+    size_t idx = seg->find(key);
+    // a module loaded inside the core kernel's range
+    if (core && core != seg && core->addrs.front() <= key && core->addrs.back() > seg->addrs[idx]) {
+        const size_t core_idx = core->find(key);
+        if (core->addrs[core_idx] > seg->addrs[idx]) {
+            seg = core;
+            idx = core_idx;
+        }
     }
-    --it;
-    assert(it->first < key);
-    return std::make_pair(it->second.c_str(), key - it->first);
+    return std::make_pair(seg->name(idx), key - seg->addrs[idx]);
 }
 
 #ifdef TEST_DRIVER
-#include <climits>
 #include <future>
-#include <iostream>
+#include <link.h>
+#include <unistd.h>
 #include "common.hh"
 
-int main(int argc, char *argv[])
+// Excerpt of a real /proc/kallsyms: duplicates at 0, a module symbol last.
+static const char fixture[] =
+    "0000000000000000 A irq_stack_union\n"
+    "0000000000000000 A __per_cpu_start\n"
+    "0000000000004000 A exception_stacks\n"
+    "000000000000a038 A cpu_sibling_map\n"
+    "ffffffff81000000 T _stext\n"
+    "ffffffffc0095190 t fjes_hw_epbuf_tx_pkt_send\t[fjes]\n";
+
+static void expect(const kallsyms_cache &kcache, uint64_t addr, const char *name, size_t offset)
 {
-    auto kcache_future = std::async(std::launch::async, []() { return make_unique<kallsyms_cache>(); });
-    while (kcache_future.wait_for(std::chrono::milliseconds(50)) == std::future_status::timeout) {
-        fprintf(stderr, ".");
-        //fflush(stderr);
+    const auto r = kcache.lookup_symbol(addr);
+    if (!r.first || std::strcmp(r.first, name) != 0 || r.second != offset) {
+        fprintf(stderr, "0x%" PRIx64 ": expected %s+0x%zx, got %s+0x%zx\n",
+                addr, name, offset, r.first ? r.first : "(null)", r.second);
+        abort();
     }
-    auto kcache = kcache_future.get();
-    if (!kcache || !*kcache)
-        return -1;
+}
 
-    // first
-    {
-        const auto r = kcache->lookup_symbol(0x0ull);
-        assert(std::strcmp(r.first.c_str(), "irq_stack_union/__per_cpu_start") == 0);
-        assert(r.second == 0);
+static void expect_not(const kallsyms_cache &kcache, uint64_t addr, const char *name)
+{
+    const auto r = kcache.lookup_symbol(addr);
+    if (r.first && std::strcmp(r.first, name) == 0) {
+        fprintf(stderr, "0x%" PRIx64 ": still resolves to %s\n", addr, name);
+        abort();
     }
+}
 
-    {
-        const auto r = kcache->lookup_symbol(0x0ull + 0x3999);
-        assert(std::strcmp(r.first.c_str(), "irq_stack_union/__per_cpu_start") == 0);
-        assert(r.second == 0x3999);
-    }
+// Module refresh: mod_a reloaded elsewhere, mod_b unloaded, mod_c loaded.
+// The core kernel is kept from the first snapshot.
+static void test_refresh()
+{
+    static const char before[] =
+        "ffffffff81000000 T _stext\n"
+        "ffffffff81000100 T core_fn\n"
+        "ffffffffc0001000 t a_fn\t[mod_a]\n"
+        "ffffffffc0002000 t b_fn\t[mod_b]\n";
+    static const char after[] =
+        "ffffffff81000000 T _stext\n"
+        "ffffffff81000100 T core_fn_reparsed\n"
+        "ffffffffc0003000 t c_fn\t[mod_c]\n"
+        "ffffffffc0005000 t a_fn\t[mod_a]\n"
+        "ffffffffc0005040 t a_fn2\t[mod_a]\n";
+    char path[] = "/tmp/kallsyms_test.XXXXXX";
+    const int fd = mkstemp(path);
+    assert(fd != -1);
+    assert(write(fd, after, sizeof(after) - 1) == ssize_t(sizeof(after) - 1));
+    close(fd);
 
-    {
-        const auto r = kcache->lookup_symbol(0x0ull + 0x4000);
-        assert(std::strcmp(r.first.c_str(), "exception_stacks") == 0);
-        assert(r.second == 0);
-    }
+    const kallsyms_cache old(before, sizeof(before) - 1);
+    assert(old.segment_count() == 3);
+    const kallsyms_cache fresh(old, {"mod_a", "mod_b", "mod_c"}, path);
+    unlink(path);
+    assert(fresh.segment_count() == 3 && fresh.size() == 5);
+    expect(fresh, 0xffffffff81000104ull, "core_fn", 4);
+    expect(fresh, 0xffffffffc0005010ull, "a_fn", 0x10);
+    expect(fresh, 0xffffffffc0005044ull, "a_fn2", 4);
+    expect(fresh, 0xffffffffc0003008ull, "c_fn", 8);
+    expect_not(fresh, 0xffffffffc0001008ull, "a_fn");
+    expect_not(fresh, 0xffffffffc0002008ull, "b_fn");
+    // the old index is unchanged
+    expect(old, 0xffffffffc0001008ull, "a_fn", 8);
+    expect(old, 0xffffffffc0002008ull, "b_fn", 8);
+}
 
-    {
-        const auto r = kcache->lookup_symbol(0x000000000000a038ull);
-        assert(std::strcmp(r.first.c_str(), "cpu_sibling_map") == 0);
-        assert(r.second == 0);
-    }
+int main(int argc, char *argv[]);
 
-    // last
-    {
-        const auto r = kcache->lookup_symbol(0xffffffffc0095190);
-        assert(std::strcmp(r.first.c_str(), "fjes_hw_epbuf_tx_pkt_send") == 0);
-        assert(r.second == 0);
-    }
+// The .symtab of this very binary. With no slide, symbols keep their
+// link-time addresses: main's runtime address less the load bias of a PIE.
+static void test_elf()
+{
+    const auto self = kallsyms_cache::from_elf("/proc/self/exe", 0, {});
+    assert(self && *self && self->segment_count() == 1);
+    uint64_t bias = 0;
+    dl_iterate_phdr([](struct dl_phdr_info *info, size_t, void *arg) {
+        *static_cast<uint64_t *>(arg) = info->dlpi_addr;
+        return 1;                       // the executable comes first
+    }, &bias);
+    expect(*self, reinterpret_cast<uintptr_t>(&main) - bias, "main", 0);
+}
 
-    {
-        const auto r = kcache->lookup_symbol(0xffffffffc0095190 + 0x13);
-        printf("%s %zu\n", r.first.c_str(), r.second);
-        assert(std::strcmp(r.first.c_str(), "fjes_hw_epbuf_tx_pkt_send") == 0);
-        assert(r.second == 0x13);
+int main(int argc, char *argv[])
+{
+    const kallsyms_cache fixed(fixture, sizeof fixture - 1);
+    assert(fixed.size() == 5);
+    assert(fixed.segment_count() == 2);
+    expect(fixed, 0x0ull, "irq_stack_union/__per_cpu_start", 0);
+    expect(fixed, 0x0ull + 0x3999, "irq_stack_union/__per_cpu_start", 0x3999);
+    expect(fixed, 0x0ull + 0x4000, "exception_stacks", 0);
+    expect(fixed, 0x000000000000a038ull, "cpu_sibling_map", 0);
+    expect(fixed, 0xffffffffc0095190ull, "fjes_hw_epbuf_tx_pkt_send", 0);
+    expect(fixed, 0xffffffffc0095190ull + 0x13, "fjes_hw_epbuf_tx_pkt_send", 0x13);
+
+    // random access, as the iterator category says
+    const auto text = std::partition_point(fixed.begin(), fixed.end(), [](std::pair<uint64_t, const char *> sym) {
+        return sym.first < 0xffffffff81000000ull;
+    });
+    assert(text - fixed.begin() == 3 && (*text).first == 0xffffffff81000000ull);
+    auto it = fixed.begin();
+    it += 4;
+    assert(it == 4 + fixed.begin() && fixed.begin() < it && it[-1].first == 0xffffffff81000000ull);
+    assert(std::strcmp(fixed.begin()[4].second, "fjes_hw_epbuf_tx_pkt_send") == 0);
+    test_refresh();
+    test_elf();
+    if (argc == 1)
+        return 0;
+
+    auto kcache_future = std::async(std::launch::async, []() { return make_unique<kallsyms_cache>(); });
+    while (kcache_future.wait_for(std::chrono::milliseconds(50)) == std::future_status::timeout) {
+        fprintf(stderr, ".");
+        //fflush(stderr);
     }
+    auto kcache = kcache_future.get();
+    if (!kcache || !*kcache)
+        return -1;
 
     for (int i = 1; i < argc; i++) {
         const auto addr = std::strtoul(argv[i], nullptr, 0);
         const auto r = kcache->lookup_symbol(addr);
-        printf("%s: %s+0x%lx\n", argv[i], r.first.c_str(), r.second);
+        printf("%s: %s+0x%zx\n", argv[i], r.first ? r.first : "n/a", r.second);
     }
 }
 #endif
@@ -1,28 +1,153 @@
 #pragma once
 
-#include <map>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
 
+#include "kernel_layout.hh"
+
+struct kallsyms_builder;
+struct kallsyms_elf;
+
+// Reads a whole file, including /proc files that report size 0.
+bool read_file(const char *filename, std::vector<char> &out);
+
+// A module object file and where its sections are loaded.
+struct kallsyms_module_file {
+    std::string name;
+    std::string path;       // uncompressed .ko
+    uint64_t base = 0;      // from /proc/modules
+    // load addresses from /sys/module/NAME/sections; if empty, executable
+    // sections are laid out from base the way the module loader does
+    std::vector<std::pair<std::string, uint64_t>> sections;
+};
+
+// First vmlinux among the usual debug and boot locations for the
+// release in layout, "" if there is none.
+std::string find_vmlinux(const kernel_layout &layout);
+// Uncompressed .ko files of layout's modules per modules.dep. With
+// read_sections, section addresses of the running kernel are filled in
+// where /sys/module allows it.
+std::vector<kallsyms_module_file> find_module_files(const kernel_layout &layout, bool read_sections);
+
+// Immutable symbol index built from /proc/kallsyms or from ELF symbol
+// tables.
+//
+// Symbols are split into segments: one for the core kernel and one per
+// module ("[name]" in kallsyms). A segment keeps its addresses in one
+// sorted array, with a parallel array of offsets into a NUL-separated
+// string arena. Symbols sharing an address are joined as "a/b" in the
+// order they appear in kallsyms. Segments are immutable and shared, so a
+// refreshed cache only builds the modules that changed.
 struct kallsyms_cache {
-    kallsyms_cache();
+    // threads == 0 picks the parser thread count from the hardware
+    explicit kallsyms_cache(unsigned threads = 0);
+    // from a /proc/kallsyms snapshot, e.g. a capture file header
+    kallsyms_cache(const char *text, size_t len, unsigned threads = 0);
+    // prev with the named modules re-read from /proc/kallsyms; those no
+    // longer loaded are dropped. The core kernel is not parsed again.
+    kallsyms_cache(const kallsyms_cache &prev, const std::vector<std::string> &modules,
+                   const char *path = "/proc/kallsyms");
+    // From the .symtab of vmlinux and module files, read through mmap.
+    // vmlinux symbols are moved by the KASLR slide: text_base, the runtime
+    // address of _text, minus its link-time address. 0 means no slide.
+    static std::unique_ptr<kallsyms_cache> from_elf(const char *vmlinux, uint64_t text_base,
+                                                    const std::vector<kallsyms_module_file> &modules);
     ~kallsyms_cache();
-    operator bool() const { return !cache.empty(); }
-
-    struct loc_result {
-        const char *symbol;
-        size_t offset;
-    };
+    operator bool() const { return total != 0; }
 
-    std::pair<const char *, size_t> lookup_symbol(uint64_t key);
+    std::pair<const char *, size_t> lookup_symbol(uint64_t key) const;
 
     // std::pair<const std::string &, size_t> lookup_symbol(void *pc)
     // {
     //     return lookup_symbol(reinterpret_cast<uint64_t>(pc));
     // }
 
-    const std::map<uint64_t, std::string>::const_iterator begin() const { return cache.cbegin(); }
-    const std::map<uint64_t, std::string>::const_iterator end() const { return cache.cend(); }
+    size_t size() const { return total; }
+    size_t segment_count() const { return segments.size(); }
+
+    struct load_stats {
+        size_t lines = 0;
+        size_t duplicates = 0;
+        size_t threads = 0;
+        size_t segments_built = 0;
+        bool hidden = false;            // kallsyms addresses were all 0 (kptr_restrict)
+        std::chrono::nanoseconds read_time{0};
+        std::chrono::nanoseconds parse_time{0};
+        std::chrono::nanoseconds index_time{0};
+    };
+    const load_stats &stats() const { return load; }
+
+    // Segment by segment in address order of their first symbol; sorted
+    // overall unless a module interleaves with the core kernel.
+    struct const_iterator {
+        using iterator_category = std::random_access_iterator_tag;
+        using value_type = std::pair<uint64_t, const char *>;
+        using difference_type = std::ptrdiff_t;
+        using pointer = void;
+        using reference = value_type;
+
+        value_type operator*() const { return cache->at(idx); }
+        value_type operator[](difference_type n) const { return cache->at(idx + n); }
+        const_iterator &operator++() { ++idx; return *this; }
+        const_iterator operator++(int) { auto tmp = *this; ++idx; return tmp; }
+        const_iterator &operator--() { --idx; return *this; }
+        const_iterator operator--(int) { auto tmp = *this; --idx; return tmp; }
+        const_iterator &operator+=(difference_type n) { idx += n; return *this; }
+        const_iterator &operator-=(difference_type n) { idx -= n; return *this; }
+        const_iterator operator+(difference_type n) const { return const_iterator{cache, idx + n}; }
+        friend const_iterator operator+(difference_type n, const const_iterator &it) { return it + n; }
+        const_iterator operator-(difference_type n) const { return const_iterator{cache, idx - n}; }
+        difference_type operator-(const const_iterator &rhs) const { return idx - rhs.idx; }
+        bool operator==(const const_iterator &rhs) const { return idx == rhs.idx; }
+        bool operator!=(const const_iterator &rhs) const { return idx != rhs.idx; }
+        bool operator<(const const_iterator &rhs) const { return idx < rhs.idx; }
+        bool operator>(const const_iterator &rhs) const { return idx > rhs.idx; }
+        bool operator<=(const const_iterator &rhs) const { return idx <= rhs.idx; }
+        bool operator>=(const const_iterator &rhs) const { return idx >= rhs.idx; }
+
+        const kallsyms_cache *cache;
+        size_t idx;
+    };
+
+    const_iterator begin() const { return const_iterator{this, 0}; }
+    const_iterator end() const { return const_iterator{this, total}; }
 
 private:
+    friend struct kallsyms_builder;
+    friend struct kallsyms_elf;
+
+    struct elf_tag {};
+    kallsyms_cache(elf_tag, const char *vmlinux, uint64_t text_base,
+                   const std::vector<kallsyms_module_file> &modules);
+
+    struct segment {
+        std::string module;             // empty for the core kernel
+        std::vector<uint64_t> addrs;
+        std::vector<uint32_t> name_offsets;
+        std::vector<char> names;
+
+        const char *name(size_t idx) const { return &names[name_offsets[idx]]; }
+        // last symbol at or below key; key must not be below addrs[0]
+        size_t find(uint64_t key) const;
+    };
+
+    void build(kallsyms_builder &builder, unsigned threads);
+    // Sorts segments and recomputes the flat index.
+    void index();
+    std::pair<uint64_t, const char *> at(size_t idx) const;
 
-    std::map<uint64_t, std::string> cache;
+    // sorted by first address
+    std::vector<std::shared_ptr<const segment>> segments;
+    // per segment: first address, flat index of its first symbol
+    std::vector<uint64_t> firsts;
+    std::vector<size_t> starts;
+    const segment *core = nullptr;
+    size_t total = 0;
+    load_stats load;
 };
@@ -0,0 +1,167 @@
+#include "kernel_layout.hh"
+
+#include <elf.h>
+#include <sys/utsname.h>
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+
+std::string read_build_id(const char *notes_path)
+{
+    FILE *f = fopen(notes_path, "rb");
+    if (!f)
+        return std::string();
+    unsigned char buf[4096];
+    const size_t len = fread(buf, 1, sizeof(buf), f);
+    fclose(f);
+
+    static const char hex[] = "0123456789abcdef";
+    size_t pos = 0;
+    while (pos + sizeof(Elf64_Nhdr) <= len) {
+        Elf64_Nhdr nhdr;
+        memcpy(&nhdr, &buf[pos], sizeof(nhdr));
+        const size_t name = pos + sizeof(nhdr);
+        const size_t desc = name + ((nhdr.n_namesz + 3) & ~3u);
+        const size_t next = desc + ((nhdr.n_descsz + 3) & ~3u);
+        if (next > len)
+            break;
+        if (nhdr.n_type == NT_GNU_BUILD_ID && nhdr.n_namesz == 4 &&
+            memcmp(&buf[name], "GNU", 4) == 0) {
+            std::string id;
+            for (size_t i = 0; i < nhdr.n_descsz; i++) {
+                id.push_back(hex[buf[desc + i] >> 4]);
+                id.push_back(hex[buf[desc + i] & 0xf]);
+            }
+            return id;
+        }
+        pos = next;
+    }
+    return std::string();
+}
+
+// _text is among the first lines of /proc/kallsyms; stop reading there.
+static uint64_t read_text_base()
+{
+    FILE *f = fopen("/proc/kallsyms", "r");
+    if (!f)
+        return 0;
+    char line[512];
+    uint64_t addr = 0;
+    while (fgets(line, sizeof(line), f)) {
+        char *end;
+        const uint64_t a = strtoull(line, &end, 16);
+        if (strcmp(end, " T _text\n") == 0 || strcmp(end, " t _text\n") == 0) {
+            addr = a;
+            break;
+        }
+    }
+    fclose(f);
+    return addr;
+}
+
+kernel_layout kernel_layout::read()
+{
+    kernel_layout layout;
+
+    utsname uts;
+    layout.kernel.name = "vmlinux";
+    if (uname(&uts) == 0) {
+        layout.kernel.name.append(" ");
+        layout.kernel.name.append(uts.release);
+    }
+    layout.kernel.build_id = read_build_id("/sys/kernel/notes");
+    layout.kernel.base = read_text_base();
+
+    // "name size refcnt deps state addr [taint]"
+    FILE *f = fopen("/proc/modules", "r");
+    if (f) {
+        char line[4096];
+        while (fgets(line, sizeof(line), f)) {
+            char name[256];
+            unsigned long long size;
+            unsigned long long base;
+            if (sscanf(line, "%255s %llu %*s %*s %*s %llx", name, &size, &base) != 3)
+                continue;
+            kernel_module mod;
+            mod.name = name;
+            mod.base = base;
+            mod.size = size;
+            const std::string notes = std::string("/sys/module/") + name + "/notes/.note.gnu.build-id";
+            mod.build_id = read_build_id(notes.c_str());
+            layout.modules.push_back(std::move(mod));
+        }
+        fclose(f);
+    }
+    std::sort(std::begin(layout.modules), std::end(layout.modules),
+              [](const kernel_module &a, const kernel_module &b) { return a.base < b.base; });
+
+    return layout;
+}
+
+std::string kernel_layout::serialize() const
+{
+    std::string out;
+    auto append = [&out](const kernel_module &m) {
+        char line[128];
+        snprintf(line, sizeof(line), " %" PRIx64 " %" PRIu64 "\n", m.base, m.size);
+        // kernel name carries the release after a space; keep fields separable
+        std::string name = m.name;
+        std::replace(std::begin(name), std::end(name), ' ', '/');
+        out.append(name);
+        out.append(" ");
+        out.append(m.build_id.empty() ? "-" : m.build_id);
+        out.append(line);
+    };
+    append(kernel);
+    for (const auto &m: modules)
+        append(m);
+    return out;
+}
+
+kernel_layout kernel_layout::parse(const char *text, size_t len)
+{
+    kernel_layout layout;
+    const std::string copy(text, len);
+    size_t pos = 0;
+    bool first = true;
+    while (pos < copy.size()) {
+        size_t nl = copy.find('\n', pos);
+        if (nl == std::string::npos)
+            nl = copy.size();
+        char name[256];
+        char build_id[256];
+        unsigned long long base;
+        unsigned long long size;
+        if (sscanf(copy.substr(pos, nl - pos).c_str(), "%255s %255s %llx %llu",
+                   name, build_id, &base, &size) == 4) {
+            kernel_module mod;
+            mod.name = name;
+            if (first)
+                std::replace(std::begin(mod.name), std::end(mod.name), '/', ' ');
+            mod.build_id = strcmp(build_id, "-") == 0 ? "" : build_id;
+            mod.base = base;
+            mod.size = size;
+            if (first)
+                layout.kernel = std::move(mod);
+            else
+                layout.modules.push_back(std::move(mod));
+            first = false;
+        }
+        pos = nl + 1;
+    }
+    std::sort(std::begin(layout.modules), std::end(layout.modules),
+              [](const kernel_module &a, const kernel_module &b) { return a.base < b.base; });
+    return layout;
+}
+
+const kernel_module *kernel_layout::module_of(uint64_t pc) const
+{
+    auto it = std::upper_bound(std::begin(modules), std::end(modules), pc,
+                               [](uint64_t pc, const kernel_module &m) { return pc < m.base; });
+    if (it == std::begin(modules))
+        return nullptr;
+    --it;
+    return pc - it->base < it->size ? &*it : nullptr;
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Identity and load addresses of the running kernel and its modules.
+//
+// Two layouts compare equal for a module only if the same binary (build-id)
+// is loaded at the same address, so KASLR and module reloads are detected.
+struct kernel_module {
+    std::string name;
+    std::string build_id;   // hex, empty if unknown
+    uint64_t base = 0;
+    uint64_t size = 0;
+
+    bool same_as(const kernel_module &other) const
+    {
+        return name == other.name && build_id == other.build_id
+            && base == other.base && size == other.size;
+    }
+};
+
+struct kernel_layout {
+    // Reads uname, /sys/kernel/notes, /proc/kallsyms (_text only),
+    // /proc/modules and /sys/module/*/notes.
+    static kernel_layout read();
+
+    // One "name build_id base size" line per module, kernel first.
+    // Used to carry the layout in capture files.
+    std::string serialize() const;
+    static kernel_layout parse(const char *text, size_t len);
+
+    // Module covering pc, or nullptr for core kernel text.
+    const kernel_module *module_of(uint64_t pc) const;
+
+    // core kernel as a pseudo module: "vmlinux <release>" at _text
+    kernel_module kernel;
+    // sorted by base
+    std::vector<kernel_module> modules;
+};
+
+// Hex encoded NT_GNU_BUILD_ID from an ELF note file, empty on failure.
+std::string read_build_id(const char *notes_path);
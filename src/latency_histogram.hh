@@ -0,0 +1,103 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Log-linear latency histogram in the style of HdrHistogram.
+//
+// Values below 16 have a bucket each; above, every power of two is split
+// into 16 linear buckets, so a bucket is at most 1/16 of its lower bound
+// wide and a percentile is within ~6% of the true value over the whole
+// uint64 range.
+//
+// A histogram has a single writing thread. Counters are relaxed atomics
+// that it updates with a plain load and store, no lock and no
+// read-modify-write, so recording stays cheap enough to leave on; other
+// threads may read() a copy at any time, which is at most a few updates
+// stale.
+struct latency_histogram {
+    static const int sub_bits = 4;
+    static const size_t sub_buckets = size_t(1) << sub_bits;
+    static const size_t buckets = (64 - sub_bits + 1) * sub_buckets;
+
+    // A plain copy, for percentiles and for the difference of two copies.
+    struct snapshot {
+        uint64_t count = 0;
+        uint64_t sum = 0;
+        uint64_t counts[buckets] = {};
+
+        // Upper bound of the bucket holding the p-th percentile (0..100); 0 if empty.
+        uint64_t percentile(double p) const
+        {
+            if (!count)
+                return 0;
+            uint64_t rank = static_cast<uint64_t>(p / 100 * count + 0.5);
+            rank = rank < 1 ? 1 : rank > count ? count : rank;
+            uint64_t seen = 0;
+            for (size_t i = 0; i < buckets; i++) {
+                seen += counts[i];
+                if (seen >= rank)
+                    return upper_bound(i);
+            }
+            return upper_bound(buckets - 1);
+        }
+
+        uint64_t mean() const { return count ? sum / count : 0; }
+
+        // What was recorded after earlier was taken.
+        snapshot since(const snapshot &earlier) const
+        {
+            snapshot d;
+            d.count = count - earlier.count;
+            d.sum = sum - earlier.sum;
+            for (size_t i = 0; i < buckets; i++)
+                d.counts[i] = counts[i] - earlier.counts[i];
+            return d;
+        }
+    };
+
+    // writer only
+    void record(uint64_t value)
+    {
+        bump(counts[index(value)], 1);
+        bump(total, 1);
+        bump(sum, value);
+    }
+
+    void read(snapshot &out) const
+    {
+        out.count = total.load(std::memory_order_relaxed);
+        out.sum = sum.load(std::memory_order_relaxed);
+        for (size_t i = 0; i < buckets; i++)
+            out.counts[i] = counts[i].load(std::memory_order_relaxed);
+    }
+
+    static size_t index(uint64_t value)
+    {
+        if (value < sub_buckets)
+            return value;
+        const int msb = 63 - __builtin_clzll(value);
+        const int shift = msb - sub_bits;
+        return (shift + 1) * sub_buckets + (value >> shift) - sub_buckets;
+    }
+
+    static uint64_t upper_bound(size_t index)
+    {
+        if (index < sub_buckets)
+            return index;
+        const int shift = index / sub_buckets - 1;
+        const uint64_t lower = (sub_buckets + index % sub_buckets) << shift;
+        return lower + ((uint64_t(1) << shift) - 1);
+    }
+
+private:
+    static void bump(std::atomic<uint64_t> &counter, uint64_t by)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + by, std::memory_order_relaxed);
+    }
+
+    std::atomic<uint64_t> counts[buckets] = {};
+    std::atomic<uint64_t> total{0};
+    std::atomic<uint64_t> sum{0};
+};
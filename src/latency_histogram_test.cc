@@ -0,0 +1,68 @@
+// latency_histogram bucket boundaries and percentiles.
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+
+#include "latency_histogram.hh"
+
+#define CHECK(cond) do { if (!(cond)) { \
+    fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); exit(1); } } while (0)
+
+using hist = latency_histogram;
+
+static void check_bucket(uint64_t value, size_t index, uint64_t upper)
+{
+    CHECK(hist::index(value) == index);
+    CHECK(hist::upper_bound(index) == upper);
+}
+
+int main()
+{
+    // exact below 16, then 16 buckets per power of two
+    check_bucket(0, 0, 0);
+    check_bucket(15, 15, 15);
+    check_bucket(16, 16, 16);
+    check_bucket(31, 31, 31);
+    check_bucket(32, 32, 33);
+    check_bucket(33, 32, 33);
+    check_bucket(34, 33, 35);
+    check_bucket(UINT64_MAX, hist::buckets - 1, UINT64_MAX);
+    CHECK(hist::buckets - 1 == 975);
+
+    // every bucket holds exactly the values between its neighbours' bounds
+    for (size_t i = 1; i < hist::buckets; i++) {
+        const uint64_t first = hist::upper_bound(i - 1) + 1;
+        CHECK(hist::index(first) == i);
+        CHECK(hist::index(first - 1) == i - 1);
+        CHECK(hist::index(hist::upper_bound(i)) == i);
+    }
+
+    hist h;
+    hist::snapshot empty;
+    h.read(empty);
+    CHECK(empty.percentile(50) == 0 && empty.mean() == 0);
+
+    // 1..100 once each: the rank-th value's bucket bound
+    for (uint64_t v = 1; v <= 100; v++)
+        h.record(v);
+    hist::snapshot s;
+    h.read(s);
+    CHECK(s.count == 100 && s.sum == 5050 && s.mean() == 50);
+    CHECK(s.percentile(0) == 1);
+    CHECK(s.percentile(10) == 10);
+    CHECK(s.percentile(50) == 51);      // 50 is in [50, 51]
+    CHECK(s.percentile(90) == 91);      // 90 is in [88, 91]
+    CHECK(s.percentile(99) == 99);      // 99 is in [96, 99]
+    CHECK(s.percentile(100) == 103);    // 100 is in [100, 103]
+
+    // since() leaves only the later values
+    for (int i = 0; i < 10; i++)
+        h.record(1000);
+    hist::snapshot later;
+    h.read(later);
+    const hist::snapshot d = later.since(s);
+    CHECK(d.count == 10 && d.sum == 10000);
+    CHECK(d.percentile(1) == 1023 && d.percentile(100) == 1023);   // 1000 is in [992, 1023]
+    return 0;
+}
@@ -0,0 +1,246 @@
+#include "metrics.hh"
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <netdb.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "common.hh"
+#include "unix_socket.hh"
+
+static const size_t max_connections = 16;
+static const size_t max_request = 4096;
+static const uint64_t request_timeout_ns = 5000000000ull;
+
+void metrics_builder::family(const char *name, const char *type, const char *help)
+{
+    text += "# HELP ";
+    text += name;
+    text += ' ';
+    text += help;
+    text += "\n# TYPE ";
+    text += name;
+    text += ' ';
+    text += type;
+    text += '\n';
+}
+
+void metrics_builder::escaped(const char *s)
+{
+    for (; *s; s++) {
+        switch (*s) {
+        case '\\': text += "\\\\"; break;
+        case '"': text += "\\\""; break;
+        case '\n': text += "\\n"; break;
+        default: text += *s; break;
+        }
+    }
+}
+
+void metrics_builder::sample(const char *name,
+                             std::initializer_list<std::pair<const char *, const char *>> labels,
+                             uint64_t value)
+{
+    text += name;
+    char sep = '{';
+    for (const auto &label: labels) {
+        if (!label.second)
+            continue;
+        text += sep;
+        text += label.first;
+        text += "=\"";
+        escaped(label.second);
+        text += '"';
+        sep = ',';
+    }
+    if (sep == ',')
+        text += '}';
+    char num[24];
+    snprintf(num, sizeof(num), " %" PRIu64 "\n", value);
+    text += num;
+}
+
+metrics_server::~metrics_server()
+{
+    for (const auto &conn: conns)
+        close(conn.fd);
+    if (listen_fd != -1)
+        close(listen_fd);
+    if (!unix_path.empty())
+        unlink(unix_path.c_str());
+}
+
+bool metrics_server::listen(const char *address)
+{
+    if (strncmp(address, "unix:", 5) == 0 || address[0] == '/') {
+        const char *path = address[0] == '/' ? address : address + 5;
+        listen_fd = unix_listen("metrics", path, max_connections);
+        if (listen_fd == -1)
+            return false;
+        unix_path = path;
+        return true;
+    }
+
+    std::string host(address);
+    const auto colon = host.rfind(':');
+    if (colon == std::string::npos) {
+        fprintf(stderr, "metrics address \"%s\" is not HOST:PORT or unix:PATH\n", address);
+        return false;
+    }
+    const std::string port = host.substr(colon + 1);
+    host.resize(colon);
+    if (host.size() >= 2 && host.front() == '[' && host.back() == ']')
+        host = host.substr(1, host.size() - 2);
+
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    addrinfo *res = nullptr;
+    const int rc = getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &res);
+    if (rc != 0) {
+        fprintf(stderr, "metrics address \"%s\": %s\n", address, gai_strerror(rc));
+        return false;
+    }
+    for (const addrinfo *ai = res; ai; ai = ai->ai_next) {
+        listen_fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+        if (listen_fd == -1)
+            continue;
+        const int one = 1;
+        setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(listen_fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        close(listen_fd);
+        listen_fd = -1;
+    }
+    freeaddrinfo(res);
+    if (listen_fd == -1) {
+        fprintf(stderr, "metrics: cannot bind %s: %s\n", address, strerror(errno));
+        return false;
+    }
+    if (::listen(listen_fd, max_connections) == -1) {
+        perror("listen");
+        return false;
+    }
+    return true;
+}
+
+void metrics_server::add_pollfds(std::vector<pollfd> &fds) const
+{
+    fds.push_back(pollfd{listen_fd, POLLIN, 0});
+    for (const auto &conn: conns)
+        fds.push_back(pollfd{conn.fd, static_cast<short>(conn.responding ? POLLOUT : POLLIN), 0});
+}
+
+void metrics_server::handle(const pollfd *fds, size_t count)
+{
+    // conns is in the order add_pollfds() saw it; new connections come last
+    const uint64_t now = monotonic_ns();
+    size_t kept = 0;
+    for (size_t i = 0; i < conns.size(); i++) {
+        connection &conn = conns[i];
+        const short revents = i + 1 < count ? fds[i + 1].revents : 0;
+        bool open = now < conn.deadline;
+        if (open && revents)
+            open = conn.responding ? write_response(conn) : read_request(conn);
+        if (!open) {
+            close(conn.fd);
+            continue;
+        }
+        if (kept != i)
+            conns[kept] = std::move(conn);
+        kept++;
+    }
+    conns.resize(kept);
+
+    if (count && (fds[0].revents & POLLIN))
+        accept_all();
+}
+
+void metrics_server::accept_all()
+{
+    while (conns.size() < max_connections) {
+        const int fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED && errno != EINTR)
+                perror("metrics: accept");
+            return;
+        }
+        connection conn;
+        conn.fd = fd;
+        conn.deadline = monotonic_ns() + request_timeout_ns;
+        conns.push_back(std::move(conn));
+    }
+}
+
+bool metrics_server::read_request(connection &conn)
+{
+    char buf[1024];
+    for (;;) {
+        const ssize_t n = recv(conn.fd, buf, sizeof(buf), 0);
+        if (n == 0)
+            return false;
+        if (n == -1)
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        conn.request.append(buf, n);
+        if (conn.request.find("\r\n\r\n") != std::string::npos
+            || conn.request.find("\n\n") != std::string::npos
+            || conn.request.size() >= max_request)
+            break;
+    }
+    respond(conn);
+    return write_response(conn);
+}
+
+void metrics_server::respond(connection &conn)
+{
+    const char *status = "200 OK";
+    const auto line_end = conn.request.find_first_of("\r\n");
+    const std::string line = conn.request.substr(0, line_end);
+    if (line.compare(0, 4, "GET ") != 0) {
+        status = "405 Method Not Allowed";
+    } else {
+        const auto path_end = line.find(' ', 4);
+        const std::string path = line.substr(4, path_end == std::string::npos ? std::string::npos : path_end - 4);
+        if (path != "/metrics" && path != "/")
+            status = "404 Not Found";
+    }
+
+    static const auto empty = std::make_shared<const std::string>();
+    conn.body = strcmp(status, "200 OK") == 0 ? page.get() : empty;
+    char header[256];
+    snprintf(header, sizeof(header),
+             "HTTP/1.0 %s\r\n"
+             "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+             "Content-Length: %zu\r\n"
+             "Connection: close\r\n\r\n",
+             status, conn.body->size());
+    conn.header = header;
+    conn.request.clear();
+    conn.responding = true;
+    served++;
+}
+
+bool metrics_server::write_response(connection &conn)
+{
+    const size_t total = conn.header.size() + conn.body->size();
+    while (conn.sent < total) {
+        ssize_t n;
+        if (conn.sent < conn.header.size())
+            n = send(conn.fd, conn.header.data() + conn.sent, conn.header.size() - conn.sent,
+                     MSG_NOSIGNAL | (conn.body->empty() ? 0 : MSG_MORE));
+        else
+            n = send(conn.fd, conn.body->data() + conn.sent - conn.header.size(),
+                     total - conn.sent, MSG_NOSIGNAL);
+        if (n == -1)
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        conn.sent += n;
+    }
+    return false;
+}
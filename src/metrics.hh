@@ -0,0 +1,87 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <poll.h>
+
+// Prometheus text exposition (version 0.0.4), which OpenMetrics scrapers
+// accept as well.
+
+// The current page. The output thread renders a new page and swaps it in
+// whole; a scrape takes a reference to the page it sends, so neither side
+// waits for the other and a page is never seen half written.
+struct metrics_page {
+    void publish(std::string text)
+    {
+        std::atomic_store(&page, std::make_shared<const std::string>(std::move(text)));
+    }
+
+    std::shared_ptr<const std::string> get() const { return std::atomic_load(&page); }
+
+private:
+    std::shared_ptr<const std::string> page = std::make_shared<const std::string>();
+};
+
+// Appends metric families and samples to a page being rendered.
+struct metrics_builder {
+    // # HELP and # TYPE lines; type is "counter" or "gauge"
+    void family(const char *name, const char *type, const char *help);
+    // name{key="value",...} value; labels with a null value are left out
+    void sample(const char *name, std::initializer_list<std::pair<const char *, const char *>> labels,
+                uint64_t value);
+
+    std::string text;
+
+private:
+    void escaped(const char *s);
+};
+
+// Serves the page over HTTP on a TCP or UNIX stream socket.
+//
+// Everything is non-blocking and driven by the caller's poll loop:
+// add_pollfds() before poll(), handle() with the same entries after it.
+// Each connection gets one response and is closed.
+struct metrics_server {
+    explicit metrics_server(const metrics_page &page) : page(page) {}
+    ~metrics_server();
+    metrics_server(const metrics_server &) = delete;
+    metrics_server &operator=(const metrics_server &) = delete;
+
+    // "HOST:PORT", "[V6ADDR]:PORT", ":PORT" (all addresses) or
+    // "unix:PATH" / an absolute PATH.
+    bool listen(const char *address);
+
+    void add_pollfds(std::vector<pollfd> &fds) const;
+    void handle(const pollfd *fds, size_t count);
+
+    uint64_t scrapes() const { return served; }
+
+private:
+    struct connection {
+        int fd;
+        uint64_t deadline;                      // monotonic ns
+        std::string request;
+        std::string header;
+        std::shared_ptr<const std::string> body;
+        size_t sent = 0;                        // of header + body
+        bool responding = false;
+    };
+
+    void accept_all();
+    // false when the connection is done or broken
+    bool read_request(connection &conn);
+    bool write_response(connection &conn);
+    void respond(connection &conn);
+
+    const metrics_page &page;
+    int listen_fd = -1;
+    std::string unix_path;
+    std::vector<connection> conns;
+    uint64_t served = 0;
+};
@@ -9,11 +9,53 @@
 #include "common.hh"
 
 //#ifdef TEST_DRIVER
-#include <cassert>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
 
-drop_mon_t::drop_mon_t(const std::function<void(void *, size_t)> &callback)
+#include <poll.h>
+
+// A generic netlink request built in place: nlmsghdr, genlmsghdr, attributes.
+struct drop_mon_t::request {
+    request(int family, uint8_t cmd)
+    {
+        memset(buf, 0, sizeof(buf));
+        auto nlh = reinterpret_cast<nlmsghdr *>(buf);
+        nlh->nlmsg_len = NLMSG_LENGTH(GENL_HDRLEN);
+        nlh->nlmsg_type = family;
+        nlh->nlmsg_flags = NLM_F_REQUEST;
+        auto genl = static_cast<genlmsghdr *>(NLMSG_DATA(nlh));
+        genl->cmd = cmd;
+        genl->version = 2;
+    }
+
+    nlmsghdr *hdr() { return reinterpret_cast<nlmsghdr *>(buf); }
+
+    void attr(uint16_t type, const void *data, uint16_t len)
+    {
+        auto nla = reinterpret_cast<nlattr *>(buf + NLMSG_ALIGN(hdr()->nlmsg_len));
+        nla->nla_type = type;
+        nla->nla_len = NLA_HDRLEN + len;
+        memcpy(reinterpret_cast<unsigned char *>(nla) + NLA_HDRLEN, data, len);
+        hdr()->nlmsg_len = NLMSG_ALIGN(hdr()->nlmsg_len) + NLA_ALIGN(nla->nla_len);
+    }
+    void flag(uint16_t type) { attr(type, nullptr, 0); }
+    void u8(uint16_t type, uint8_t v) { attr(type, &v, sizeof(v)); }
+    void u32(uint16_t type, uint32_t v) { attr(type, &v, sizeof(v)); }
+
+    unsigned char buf[128];
+};
+
+// ODR-used by std::min, which binds references
+const size_t drop_mon_t::rx_batch;
+const size_t drop_mon_t::rx_bufsize;
+
+drop_mon_t::drop_mon_t(const callback_t &callback)
     : callback(callback)
 {
+    init_pool();
+
     // resolve family id
     sock = nl_socket_alloc();
     int err = genl_connect(sock);
@@ -44,6 +86,26 @@ drop_mon_t::drop_mon_t(const std::function<void(void *, size_t)> &callback)
     }
 }
 
+drop_mon_t::drop_mon_t(const callback_t &callback, int family, int fd)
+    : family(family), sock(nullptr), fd(fd), seq(0), callback(callback)
+{
+    init_pool();
+}
+
+void drop_mon_t::init_pool()
+{
+    rx_pool.resize(rx_batch * rx_bufsize);
+    rx_iov.resize(rx_batch);
+    rx_msgs.resize(rx_batch);
+    for (size_t i = 0; i < rx_batch; i++) {
+        rx_iov[i].iov_base = &rx_pool[i * rx_bufsize];
+        rx_iov[i].iov_len = rx_bufsize;
+        memset(&rx_msgs[i], 0, sizeof(rx_msgs[i]));
+        rx_msgs[i].msg_hdr.msg_iov = &rx_iov[i];
+        rx_msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+}
+
 drop_mon_t::~drop_mon_t()
 {
     if (sock) {
@@ -52,21 +114,94 @@ drop_mon_t::~drop_mon_t()
     }
 }
 
-bool drop_mon_t::start()
+bool drop_mon_t::start(const drop_mon_config &config)
 {
-    if (send(NLM_F_REQUEST | NLM_F_ACK, NET_DM_CMD_START)) {
-        nl_socket_set_nonblocking(sock);
-        return true;
+    active = config;
+    bool v2 = false;
+    if (config.packet_mode || config.trunc_len || config.queue_len) {
+        request req(family, NET_DM_CMD_CONFIG);
+        req.u8(NET_DM_ATTR_ALERT_MODE, config.packet_mode ? NET_DM_ALERT_MODE_PACKET
+                                                          : NET_DM_ALERT_MODE_SUMMARY);
+        if (config.trunc_len)
+            req.u32(NET_DM_ATTR_TRUNC_LEN, config.trunc_len);
+        if (config.queue_len)
+            req.u32(NET_DM_ATTR_QUEUE_LEN, config.queue_len);
+        const int err = transact(req);
+        if (err == 0) {
+            v2 = true;
+        } else {
+            // before 5.4 NET_DM_CMD_CONFIG is a stub returning -EOPNOTSUPP
+            fprintf(stderr, "NET_DM configuration rejected (%s), using legacy summary alerts\n",
+                    strerror(-err));
+            active.packet_mode = false;
+            active.trunc_len = 0;
+            active.queue_len = 0;
+        }
     }
-    return false;
+
+    for (;;) {
+        request req(family, NET_DM_CMD_START);
+        // old kernels ignore these attributes
+        if (active.sw_drops || !active.hw_drops)
+            req.flag(NET_DM_ATTR_SW_DROPS);
+        if (active.hw_drops)
+            req.flag(NET_DM_ATTR_HW_DROPS);
+        const int err = transact(req);
+        if (err == 0)
+            break;
+        if (active.hw_drops && err != -EBUSY) {
+            fprintf(stderr, "hardware drop monitoring rejected (%s), software drops only\n",
+                    strerror(-err));
+            active.hw_drops = false;
+            active.sw_drops = true;
+            continue;
+        }
+        fprintf(stderr, "NET_DM_CMD_START failed: %s\n", strerror(-err));
+        return false;
+    }
+    if (!v2 && active.hw_drops)
+        fprintf(stderr, "kernel may not support hardware drop monitoring\n");
+
+    if (sock)
+        nl_socket_set_nonblocking(sock);
+    return true;
 }
 
 bool drop_mon_t::stop()
 {
-    return send(NLM_F_REQUEST | NLM_F_ACK, NET_DM_CMD_STOP);
+    // not waiting for the ACK, alerts in flight are still drained
+    request req(family, NET_DM_CMD_STOP);
+    req.hdr()->nlmsg_flags |= NLM_F_ACK;
+    return send(req);
 }
 
-int drop_mon_t::get_fd() const { return sock ? nl_socket_get_fd(sock) : -1; }
+bool drop_mon_t::no_callback() const
+{
+    fprintf(stderr, "drop_mon_t: no callback given, pass a handler to try_rx() or feed()\n");
+    return false;
+}
+
+int drop_mon_t::get_fd() const { return sock ? nl_socket_get_fd(sock) : fd; }
+
+int drop_mon_t::set_rcvbuf(int bytes)
+{
+    const int fd = get_fd();
+    if (fd == -1)
+        return -1;
+    // SO_RCVBUFFORCE needs CAP_NET_ADMIN, which NET_DM requires anyway
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &bytes, sizeof(bytes)) == -1 &&
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bytes, sizeof(bytes)) == -1) {
+        perror("setsockopt(SO_RCVBUF)");
+        return -1;
+    }
+    int effective = 0;
+    socklen_t len = sizeof(effective);
+    if (getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &effective, &len) == -1) {
+        perror("getsockopt(SO_RCVBUF)");
+        return -1;
+    }
+    return effective;
+}
 
 
 const char *net_dm_string(uint8_t cmd)
@@ -93,123 +228,282 @@ const char *nlmsg_type_string(uint16_t nlmsg_type)
     }
 }
 
-bool drop_mon_t::try_rx() const
+int drop_mon_t::receive()
 {
-    int len = 0;
-    unsigned char *buf = nullptr;
-    do {
-        sockaddr_nl addr;
-        int rc = nl_recv(sock, &addr, &buf, NULL);
-        if (rc < 0) {
-            if (errno == EINTR) {
-                perror("nl_recv");
+    const int fd = get_fd();
+    for (;;) {
+        for (auto &msg: rx_msgs) {
+            msg.msg_hdr.msg_flags = 0;
+            msg.msg_len = 0;
+        }
+        const int n = recvmmsg(fd, rx_msgs.data(), rx_msgs.size(), MSG_DONTWAIT, nullptr);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            else if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            else if (errno == ENOBUFS) {
+                // socket overflowed, alerts were dropped; it stays usable
+                rx_stats.overruns++;
                 continue;
             }
-            else if (errno == EAGAIN) {
-                //perror("nl_recv");
-                break;
-            }
-            perror("nl_recv");
-            free(buf);
-            return false;
+            perror("recvmmsg");
+            return -1;
         }
-        // printf("nl_recv: %d from pid %d\n", rc, addr.nl_pid);
-        len += rc;
-    } while (false);
+        rx_stats.rx_calls++;
+        for (int i = 0; i < n; i++) {
+            const auto &msg = rx_msgs[i];
+            if (msg.msg_hdr.msg_flags & MSG_TRUNC)
+                rx_stats.truncated++;
+            rx_stats.datagrams++;
+            rx_stats.bytes += msg.msg_len;
+            if (rx_hook)
+                rx_hook(msg.msg_hdr.msg_iov->iov_base, std::min<size_t>(msg.msg_len, rx_bufsize));
+        }
+        return n;
+    }
+}
 
-    for (nlmsghdr *nlhdr = (nlmsghdr *)buf; nlmsg_ok(nlhdr, len); nlhdr = nlmsg_next(nlhdr, &len)) {
+// NLA_F_NESTED and NLA_F_NET_BYTEORDER are not part of the type
+static inline int attr_type(const nlattr *nla) { return nla->nla_type & NLA_TYPE_MASK; }
 
-        // fprintf(stderr, "  type: %d/%s total=%d nlmsg_len=%u flags=0x%x ",
-        //         nlhdr->nlmsg_type,
-        //         nlmsg_type_string(nlhdr->nlmsg_type),
-        //         len, nlhdr->nlmsg_len, nlhdr->nlmsg_flags);
+static inline const void *attr_data(const nlattr *nla)
+{
+    return reinterpret_cast<const unsigned char *>(nla) + NLA_HDRLEN;
+}
 
-        if (nlhdr->nlmsg_type == NLMSG_NOOP) {
-            continue;
-        } else if (nlhdr->nlmsg_type == NLMSG_ERROR) {
-            if (nlhdr->nlmsg_len < NLMSG_LENGTH(sizeof(nlmsgerr))) {
-                printf("INVALID LENGTH %u < %zu assumed err=%d\n",
-                       nlhdr->nlmsg_len, NLMSG_LENGTH(sizeof(nlmsgerr)),
-                       ((nlmsgerr *)(NLMSG_DATA(nlhdr)))->error);
-                for (size_t i = 0; i < (unsigned)len; i++)
-                    printf(" 0x%02x", ((unsigned char *)nlhdr)[i]);
-                fprintf(stderr, "%s:\n", __func__);
-            }
-            else if (((nlmsgerr *)(NLMSG_DATA(nlhdr)))->error == 0)
-                ; //fprintf(stderr, "ACK\n");
-            else
-                fprintf(stderr, "ERROR %d %s\n",
-                        ((nlmsgerr *)(NLMSG_DATA(nlhdr)))->error,
-                        strerror(-((nlmsgerr *)(NLMSG_DATA(nlhdr)))->error));
-            continue;
-        } else if (nlhdr->nlmsg_type == family) {
-            auto glh = (genlmsghdr *)nlmsg_data(nlhdr);
-
-            // printf("  genlmsghdr: type=%x/%s version=%x\n", glh->cmd,
-            //        net_dm_string(glh->cmd), glh->version);
-
-            if (glh->cmd == NET_DM_CMD_ALERT) {
-                auto genl_hdr = (genlmsghdr *)nlmsg_data(nlhdr);
-                auto nla_hdr = (nlattr *)genlmsg_data(genl_hdr);
-                auto nla_payload = (net_dm_alert_msg *)nla_data(nla_hdr);
-                auto entries = nla_payload->entries;
-                // fprintf(stderr, "  net_dm_alert_msg:\n"
-                //         "    nlmsghdr::nlmsg_len=%u / sizeof=%zu\n"
-                //         "    genlmsghdr::len=%zu / sizeof=%zu\n"
-                //         "    nlattr::(nla_len=%u, nla_type=%u) / sizeof=%zu\n"
-                //         "    net_dm_alert_msg::entries=%u / sizeof=%zu\n"
-                //         "    net_dm_drop_point sizeof=%zu\n",
-                //         nlhdr->nlmsg_len, sizeof(*nlhdr),
-                //         (char *)nla_hdr - (char *)genl_hdr, sizeof(genlmsghdr),
-                //         nla_hdr->nla_len, nla_hdr->nla_type, sizeof(struct nlattr),
-                //         nla_payload->entries, sizeof(net_dm_alert_msg),
-                //         sizeof(net_dm_drop_point));
-                assert(nla_hdr->nla_type == 0); // NLA_UNSPEC
-                for (size_t i = 0; i < entries; i++) {
-                    const auto &drop_point = ((net_dm_drop_point *)nla_payload->points)[i];
-                    void *loc;
-                    memcpy(&loc, drop_point.pc, sizeof loc);
-                    // fprintf(stderr, "        drop_point -> 0x%p * %u\n", loc, drop_point.count);
-                    callback(loc, drop_point.count);
-                }
-
-                // 16 + 4 + 4 + 4 + x * 12
-                const auto nlmsg_len = sizeof(nlmsghdr) + sizeof(genlmsghdr)
-                    + sizeof(nlattr) + sizeof(net_dm_alert_msg)
-                    + nla_payload->entries * sizeof(net_dm_drop_point);
-                if (nlhdr->nlmsg_len != nlmsg_len) {
-                    // fprintf(stderr, "fixing up nlmsg_len %u -> %zu/%d\n",
-                    //         nlhdr->nlmsg_len, nlmsg_len, len);
-                    nlhdr->nlmsg_len = nlmsg_len;
-                }
-            }
-            // fprintf(stderr, "  ... nlmsg_len=%u/%d -> ", nlhdr->nlmsg_len, len);
-            //nlhdr = nlmsg_next(nlhdr, &len);
-            // printf("%u/%d\n", nlhdr->nlmsg_len, len);
-        } else {
-            fprintf(stderr, "%s: IGNORED\n", __func__);
+static inline size_t attr_len(const nlattr *nla) { return nla->nla_len - NLA_HDRLEN; }
+
+template<typename T>
+static inline T attr_get(const nlattr *nla)
+{
+    T v = 0;
+    memcpy(&v, attr_data(nla), std::min(sizeof(v), attr_len(nla)));
+    return v;
+}
+
+// NUL-terminated within the attribute, or nullptr
+static inline const char *attr_string(const nlattr *nla)
+{
+    const char *s = static_cast<const char *>(attr_data(nla));
+    return attr_len(nla) && memchr(s, '\0', attr_len(nla)) ? s : nullptr;
+}
+
+// Calls f(nla) for each well-formed attribute in [attrs, attrs + len).
+template<typename F>
+static void for_each_attr(const nlattr *attrs, int len, F f)
+{
+    for (auto nla = attrs; len >= int(NLA_HDRLEN) && nla->nla_len >= NLA_HDRLEN && nla->nla_len <= len;
+         len -= NLA_ALIGN(nla->nla_len),
+         nla = reinterpret_cast<const nlattr *>(reinterpret_cast<const unsigned char *>(nla) + NLA_ALIGN(nla->nla_len)))
+        f(nla);
+}
+
+size_t drop_mon_t::alert(nlmsghdr *nlhdr)
+{
+    auto glh = (genlmsghdr *)nlmsg_data(nlhdr);
+
+    // printf("  genlmsghdr: type=%x/%s version=%x\n", glh->cmd,
+    //        net_dm_string(glh->cmd), glh->version);
+
+    const int len = int(nlhdr->nlmsg_len) - int(NLMSG_LENGTH(GENL_HDRLEN));
+    if (len < int(NLA_HDRLEN))
+        return 0;
+    auto attrs = (const nlattr *)genlmsg_data(glh);
+
+    if (glh->cmd == NET_DM_CMD_PACKET_ALERT)
+        return packet_alert(attrs, len);
+    if (glh->cmd != NET_DM_CMD_ALERT)
+        return 0;
+    // the first attribute is walked without for_each_attr's checks
+    if (attrs->nla_len < NLA_HDRLEN || attrs->nla_len > len) {
+        rx_stats.malformed++;
+        return 0;
+    }
+    // summary of hardware traps: NET_DM_ATTR_HW_ENTRIES instead of the legacy struct
+    if (attr_type(attrs) == NET_DM_ATTR_HW_ENTRIES)
+        return hw_summary(attrs);
+    return legacy_alert(nlhdr, attrs, len);
+}
+
+size_t drop_mon_t::legacy_alert(nlmsghdr *nlhdr, const nlattr *nla_hdr, int len)
+{
+    auto nla_payload = (const net_dm_alert_msg *)attr_data(nla_hdr);
+    // NLA_UNSPEC; replayed and forwarded datagrams are not trusted either
+    if (nla_hdr->nla_type != 0 || len < int(NLA_HDRLEN + sizeof(net_dm_alert_msg))
+        || nla_payload->entries > (len - NLA_HDRLEN - sizeof(net_dm_alert_msg)) / sizeof(net_dm_drop_point)) {
+        rx_stats.malformed++;
+        return 0;
+    }
+    rx_stats.alerts++;
+    rx_stats.drop_points += nla_payload->entries;
+    decoded.resize(1);
+    decoded[0] = drop_points{(const net_dm_drop_point *)nla_payload->points, nla_payload->entries};
+
+    // 16 + 4 + 4 + 4 + x * 12
+    const auto nlmsg_len = sizeof(nlmsghdr) + sizeof(genlmsghdr)
+        + sizeof(nlattr) + sizeof(net_dm_alert_msg)
+        + nla_payload->entries * sizeof(net_dm_drop_point);
+    if (nlhdr->nlmsg_len != nlmsg_len)
+        nlhdr->nlmsg_len = nlmsg_len;
+    return 1;
+}
+
+size_t drop_mon_t::packet_alert(const nlattr *attrs, int len)
+{
+    packets.resize(1);
+    packet_points.resize(1);
+    decoded.resize(1);
+    drop_packet &pkt = packets[0];
+    pkt = drop_packet();
+    for_each_attr(attrs, len, [&pkt](const nlattr *nla) {
+        switch (attr_type(nla)) {
+        case NET_DM_ATTR_PC: pkt.pc = attr_get<uint64_t>(nla); break;
+        case NET_DM_ATTR_SYMBOL: pkt.symbol = attr_string(nla); break;
+        case NET_DM_ATTR_TIMESTAMP: pkt.timestamp = attr_get<uint64_t>(nla); break;
+        case NET_DM_ATTR_PROTO: pkt.proto = attr_get<uint16_t>(nla); break;
+        case NET_DM_ATTR_ORIGIN: pkt.origin = attr_get<uint16_t>(nla); break;
+        case NET_DM_ATTR_ORIG_LEN: pkt.orig_len = attr_get<uint32_t>(nla); break;
+        case NET_DM_ATTR_HW_TRAP_GROUP_NAME: pkt.trap_group = attr_string(nla); break;
+        case NET_DM_ATTR_HW_TRAP_NAME: pkt.trap_name = attr_string(nla); break;
+        case NET_DM_ATTR_REASON: pkt.reason = attr_string(nla); break;
+        case NET_DM_ATTR_PAYLOAD:
+            pkt.payload = static_cast<const unsigned char *>(attr_data(nla));
+            pkt.payload_len = attr_len(nla);
+            break;
+        case NET_DM_ATTR_IN_PORT:
+            for_each_attr(static_cast<const nlattr *>(attr_data(nla)), attr_len(nla), [&pkt](const nlattr *port) {
+                if (attr_type(port) == NET_DM_ATTR_PORT_NETDEV_IFINDEX)
+                    pkt.ifindex = attr_get<uint32_t>(port);
+                else if (attr_type(port) == NET_DM_ATTR_PORT_NETDEV_NAME)
+                    pkt.ifname = attr_string(port);
+            });
+            break;
         }
+    });
+    rx_stats.packets++;
+    rx_stats.drop_points++;
+    if (pkt.origin == NET_DM_ORIGIN_HW)
+        rx_stats.hw_drops++;
+
+    net_dm_drop_point &point = packet_points[0];
+    memcpy(point.pc, &pkt.pc, sizeof(point.pc));
+    point.count = 1;
+    decoded[0] = drop_points{&point, 1, &pkt};
+    return 1;
+}
+
+size_t drop_mon_t::hw_summary(const nlattr *entries)
+{
+    // NET_DM_ATTR_HW_ENTRIES { NET_DM_ATTR_HW_ENTRY { TRAP_NAME, TRAP_COUNT } ... }
+    size_t n = 0;
+    for_each_attr(static_cast<const nlattr *>(attr_data(entries)), attr_len(entries), [&n](const nlattr *) { n++; });
+    packets.resize(n);
+    packet_points.resize(n);
+    decoded.resize(n);
+    size_t i = 0;
+    for_each_attr(static_cast<const nlattr *>(attr_data(entries)), attr_len(entries), [this, &i](const nlattr *entry) {
+        drop_packet &pkt = packets[i];
+        pkt = drop_packet();
+        pkt.origin = NET_DM_ORIGIN_HW;
+        uint32_t count = 0;
+        for_each_attr(static_cast<const nlattr *>(attr_data(entry)), attr_len(entry), [&pkt, &count](const nlattr *nla) {
+            if (attr_type(nla) == NET_DM_ATTR_HW_TRAP_NAME)
+                pkt.trap_name = attr_string(nla);
+            else if (attr_type(nla) == NET_DM_ATTR_HW_TRAP_COUNT)
+                count = attr_get<uint32_t>(nla);
+        });
+        net_dm_drop_point &point = packet_points[i];
+        memset(point.pc, 0, sizeof(point.pc));
+        point.count = count;
+        decoded[i] = drop_points{&point, 1, &pkt};
+        rx_stats.drop_points++;
+        rx_stats.hw_drops += count;
+        i++;
+    });
+    rx_stats.alerts++;
+    return n;
+}
+
+void drop_mon_t::control(const nlmsghdr *nlhdr)
+{
+    // fprintf(stderr, "  type: %d/%s nlmsg_len=%u flags=0x%x\n",
+    //         nlhdr->nlmsg_type, nlmsg_type_string(nlhdr->nlmsg_type),
+    //         nlhdr->nlmsg_len, nlhdr->nlmsg_flags);
 
+    if (nlhdr->nlmsg_type == NLMSG_NOOP) {
+        return;
+    } else if (nlhdr->nlmsg_type == NLMSG_OVERRUN) {
+        rx_stats.overruns++;
+    } else if (nlhdr->nlmsg_type == NLMSG_ERROR) {
+        const auto err = (const nlmsgerr *)NLMSG_DATA(nlhdr);
+        if (nlhdr->nlmsg_len < NLMSG_LENGTH(sizeof(nlmsgerr))) {
+            printf("INVALID LENGTH %u < %zu assumed err=%d\n",
+                   nlhdr->nlmsg_len, NLMSG_LENGTH(sizeof(nlmsgerr)), err->error);
+            for (size_t i = 0; i < nlhdr->nlmsg_len; i++)
+                printf(" 0x%02x", ((const unsigned char *)nlhdr)[i]);
+            fprintf(stderr, "%s:\n", __func__);
+        }
+        else if (err->error == 0)
+            ; //fprintf(stderr, "ACK\n");
+        else
+            fprintf(stderr, "ERROR %d %s\n", err->error, strerror(-err->error));
+    } else {
+        fprintf(stderr, "%s: IGNORED\n", __func__);
     }
-    // fprintf(stderr, "\n");
+}
 
-    free(buf);
-    return true;
+bool drop_mon_t::send(request &req)
+{
+    req.hdr()->nlmsg_seq = seq++;
+    // unbound destination: the kernel, or the peer of a test socketpair
+    for (;;) {
+        if (::send(get_fd(), req.buf, req.hdr()->nlmsg_len, 0) != -1)
+            return true;
+        if (errno != EINTR) {
+            perror("send");
+            return false;
+        }
+    }
 }
 
-bool drop_mon_t::send(int flags, uint8_t cmd)
+int drop_mon_t::transact(request &req)
 {
-    auto buf = unique_ptr<nl_msg>(nlmsg_alloc(), nlmsg_free);
-    if (!buf)
-        return false;
-    auto msg = genlmsg_put(buf.get(), NL_AUTO_PORT, seq, family, 0, flags, cmd, 1);
-    if (!msg)
-        return false;
-    const auto err = nl_send(sock, buf.get());
-    if (err < 0) {
-        fprintf(stderr, "%s:%d: %s\n", __func__, __LINE__, nl_geterror(err));
-        return false;
+    req.hdr()->nlmsg_flags |= NLM_F_ACK;
+    if (!send(req))
+        return -errno;
+    const uint32_t want = req.hdr()->nlmsg_seq;
+
+    // Multicast alerts of another session may arrive first; they are
+    // dropped, tracing has not started here yet.
+    const int fd = get_fd();
+    for (;;) {
+        pollfd pfd{fd, POLLIN, 0};
+        const int ready = poll(&pfd, 1, 2000);
+        if (ready == 0)
+            return -ETIMEDOUT;
+        if (ready == -1) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+        const ssize_t n = recv(fd, rx_pool.data(), rx_bufsize, MSG_DONTWAIT);
+        if (n == -1) {
+            if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
+                continue;
+            if (errno == ENOBUFS) {
+                rx_stats.overruns++;
+                continue;
+            }
+            return -errno;
+        }
+        int len = n;
+        for (auto nlh = reinterpret_cast<nlmsghdr *>(rx_pool.data()); NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+            if (nlh->nlmsg_type != NLMSG_ERROR || nlh->nlmsg_len < NLMSG_LENGTH(sizeof(nlmsgerr)))
+                continue;
+            const auto err = static_cast<const nlmsgerr *>(NLMSG_DATA(nlh));
+            if (err->msg.nlmsg_seq == want)
+                return err->error;
+        }
     }
-    seq++;
-    return true;
 }
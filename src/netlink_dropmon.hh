@@ -1,23 +1,261 @@
 #pragma once
 
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include <functional>
+#include <iterator>
+#include <vector>
+
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/net_dropmon.h>
+
+#include "common.hh"
+#include "latency_histogram.hh"
 
 struct nl_sock;
 
+struct drop_mon_stats {
+    uint64_t rx_calls = 0;      // recvmmsg calls that returned messages
+    uint64_t datagrams = 0;
+    uint64_t bytes = 0;
+    uint64_t alerts = 0;        // NET_DM_CMD_ALERT messages
+    uint64_t drop_points = 0;
+    uint64_t overruns = 0;      // ENOBUFS and NLMSG_OVERRUN: alerts lost in the socket
+    uint64_t truncated = 0;     // datagrams larger than a pool buffer
+    uint64_t malformed = 0;     // alerts dropped for lengths past their message
+    uint64_t packets = 0;       // NET_DM_CMD_PACKET_ALERT messages
+    uint64_t hw_drops = 0;      // drops reported with NET_DM_ORIGIN_HW
+};
+
+// What NET_DM_CMD_CONFIG and NET_DM_CMD_START ask of the kernel. Kernels
+// without the attribute protocol (before 5.4) only do legacy summaries.
+struct drop_mon_config {
+    bool packet_mode = false;   // one alert per dropped packet, with metadata
+    uint32_t trunc_len = 0;     // packet mode: payload bytes per alert, 0 = all
+    uint32_t queue_len = 0;     // packet mode: kernel alert queue, 0 = default
+    bool sw_drops = true;
+    bool hw_drops = false;      // devlink trap drops
+};
+
+// Metadata of one NET_DM_CMD_PACKET_ALERT, or of one hardware trap in a
+// summary alert. Strings and payload point into the receive buffer and
+// are nullptr when the kernel did not send them.
+struct drop_packet {
+    uint64_t pc = 0;            // 0 for hardware drops
+    const char *symbol = nullptr;
+    uint64_t timestamp = 0;     // kernel's ns timestamp of the drop
+    uint16_t proto = 0;         // ethertype, host order
+    uint16_t origin = 0;        // NET_DM_ORIGIN_SW or NET_DM_ORIGIN_HW
+    uint32_t ifindex = 0;
+    const char *ifname = nullptr;
+    uint32_t orig_len = 0;      // packet length before truncation
+    const unsigned char *payload = nullptr;
+    size_t payload_len = 0;
+    const char *trap_group = nullptr;
+    const char *trap_name = nullptr;
+    const char *reason = nullptr;
+};
+
+// The drop points of one NET_DM alert, in place in the receive buffer.
+// Only valid during the callback.
+struct drop_points {
+    struct point {
+        uint64_t pc;
+        uint32_t count;
+    };
+
+    struct const_iterator {
+        using iterator_category = std::random_access_iterator_tag;
+        using value_type = point;
+        using difference_type = std::ptrdiff_t;
+        using pointer = void;
+        using reference = point;
+
+        point operator*() const
+        {
+            // pc is a byte array, unaligned at every other entry
+            point p;
+            memcpy(&p.pc, pos->pc, sizeof p.pc);
+            p.count = pos->count;
+            return p;
+        }
+        const_iterator &operator++() { ++pos; return *this; }
+        difference_type operator-(const const_iterator &rhs) const { return pos - rhs.pos; }
+        bool operator==(const const_iterator &rhs) const { return pos == rhs.pos; }
+        bool operator!=(const const_iterator &rhs) const { return pos != rhs.pos; }
+
+        const net_dm_drop_point *pos;
+    };
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    point operator[](size_t i) const { return *const_iterator{points + i}; }
+    const_iterator begin() const { return const_iterator{points}; }
+    const_iterator end() const { return const_iterator{points + count}; }
+
+    const net_dm_drop_point *points;
+    size_t count;
+    // packet mode and hardware summaries: one point, count 1 or trap count
+    const drop_packet *packet = nullptr;
+};
+
+// NET_DM alert listener.
+//
+// Consumers get one call per alert with a drop_points view, either through
+// the std::function given at construction or through a handler passed to
+// the try_rx()/feed() templates, which the compiler can inline. Packet
+// alerts and hardware trap summaries arrive as one-point views that carry
+// a drop_packet. Without a callback, only the handler overloads deliver.
 struct drop_mon_t {
-    drop_mon_t(const std::function<void(void *, size_t)> &callback);
+    using callback_t = std::function<void(const drop_points &)>;
+
+    explicit drop_mon_t(const callback_t &callback = callback_t());
+    // Without a kernel socket: fd == -1 only parses (replaying captures),
+    // otherwise fd stands in for the netlink socket (tests). fd is not closed.
+    drop_mon_t(const callback_t &callback, int family, int fd = -1);
     ~drop_mon_t();
-    bool start();
+
+    // Configures and starts tracing. Falls back to legacy summary alerts
+    // when the kernel rejects NET_DM_CMD_CONFIG, and to software drops
+    // only when it rejects hardware drops.
+    bool start(const drop_mon_config &config = drop_mon_config());
     bool stop();
     int get_fd() const;
+    int get_family() const { return family; }
+    // The configuration the kernel accepted in start().
+    const drop_mon_config &config() const { return active; }
+
+    // Sets the socket receive buffer, bypassing rmem_max when permitted.
+    // Returns the effective size or -1.
+    int set_rcvbuf(int bytes);
+
+    // Drains the socket until EAGAIN. Returns false on a fatal socket error,
+    // or without a callback.
+    bool try_rx() { return callback ? try_rx(callback) : no_callback(); }
+
+    template<typename Handler>
+    bool try_rx(Handler &&handler)
+    {
+        // Give control back to the poll loop now and then, so a sustained
+        // storm cannot starve signal handling. poll fires again right away.
+        for (int round = 0; round < 256; round++) {
+            const uint64_t start = rx_timing ? monotonic_ns() : 0;
+            const int n = receive();
+            if (n == -1)
+                return false;
+            // the first parse is timed from here, not from before recvmmsg
+            uint64_t t = n && (rx_timing || parse_timing) ? monotonic_ns() : 0;
+            if (rx_timing && n)
+                rx_timing->record(t - start);
+            for (int i = 0; i < n; i++) {
+                parse(static_cast<unsigned char *>(rx_iov[i].iov_base),
+                      std::min<size_t>(rx_msgs[i].msg_len, rx_bufsize), handler);
+                if (parse_timing) {
+                    const uint64_t now = monotonic_ns();
+                    parse_timing->record(now - t);
+                    t = now;
+                }
+            }
+            if (static_cast<size_t>(n) < rx_msgs.size())
+                return true;
+        }
+        return true;
+    }
+
+    const drop_mon_stats &stats() const { return rx_stats; }
+
+    // Sees every received datagram before it is parsed (--record).
+    void set_rx_hook(const std::function<void(const void *, size_t)> &hook) { rx_hook = hook; }
+
+    // Times each recvmmsg in try_rx() and the parsing of each received or
+    // fed datagram (--stats); either may be nullptr.
+    void set_timing(latency_histogram *receive, latency_histogram *parse)
+    {
+        rx_timing = receive;
+        parse_timing = parse;
+    }
 
-    bool try_rx() const;
+    // Parses one datagram as if received; buf may be modified. Returns
+    // false without a callback.
+    bool feed(unsigned char *buf, size_t len)
+    {
+        if (!callback)
+            return no_callback();
+        feed(buf, len, callback);
+        return true;
+    }
+
+    template<typename Handler>
+    void feed(unsigned char *buf, size_t len, Handler &&handler)
+    {
+        rx_stats.datagrams++;
+        rx_stats.bytes += len;
+        const uint64_t t = parse_timing ? monotonic_ns() : 0;
+        parse(buf, len, handler);
+        if (parse_timing)
+            parse_timing->record(monotonic_ns() - t);
+    }
 
 private:
-    bool send(int flags, uint8_t cmd);
+    struct request;
+    bool send(request &req);
+    // Sends req with NLM_F_ACK and waits for the kernel's answer.
+    // Returns 0 or the negative errno from the NLMSG_ERROR reply.
+    int transact(request &req);
+    void init_pool();
+    // Reports a handler-less try_rx() or feed() without a callback; false.
+    bool no_callback() const;
+
+    // One recvmmsg into the pool. Returns the number of datagrams, 0 when
+    // the socket is drained, -1 on a fatal error.
+    int receive();
+
+    template<typename Handler>
+    void parse(unsigned char *buf, int len, Handler &handler)
+    {
+        for (auto nlh = reinterpret_cast<nlmsghdr *>(buf); NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+            if (nlh->nlmsg_type != family) {
+                control(nlh);
+                continue;
+            }
+            const size_t n = alert(nlh);
+            for (size_t i = 0; i < n; i++)
+                handler(decoded[i]);
+        }
+    }
+
+    // Decodes a NET_DM message into decoded[]; returns the number of views.
+    size_t alert(nlmsghdr *nlh);
+    size_t legacy_alert(nlmsghdr *nlh, const nlattr *attrs, int len);
+    size_t packet_alert(const nlattr *attrs, int len);
+    size_t hw_summary(const nlattr *entries);
+    // NLMSG_ERROR, NLMSG_OVERRUN and other non-NET_DM messages.
+    void control(const nlmsghdr *nlh);
+
+    static const size_t rx_batch = 16;
+    static const size_t rx_bufsize = 64 * 1024;
 
     int family;
     struct nl_sock *sock;
+    int fd = -1;
     uint32_t seq;
-    const std::function<void(void *, size_t)> callback;
+    drop_mon_config active;
+    const callback_t callback;
+    std::function<void(const void *, size_t)> rx_hook;
+    latency_histogram *rx_timing = nullptr;
+    latency_histogram *parse_timing = nullptr;
+
+    // preallocated receive pool: rx_batch buffers of rx_bufsize
+    std::vector<unsigned char> rx_pool;
+    std::vector<iovec> rx_iov;
+    std::vector<mmsghdr> rx_msgs;
+    drop_mon_stats rx_stats;
+
+    // views handed to the handler, reused across messages
+    std::vector<drop_points> decoded;
+    std::vector<drop_packet> packets;
+    std::vector<net_dm_drop_point> packet_points;
 };
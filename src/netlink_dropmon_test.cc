@@ -0,0 +1,285 @@
+// drop_mon_t against a fake NET_DM responder on a socketpair.
+//
+// The responder plays a legacy kernel (NET_DM_CMD_CONFIG unsupported) or a
+// current one, acks requests like the kernel does and sends alerts once
+// tracing is started.
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <linux/genetlink.h>
+#include <linux/net_dropmon.h>
+#include <linux/netlink.h>
+
+#include "genl_message.hh"
+#include "netlink_dropmon.hh"
+
+static const int family = GENL_MIN_ID + 7;
+
+#define CHECK(cond) do { if (!(cond)) { \
+    fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); exit(1); } } while (0)
+
+struct fake_kernel {
+    bool v2;
+    bool hw;
+    int fd;
+
+    // what the client asked for
+    std::vector<uint8_t> cmds;
+    int alert_mode = -1;
+    uint32_t trunc_len = 0;
+    uint32_t queue_len = 0;
+    bool hw_requested = false;
+
+    void ack(const nlmsghdr *req, int error)
+    {
+        std::vector<unsigned char> buf(NLMSG_LENGTH(sizeof(nlmsgerr)));
+        auto nlh = reinterpret_cast<nlmsghdr *>(buf.data());
+        nlh->nlmsg_len = buf.size();
+        nlh->nlmsg_type = NLMSG_ERROR;
+        nlh->nlmsg_seq = req->nlmsg_seq;
+        auto err = static_cast<nlmsgerr *>(NLMSG_DATA(nlh));
+        err->error = error;
+        err->msg = *req;
+        CHECK(send(fd, buf.data(), buf.size(), 0) == ssize_t(buf.size()));
+    }
+
+    void send_alerts()
+    {
+        if (alert_mode != NET_DM_ALERT_MODE_PACKET) {
+            // legacy summary, three drop points
+            genl_message m(family, NET_DM_CMD_ALERT);
+            m.alert_msg(3, [](uint32_t i) { return std::make_pair(0xffffffff81000000ull + i, i + 1); });
+            CHECK(send(fd, m.buf.data(), m.buf.size(), 0) == ssize_t(m.buf.size()));
+            return;
+        }
+
+        genl_message m(family, NET_DM_CMD_PACKET_ALERT);
+        m.put<uint64_t>(NET_DM_ATTR_PC, 0xffffffff81234567ull);
+        m.put(NET_DM_ATTR_SYMBOL, "kfree_skb_reason+0x2a/0x60");
+        const size_t port = m.nest();
+        m.put<uint32_t>(NET_DM_ATTR_PORT_NETDEV_IFINDEX, 3);
+        m.put(NET_DM_ATTR_PORT_NETDEV_NAME, "eth0");
+        m.nest(port, NET_DM_ATTR_IN_PORT);
+        m.put<uint64_t>(NET_DM_ATTR_TIMESTAMP, 1234567890ull);
+        m.put<uint16_t>(NET_DM_ATTR_PROTO, 0x0800);
+        m.put<uint16_t>(NET_DM_ATTR_ORIGIN, NET_DM_ORIGIN_SW);
+        m.put<uint32_t>(NET_DM_ATTR_ORIG_LEN, 1500);
+        m.put(NET_DM_ATTR_REASON, "NO_SOCKET");
+        const unsigned char payload[] = {0x45, 0x00, 0x05, 0xdc};
+        m.attr(NET_DM_ATTR_PAYLOAD, payload, sizeof(payload));
+        CHECK(send(fd, m.buf.data(), m.buf.size(), 0) == ssize_t(m.buf.size()));
+
+        // summary of two hardware traps
+        genl_message hw(family, NET_DM_CMD_ALERT);
+        const size_t entries = hw.nest();
+        const char *names[] = {"ingress_vlan_filter", "blackhole_route"};
+        for (uint32_t i = 0; i < 2; i++) {
+            const size_t entry = hw.nest();
+            hw.put(NET_DM_ATTR_HW_TRAP_NAME, names[i]);
+            hw.put<uint32_t>(NET_DM_ATTR_HW_TRAP_COUNT, 10 * (i + 1));
+            hw.nest(entry, NET_DM_ATTR_HW_ENTRY);
+        }
+        hw.nest(entries, NET_DM_ATTR_HW_ENTRIES);
+        CHECK(send(fd, hw.buf.data(), hw.buf.size(), 0) == ssize_t(hw.buf.size()));
+    }
+
+    void serve()
+    {
+        std::vector<unsigned char> buf(4096);
+        for (;;) {
+            const ssize_t n = recv(fd, buf.data(), buf.size(), 0);
+            if (n <= 0)
+                return;
+            auto nlh = reinterpret_cast<nlmsghdr *>(buf.data());
+            CHECK(NLMSG_OK(nlh, n) && nlh->nlmsg_type == family);
+            const uint8_t cmd = static_cast<genlmsghdr *>(NLMSG_DATA(nlh))->cmd;
+            cmds.push_back(cmd);
+
+            bool sw = false, hw_flag = false;
+            int len = nlh->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN);
+            auto nla = reinterpret_cast<nlattr *>(static_cast<unsigned char *>(NLMSG_DATA(nlh)) + GENL_HDRLEN);
+            for (; len >= int(NLA_HDRLEN) && nla->nla_len <= len;
+                 len -= NLA_ALIGN(nla->nla_len),
+                 nla = reinterpret_cast<nlattr *>(reinterpret_cast<unsigned char *>(nla) + NLA_ALIGN(nla->nla_len))) {
+                const void *data = reinterpret_cast<unsigned char *>(nla) + NLA_HDRLEN;
+                switch (nla->nla_type) {
+                case NET_DM_ATTR_ALERT_MODE: alert_mode = *static_cast<const uint8_t *>(data); break;
+                case NET_DM_ATTR_TRUNC_LEN: memcpy(&trunc_len, data, 4); break;
+                case NET_DM_ATTR_QUEUE_LEN: memcpy(&queue_len, data, 4); break;
+                case NET_DM_ATTR_SW_DROPS: sw = true; break;
+                case NET_DM_ATTR_HW_DROPS: hw_flag = true; break;
+                }
+            }
+
+            if (cmd == NET_DM_CMD_CONFIG) {
+                ack(nlh, v2 ? 0 : -EOPNOTSUPP);
+                if (!v2)
+                    alert_mode = -1;
+            } else if (cmd == NET_DM_CMD_START) {
+                hw_requested |= hw_flag;
+                if (v2 && hw_flag && !hw) {
+                    ack(nlh, -EOPNOTSUPP);
+                    continue;
+                }
+                CHECK(sw || hw_flag || !v2);
+                ack(nlh, 0);
+                send_alerts();
+            } else if (cmd == NET_DM_CMD_STOP) {
+                ack(nlh, 0);
+                return;
+            } else {
+                ack(nlh, -EINVAL);
+            }
+        }
+    }
+};
+
+struct result {
+    std::vector<std::pair<uint64_t, uint32_t>> points;
+    std::vector<std::string> symbols;
+    std::vector<std::string> ifnames;
+    std::vector<std::string> trap_names;
+    std::vector<std::string> reasons;
+    size_t payload = 0;
+};
+
+static result run(bool v2, bool hw, const drop_mon_config &config, size_t expect,
+                  fake_kernel *out_kernel = nullptr, drop_mon_config *out_active = nullptr)
+{
+    int fds[2];
+    CHECK(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds) == 0);
+    fake_kernel kernel{v2, hw, fds[1]};
+    std::thread responder(&fake_kernel::serve, &kernel);
+
+    result r;
+    drop_mon_t dropmon(drop_mon_t::callback_t(), family, fds[0]);
+    CHECK(dropmon.start(config));
+    auto handler = [&r](const drop_points &points) {
+        for (const auto p: points)
+            r.points.emplace_back(p.pc, p.count);
+        if (const drop_packet *pkt = points.packet) {
+            if (pkt->symbol)
+                r.symbols.push_back(pkt->symbol);
+            if (pkt->ifname)
+                r.ifnames.push_back(pkt->ifname);
+            if (pkt->trap_name)
+                r.trap_names.push_back(pkt->trap_name);
+            if (pkt->reason)
+                r.reasons.push_back(pkt->reason);
+            r.payload += pkt->payload_len;
+        }
+    };
+    for (int tries = 0; r.points.size() < expect && tries < 100; tries++) {
+        pollfd pfd{fds[0], POLLIN, 0};
+        poll(&pfd, 1, 20);
+        CHECK(dropmon.try_rx(handler));
+    }
+    CHECK(dropmon.stop());
+    responder.join();
+    close(fds[0]);
+    close(fds[1]);
+    if (out_kernel)
+        *out_kernel = kernel;
+    if (out_active)
+        *out_active = dropmon.config();
+    return r;
+}
+
+int main()
+{
+    // legacy kernel: packet mode is refused, summaries still work
+    {
+        drop_mon_config config;
+        config.packet_mode = true;
+        config.trunc_len = 64;
+        fake_kernel kernel{false, false, -1};
+        drop_mon_config active;
+        const auto r = run(false, false, config, 3, &kernel, &active);
+        CHECK(!active.packet_mode);
+        CHECK(kernel.cmds.size() == 3);
+        CHECK(kernel.cmds[0] == NET_DM_CMD_CONFIG && kernel.cmds[1] == NET_DM_CMD_START);
+        CHECK(r.points.size() == 3);
+        CHECK(r.points[0].first == 0xffffffff81000000ull && r.points[0].second == 1);
+        CHECK(r.points[2].first == 0xffffffff81000002ull && r.points[2].second == 3);
+    }
+
+    // legacy behaviour without options: no NET_DM_CMD_CONFIG at all
+    {
+        fake_kernel kernel{true, false, -1};
+        const auto r = run(true, false, drop_mon_config(), 3, &kernel);
+        CHECK(kernel.cmds.size() == 2 && kernel.cmds[0] == NET_DM_CMD_START);
+        CHECK(r.points.size() == 3);
+    }
+
+    // current kernel: packet alerts and hardware trap summaries
+    {
+        drop_mon_config config;
+        config.packet_mode = true;
+        config.trunc_len = 64;
+        config.queue_len = 500;
+        config.hw_drops = true;
+        fake_kernel kernel{true, true, -1};
+        drop_mon_config active;
+        const auto r = run(true, true, config, 3, &kernel, &active);
+        CHECK(active.packet_mode && active.hw_drops);
+        CHECK(kernel.alert_mode == NET_DM_ALERT_MODE_PACKET);
+        CHECK(kernel.trunc_len == 64 && kernel.queue_len == 500 && kernel.hw_requested);
+        CHECK(r.points.size() == 3);
+        CHECK(r.points[0].first == 0xffffffff81234567ull && r.points[0].second == 1);
+        CHECK(r.symbols.size() == 1 && r.symbols[0] == "kfree_skb_reason+0x2a/0x60");
+        CHECK(r.ifnames.size() == 1 && r.ifnames[0] == "eth0");
+        CHECK(r.reasons.size() == 1 && r.reasons[0] == "NO_SOCKET");
+        CHECK(r.payload == 4);
+        CHECK(r.points[1].first == 0 && r.points[1].second == 10);
+        CHECK(r.points[2].first == 0 && r.points[2].second == 20);
+        CHECK(r.trap_names.size() == 2 && r.trap_names[1] == "blackhole_route");
+    }
+
+    // hardware drops refused: retried with software drops only
+    {
+        drop_mon_config config;
+        config.hw_drops = true;
+        fake_kernel kernel{true, false, -1};
+        drop_mon_config active;
+        const auto r = run(true, false, config, 3, &kernel, &active);
+        CHECK(!active.hw_drops && active.sw_drops);
+        CHECK(kernel.cmds.size() == 3 && kernel.cmds[1] == NET_DM_CMD_START);
+        CHECK(r.points.size() == 3);
+    }
+
+    // lengths past the end of the message: rejected, not read
+    {
+        size_t points = 0;
+        drop_mon_t parser(drop_mon_t::callback_t(), family);
+        auto count = [&points](const drop_points &alert) { points += alert.size(); };
+
+        std::vector<unsigned char> payload(sizeof(net_dm_alert_msg) + 3 * sizeof(net_dm_drop_point));
+        reinterpret_cast<net_dm_alert_msg *>(payload.data())->entries = 1000;
+        genl_message legacy(family, NET_DM_CMD_ALERT);
+        legacy.attr(0, payload.data(), payload.size());
+        parser.feed(legacy.buf.data(), legacy.buf.size(), count);
+
+        genl_message hw(family, NET_DM_CMD_ALERT);
+        const size_t entries = hw.nest();
+        hw.put<uint32_t>(NET_DM_ATTR_HW_TRAP_COUNT, 1);
+        hw.nest(entries, NET_DM_ATTR_HW_ENTRIES);
+        reinterpret_cast<nlattr *>(&hw.buf[entries])->nla_len = 4096;
+        parser.feed(hw.buf.data(), hw.buf.size(), count);
+
+        CHECK(points == 0);
+        CHECK(parser.stats().malformed == 2 && parser.stats().alerts == 0);
+    }
+
+    printf("netlink_dropmon_test: ok\n");
+    return 0;
+}
@@ -0,0 +1,592 @@
+#include "output.hh"
+
+#include <sys/uio.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+
+bool parse_output_format(const char *name, output_format &out)
+{
+    if (std::strcmp(name, "table") == 0)
+        out = output_format::table;
+    else if (std::strcmp(name, "ndjson") == 0)
+        out = output_format::ndjson;
+    else if (std::strcmp(name, "csv") == 0)
+        out = output_format::csv;
+    else if (std::strcmp(name, "binary") == 0)
+        out = output_format::binary;
+    else
+        return false;
+    return true;
+}
+
+output_writer::output_writer(output_format format, int fd)
+    : format(format), fd(fd), buf(blocks * block_size)
+{
+    if (format == output_format::csv)
+        put("type,timestamp_ns,interval_ns,sites,count,delta,pc,symbol,offset,function,location,flow,error\n");
+}
+
+output_writer::~output_writer()
+{
+    flush();
+}
+
+bool output_writer::flush()
+{
+    iovec iov[blocks];
+    size_t n = 0;
+    for (size_t i = 0; i <= cur; i++) {
+        if (fill[i]) {
+            iov[n].iov_base = &buf[i * block_size];
+            iov[n].iov_len = fill[i];
+            n++;
+        }
+        fill[i] = 0;
+    }
+    cur = 0;
+
+    iovec *pos = iov;
+    while (n && !error) {
+        const ssize_t written = writev(fd, pos, n);
+        if (written == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("writev");
+            error = true;
+            break;
+        }
+        // partial write: skip what went out
+        size_t done = written;
+        while (n && done >= pos->iov_len) {
+            done -= pos->iov_len;
+            pos++;
+            n--;
+        }
+        if (n) {
+            pos->iov_base = static_cast<char *>(pos->iov_base) + done;
+            pos->iov_len -= done;
+        }
+    }
+    return !error;
+}
+
+void output_writer::put(const char *s, size_t len)
+{
+    while (len) {
+        if (fill[cur] == block_size) {
+            if (cur + 1 < blocks)
+                cur++;
+            else
+                flush();
+        }
+        const size_t n = std::min(len, block_size - fill[cur]);
+        memcpy(&buf[cur * block_size + fill[cur]], s, n);
+        fill[cur] += n;
+        s += n;
+        len -= n;
+    }
+}
+
+void output_writer::put_str(const char *s)
+{
+    put(s, strlen(s));
+}
+
+void output_writer::put(char c)
+{
+    if (fill[cur] == block_size) {
+        put(&c, 1);
+        return;
+    }
+    buf[cur * block_size + fill[cur]++] = c;
+}
+
+void output_writer::put_padded(const char *s, size_t len, int width)
+{
+    static const char spaces[] = "                                ";
+    for (size_t pad = width > 0 && size_t(width) > len ? width - len : 0; pad; ) {
+        const size_t n = std::min(pad, sizeof(spaces) - 1);
+        put(spaces, n);
+        pad -= n;
+    }
+    put(s, len);
+}
+
+void output_writer::put_u64(uint64_t v, int width)
+{
+    char tmp[24];
+    char *p = tmp + sizeof(tmp);
+    do {
+        *--p = '0' + v % 10;
+        v /= 10;
+    } while (v);
+    put_padded(p, tmp + sizeof(tmp) - p, width);
+}
+
+void output_writer::put_i64(int64_t v, int width)
+{
+    if (v >= 0) {
+        put_u64(v, width);
+        return;
+    }
+    char tmp[24];
+    char *p = tmp + sizeof(tmp);
+    uint64_t u = -static_cast<uint64_t>(v);
+    do {
+        *--p = '0' + u % 10;
+        u /= 10;
+    } while (u);
+    *--p = '-';
+    put_padded(p, tmp + sizeof(tmp) - p, width);
+}
+
+void output_writer::put_hex(uint64_t v, int width)
+{
+    static const char digits[] = "0123456789abcdef";
+    char tmp[24];
+    char *p = tmp + sizeof(tmp);
+    do {
+        *--p = digits[v & 0xf];
+        v >>= 4;
+    } while (v);
+    *--p = 'x';
+    *--p = '0';
+    put_padded(p, tmp + sizeof(tmp) - p, width);
+}
+
+void output_writer::put_json(const char *s)
+{
+    if (!s) {
+        put("null");
+        return;
+    }
+    put('"');
+    const char *run = s;
+    for (; *s; s++) {
+        const unsigned char c = *s;
+        if (c >= 0x20 && c != '"' && c != '\\')
+            continue;
+        put(run, s - run);
+        run = s + 1;
+        if (c == '"' || c == '\\') {
+            put('\\');
+            put(char(c));
+        } else {
+            static const char digits[] = "0123456789abcdef";
+            const char esc[6] = {'\\', 'u', '0', '0', digits[c >> 4], digits[c & 0xf]};
+            put(esc, sizeof(esc));
+        }
+    }
+    put(run, s - run);
+    put('"');
+}
+
+void output_writer::put_csv(const char *s)
+{
+    if (!s)
+        return;
+    if (!strpbrk(s, ",\"\r\n")) {
+        put_str(s);
+        return;
+    }
+    put('"');
+    for (; *s; s++) {
+        if (*s == '"')
+            put('"');
+        put(*s);
+    }
+    put('"');
+}
+
+static const char *str(const char *s)
+{
+    return s && *s ? s : nullptr;
+}
+
+// Same columns as the printf-based output this replaces.
+void output_writer::put_table_site(uint64_t pc, const symbol_resolver::result &sym)
+{
+    put_hex(pc, 20);
+    if (!sym.symbol) {
+        const char *function = str(sym.function);
+        function = function ? function : "n/a";
+        put_padded(function, strlen(function), 32);
+    } else {
+        put_padded(sym.symbol, strlen(sym.symbol), 32);
+        put('+');
+        put_u64(sym.offset);
+    }
+    const char *location = sym.location ? sym.location : "n/a";
+    put_padded(location, strlen(location), 32);
+}
+
+void output_writer::put_json_site(uint64_t pc, const symbol_resolver::result &sym)
+{
+    put(",\"pc\":\"");
+    put_hex(pc);
+    put("\",\"symbol\":");
+    put_json(sym.symbol);
+    put(",\"offset\":");
+    put_u64(sym.symbol ? sym.offset : 0);
+    put(",\"function\":");
+    put_json(str(sym.function));
+    put(",\"location\":");
+    put_json(str(sym.location));
+}
+
+void output_writer::put_csv_site(uint64_t pc, const symbol_resolver::result &sym)
+{
+    put_hex(pc);
+    put(',');
+    put_csv(sym.symbol);
+    put(',');
+    if (sym.symbol)
+        put_u64(sym.offset);
+    put(',');
+    put_csv(str(sym.function));
+    put(',');
+    put_csv(str(sym.location));
+}
+
+void output_writer::put_binary_site(uint16_t type, uint64_t timestamp, uint64_t pc, uint64_t count,
+                                    uint64_t previous, const symbol_resolver::result &sym)
+{
+    const char *strings[3] = {sym.symbol ? sym.symbol : "", str(sym.function), str(sym.location)};
+    uint16_t lens[3];
+    for (size_t i = 0; i < 3; i++) {
+        strings[i] = strings[i] ? strings[i] : "";
+        lens[i] = static_cast<uint16_t>(std::min<size_t>(strlen(strings[i]), UINT16_MAX));
+    }
+    output_site_record rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.hdr.len = sizeof(rec) + lens[0] + lens[1] + lens[2];
+    rec.hdr.type = type;
+    rec.hdr.version = 1;
+    rec.hdr.timestamp_ns = timestamp;
+    rec.pc = pc;
+    rec.count = count;
+    rec.previous = previous;
+    rec.offset = sym.symbol ? sym.offset : 0;
+    rec.symbol_len = lens[0];
+    rec.function_len = lens[1];
+    rec.location_len = lens[2];
+    put(reinterpret_cast<const char *>(&rec), sizeof(rec));
+    for (size_t i = 0; i < 3; i++)
+        put(strings[i], lens[i]);
+}
+
+void output_writer::events_header()
+{
+    if (format != output_format::table)
+        return;
+    put_padded("#", 1, 3);
+    put_padded("ip", 2, 20);
+    put_padded("sym+off", 7, 32);
+    put_padded("location", 8, 32);
+    put('\n');
+}
+
+void output_writer::event(uint64_t timestamp, uint64_t pc, uint64_t count,
+                          const symbol_resolver::result &sym)
+{
+    switch (format) {
+    case output_format::table:
+        put_u64(count, 3);
+        put("  ");
+        put_table_site(pc, sym);
+        put('\n');
+        break;
+    case output_format::ndjson:
+        put("{\"type\":\"drop\",\"ts\":");
+        put_u64(timestamp);
+        put(",\"count\":");
+        put_u64(count);
+        put_json_site(pc, sym);
+        put("}\n");
+        break;
+    case output_format::csv:
+        put("drop,");
+        put_u64(timestamp);
+        put(",,,");
+        put_u64(count);
+        put(",,");
+        put_csv_site(pc, sym);
+        put(",,\n");
+        break;
+    case output_format::binary:
+        put_binary_site(OUTPUT_DROP, timestamp, pc, count, 0, sym);
+        break;
+    }
+}
+
+void output_writer::interval(uint64_t timestamp, const drop_aggregate::interval &report)
+{
+    const uint64_t length_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(report.length).count();
+    switch (format) {
+    case output_format::table: {
+        // once per interval, stdio formatting is fine here
+        char line[128];
+        const int n = snprintf(line, sizeof(line), "\n--- %.3fs: %" PRIu64 " drops at %zu sites, %.1f/s ---\n",
+                               std::chrono::duration<double>(report.length).count(),
+                               report.drops, report.sites, report.rate(report.drops));
+        put(line, std::min<size_t>(n, sizeof(line) - 1));
+        if (!report.top.empty()) {
+            put_padded("#", 1, 10);
+            put_padded("rate/s", 6, 12);
+            put_padded("delta", 5, 10);
+            put_padded("ip", 2, 20);
+            put_padded("sym+off", 7, 32);
+            put_padded("location", 8, 32);
+            put('\n');
+        }
+        break;
+    }
+    case output_format::ndjson:
+        put("{\"type\":\"interval\",\"ts\":");
+        put_u64(timestamp);
+        put(",\"interval_ns\":");
+        put_u64(length_ns);
+        put(",\"drops\":");
+        put_u64(report.drops);
+        put(",\"sites\":");
+        put_u64(report.sites);
+        put("}\n");
+        break;
+    case output_format::csv:
+        put("interval,");
+        put_u64(timestamp);
+        put(',');
+        put_u64(length_ns);
+        put(',');
+        put_u64(report.sites);
+        put(',');
+        put_u64(report.drops);
+        put(",,,,,,,,\n");
+        break;
+    case output_format::binary: {
+        output_interval_record rec;
+        memset(&rec, 0, sizeof(rec));
+        rec.hdr.len = sizeof(rec);
+        rec.hdr.type = OUTPUT_INTERVAL;
+        rec.hdr.version = 1;
+        rec.hdr.timestamp_ns = timestamp;
+        rec.length_ns = length_ns;
+        rec.drops = report.drops;
+        rec.sites = report.sites;
+        put(reinterpret_cast<const char *>(&rec), sizeof(rec));
+        break;
+    }
+    }
+}
+
+void output_writer::site(uint64_t timestamp, const drop_aggregate::interval &report,
+                         const drop_aggregate::row &row, const symbol_resolver::result &sym)
+{
+    const int64_t delta = static_cast<int64_t>(row.count - row.previous);
+    switch (format) {
+    case output_format::table: {
+        put_u64(row.count, 10);
+        char rate[32];
+        const int n = snprintf(rate, sizeof(rate), "%*.1f", 12, report.rate(row.count));
+        put(rate, std::min<size_t>(n, sizeof(rate) - 1));
+        put_i64(delta, 10);
+        put("  ");
+        put_table_site(row.pc, sym);
+        put('\n');
+        break;
+    }
+    case output_format::ndjson:
+        put("{\"type\":\"site\",\"ts\":");
+        put_u64(timestamp);
+        put(",\"count\":");
+        put_u64(row.count);
+        put(",\"previous\":");
+        put_u64(row.previous);
+        put(",\"total\":");
+        put_u64(row.total);
+        put_json_site(row.pc, sym);
+        put("}\n");
+        break;
+    case output_format::csv:
+        put("site,");
+        put_u64(timestamp);
+        put(',');
+        put_u64(std::chrono::duration_cast<std::chrono::nanoseconds>(report.length).count());
+        put(",,");
+        put_u64(row.count);
+        put(',');
+        put_i64(delta);
+        put(',');
+        put_csv_site(row.pc, sym);
+        put(",,\n");
+        break;
+    case output_format::binary:
+        put_binary_site(OUTPUT_SITE, timestamp, row.pc, row.count, row.previous, sym);
+        break;
+    }
+}
+
+void output_writer::loss(uint64_t timestamp, output_loss source, uint64_t count)
+{
+    const bool netlink = source == output_loss::netlink;
+    switch (format) {
+    case output_format::table:
+        put("!!! ");
+        put_u64(count);
+        put_str(netlink ? " netlink overruns, drop reports were lost\n"
+                    : " drop reports lost, output thread fell behind\n");
+        break;
+    case output_format::ndjson:
+        put("{\"type\":\"loss\",\"ts\":");
+        put_u64(timestamp);
+        put_str(netlink ? ",\"source\":\"netlink\",\"count\":" : ",\"source\":\"queue\",\"count\":");
+        put_u64(count);
+        put("}\n");
+        break;
+    case output_format::csv:
+        put_str(netlink ? "loss_netlink," : "loss_queue,");
+        put_u64(timestamp);
+        put(",,,");
+        put_u64(count);
+        put(",,,,,,,,\n");
+        break;
+    case output_format::binary: {
+        output_loss_record rec;
+        memset(&rec, 0, sizeof(rec));
+        rec.hdr.len = sizeof(rec);
+        rec.hdr.type = OUTPUT_LOSS;
+        rec.hdr.version = 1;
+        rec.hdr.timestamp_ns = timestamp;
+        rec.source = static_cast<uint32_t>(source);
+        rec.count = count;
+        put(reinterpret_cast<const char *>(&rec), sizeof(rec));
+        break;
+    }
+    }
+}
+
+void output_writer::flows(uint64_t timestamp, const flow_topk::interval &report)
+{
+    switch (format) {
+    case output_format::table: {
+        char line[160];
+        const int n = snprintf(line, sizeof(line), "--- top flows: %" PRIu64 " packets, %" PRIu64
+                               " without flow, counts over by at most %" PRIu64 " ---\n",
+                               report.packets, report.unparsed, report.bound);
+        put(line, std::min<size_t>(n, sizeof(line) - 1));
+        if (!report.top.empty()) {
+            put_padded("#", 1, 10);
+            put_padded("+-", 2, 10);
+            put_padded("flow", 4, 48);
+            put_padded("ip", 2, 20);
+            put_padded("sym+off", 7, 32);
+            put_padded("location", 8, 32);
+            put('\n');
+        }
+        break;
+    }
+    case output_format::ndjson:
+        put("{\"type\":\"flows\",\"ts\":");
+        put_u64(timestamp);
+        put(",\"packets\":");
+        put_u64(report.packets);
+        put(",\"unparsed\":");
+        put_u64(report.unparsed);
+        put(",\"capacity\":");
+        put_u64(report.capacity);
+        put(",\"error_bound\":");
+        put_u64(report.bound);
+        put("}\n");
+        break;
+    case output_format::csv:
+        put("flows,");
+        put_u64(timestamp);
+        put(",,,");
+        put_u64(report.packets);
+        put(",,,,,,,,");
+        put_u64(report.bound);
+        put('\n');
+        break;
+    case output_format::binary: {
+        output_flows_record rec;
+        memset(&rec, 0, sizeof(rec));
+        rec.hdr.len = sizeof(rec);
+        rec.hdr.type = OUTPUT_FLOWS;
+        rec.hdr.version = 1;
+        rec.hdr.timestamp_ns = timestamp;
+        rec.packets = report.packets;
+        rec.unparsed = report.unparsed;
+        rec.capacity = report.capacity;
+        rec.bound = report.bound;
+        put(reinterpret_cast<const char *>(&rec), sizeof(rec));
+        break;
+    }
+    }
+}
+
+void output_writer::flow(uint64_t timestamp, const flow_topk::row &row, const symbol_resolver::result &sym)
+{
+    char tuple[128];
+    if (format != output_format::binary) {
+        const int n = row.key.format(tuple, sizeof(tuple));
+        tuple[std::min<size_t>(n, sizeof(tuple) - 1)] = '\0';
+    }
+    switch (format) {
+    case output_format::table:
+        put_u64(row.count, 10);
+        put_u64(row.error, 10);
+        put_padded(tuple, strlen(tuple), 48);
+        put_table_site(row.key.pc, sym);
+        put('\n');
+        break;
+    case output_format::ndjson:
+        put("{\"type\":\"flow\",\"ts\":");
+        put_u64(timestamp);
+        put(",\"count\":");
+        put_u64(row.count);
+        put(",\"error\":");
+        put_u64(row.error);
+        put(",\"flow\":");
+        put_json(tuple);
+        put_json_site(row.key.pc, sym);
+        put("}\n");
+        break;
+    case output_format::csv:
+        put("flow,");
+        put_u64(timestamp);
+        put(",,,");
+        put_u64(row.count);
+        put(",,");
+        put_csv_site(row.key.pc, sym);
+        put(',');
+        put_csv(tuple);
+        put(',');
+        put_u64(row.error);
+        put('\n');
+        break;
+    case output_format::binary: {
+        output_flow_record rec;
+        memset(&rec, 0, sizeof(rec));
+        rec.hdr.len = sizeof(rec);
+        rec.hdr.type = OUTPUT_FLOW;
+        rec.hdr.version = 1;
+        rec.hdr.timestamp_ns = timestamp;
+        rec.pc = row.key.pc;
+        rec.count = row.count;
+        rec.error = row.error;
+        memcpy(rec.src, row.key.src, sizeof(rec.src));
+        memcpy(rec.dst, row.key.dst, sizeof(rec.dst));
+        rec.sport = row.key.sport;
+        rec.dport = row.key.dport;
+        rec.family = row.key.family;
+        rec.l4proto = row.key.l4proto;
+        put(reinterpret_cast<const char *>(&rec), sizeof(rec));
+        break;
+    }
+    }
+}
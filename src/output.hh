@@ -0,0 +1,153 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <unistd.h>
+
+#include "drop_aggregate.hh"
+#include "flow_topk.hh"
+#include "symbol_resolver.hh"
+
+enum class output_format { table, ndjson, csv, binary };
+
+// "table", "ndjson", "csv" or "binary".
+bool parse_output_format(const char *name, output_format &out);
+
+enum class output_loss { netlink, queue };
+
+// Binary format: a stream of records in native endianness. Every record
+// starts with output_record; len covers the whole record so readers can
+// skip unknown types. Strings follow the fixed part, not NUL-terminated.
+struct output_record {
+    uint32_t len;
+    uint16_t type;          // output_record_type
+    uint16_t version;       // 1
+    uint64_t timestamp_ns;  // CLOCK_MONOTONIC
+};
+
+enum output_record_type : uint16_t {
+    OUTPUT_DROP = 1,        // output_site_record, previous = 0
+    OUTPUT_INTERVAL = 2,    // output_interval_record
+    OUTPUT_SITE = 3,        // output_site_record, one per top-N row
+    OUTPUT_LOSS = 4,        // output_loss_record
+    OUTPUT_FLOWS = 5,       // output_flows_record, then one OUTPUT_FLOW per row
+    OUTPUT_FLOW = 6,        // output_flow_record
+};
+
+struct output_site_record {
+    output_record hdr;
+    uint64_t pc;
+    uint64_t count;
+    uint64_t previous;      // count in the interval before
+    uint64_t offset;        // into symbol
+    uint16_t symbol_len;    // then symbol, function, location
+    uint16_t function_len;
+    uint16_t location_len;
+    uint16_t reserved;
+};
+
+struct output_interval_record {
+    output_record hdr;
+    uint64_t length_ns;
+    uint64_t drops;
+    uint64_t sites;
+};
+
+struct output_loss_record {
+    output_record hdr;
+    uint32_t source;        // output_loss
+    uint32_t reserved;
+    uint64_t count;
+};
+
+struct output_flows_record {
+    output_record hdr;
+    uint64_t packets;
+    uint64_t unparsed;
+    uint64_t capacity;
+    uint64_t bound;         // max overcount of any row
+};
+
+// Symbols of pc are in the OUTPUT_SITE records or left to the reader.
+struct output_flow_record {
+    output_record hdr;
+    uint64_t pc;
+    uint64_t count;         // true count is in [count - error, count]
+    uint64_t error;
+    uint8_t src[16];
+    uint8_t dst[16];
+    uint16_t sport;
+    uint16_t dport;
+    uint8_t family;         // 4 or 6
+    uint8_t l4proto;
+    uint8_t reserved[2];
+};
+
+// Formats drop reports into a private buffer and writes it with writev.
+//
+// The buffer is a set of blocks that are only written out when all of
+// them are full or on flush(), so a burst of reports costs one syscall.
+// Integers and hex are formatted by hand; stdio is not involved.
+// Used from the output thread only.
+struct output_writer {
+    explicit output_writer(output_format format, int fd = STDOUT_FILENO);
+    ~output_writer();
+    output_writer(const output_writer &) = delete;
+    output_writer &operator=(const output_writer &) = delete;
+
+    // Column header for one-line-per-drop output.
+    void events_header();
+    void event(uint64_t timestamp, uint64_t pc, uint64_t count, const symbol_resolver::result &sym);
+
+    // An interval summary, followed by one site() per top-N row.
+    void interval(uint64_t timestamp, const drop_aggregate::interval &report);
+    void site(uint64_t timestamp, const drop_aggregate::interval &report,
+              const drop_aggregate::row &row, const symbol_resolver::result &sym);
+
+    // Top dropped flows of the interval, followed by one flow() per row.
+    void flows(uint64_t timestamp, const flow_topk::interval &report);
+    void flow(uint64_t timestamp, const flow_topk::row &row, const symbol_resolver::result &sym);
+
+    void loss(uint64_t timestamp, output_loss source, uint64_t count);
+
+    bool flush();
+    bool failed() const { return error; }
+    // nothing buffered since the last flush()
+    bool empty() const
+    {
+        for (size_t i = 0; i <= cur; i++)
+            if (fill[i])
+                return false;
+        return true;
+    }
+
+private:
+    static const size_t block_size = 64 * 1024;
+    static const size_t blocks = 8;
+
+    void put(const char *s, size_t len);
+    template<size_t N>
+    void put(const char (&literal)[N]) { put(literal, N - 1); }
+    void put_str(const char *s);
+    void put(char c);
+    void put_u64(uint64_t v, int width = 0);
+    void put_i64(int64_t v, int width = 0);
+    void put_hex(uint64_t v, int width = 0);
+    void put_padded(const char *s, size_t len, int width);
+    void put_json(const char *s);
+    void put_csv(const char *s);
+    void put_table_site(uint64_t pc, const symbol_resolver::result &sym);
+    void put_json_site(uint64_t pc, const symbol_resolver::result &sym);
+    void put_csv_site(uint64_t pc, const symbol_resolver::result &sym);
+    void put_binary_site(uint16_t type, uint64_t timestamp, uint64_t pc, uint64_t count,
+                         uint64_t previous, const symbol_resolver::result &sym);
+
+    output_format format;
+    int fd;
+    std::vector<char> buf;      // blocks * block_size
+    size_t fill[blocks] = {};
+    size_t cur = 0;
+    bool error = false;
+};
@@ -0,0 +1,164 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// Open-addressing hash map keyed by kernel PC.
+//
+// Linear probing over a power-of-two table, load factor kept below 1/2.
+// Key 0 marks an empty slot; a real PC of 0 is stored out of line.
+template<typename V>
+struct pc_map {
+    struct slot {
+        uint64_t key;
+        V value;
+    };
+
+    explicit pc_map(size_t capacity = 1024)
+        : slots(round_up(capacity))
+    {}
+
+    V *find(uint64_t key)
+    {
+        if (key == 0)
+            return has_zero ? &zero.value : nullptr;
+        for (size_t i = hash(key);; i = (i + 1) & mask()) {
+            if (slots[i].key == key)
+                return &slots[i].value;
+            if (slots[i].key == 0)
+                return nullptr;
+        }
+    }
+
+    const V *find(uint64_t key) const { return const_cast<pc_map *>(this)->find(key); }
+
+    V &operator[](uint64_t key)
+    {
+        if (key == 0) {
+            if (!has_zero) {
+                has_zero = true;
+                zero.value = V();
+                count++;
+            }
+            return zero.value;
+        }
+        for (size_t i = hash(key);; i = (i + 1) & mask()) {
+            if (slots[i].key == key)
+                return slots[i].value;
+            if (slots[i].key == 0) {
+                if (2 * (count + 1) > slots.size()) {
+                    grow();
+                    return (*this)[key];
+                }
+                slots[i].key = key;
+                slots[i].value = V();
+                count++;
+                return slots[i].value;
+            }
+        }
+    }
+
+    // Backward-shift deletion, no tombstones.
+    bool erase(uint64_t key)
+    {
+        if (key == 0) {
+            if (!has_zero)
+                return false;
+            has_zero = false;
+            zero.value = V();
+            count--;
+            return true;
+        }
+        size_t i = hash(key);
+        while (slots[i].key != key) {
+            if (slots[i].key == 0)
+                return false;
+            i = (i + 1) & mask();
+        }
+        for (size_t j = (i + 1) & mask(); slots[j].key != 0; j = (j + 1) & mask()) {
+            // slot j may move to i unless its home lies cyclically in (i, j]
+            const size_t home = hash(slots[j].key);
+            const bool stays = i <= j ? (i < home && home <= j) : (i < home || home <= j);
+            if (stays)
+                continue;
+            slots[i].key = slots[j].key;
+            slots[i].value = std::move(slots[j].value);
+            i = j;
+        }
+        slots[i].key = 0;
+        slots[i].value = V();
+        count--;
+        return true;
+    }
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    void clear()
+    {
+        for (auto &s: slots)
+            s.key = 0;
+        has_zero = false;
+        count = 0;
+    }
+
+    // Calls f(key, value) for every element, in table order.
+    template<typename F>
+    void for_each(F f)
+    {
+        if (has_zero)
+            f(uint64_t(0), zero.value);
+        for (auto &s: slots)
+            if (s.key != 0)
+                f(s.key, s.value);
+    }
+
+    template<typename F>
+    void for_each(F f) const
+    {
+        if (has_zero)
+            f(uint64_t(0), static_cast<const V &>(zero.value));
+        for (const auto &s: slots)
+            if (s.key != 0)
+                f(s.key, static_cast<const V &>(s.value));
+    }
+
+private:
+    static size_t round_up(size_t n)
+    {
+        size_t cap = 16;
+        while (cap < n)
+            cap <<= 1;
+        return cap;
+    }
+
+    size_t mask() const { return slots.size() - 1; }
+
+    size_t hash(uint64_t key) const
+    {
+        // Fibonacci hashing; kernel text addresses differ mostly in low bits
+        return static_cast<size_t>((key * 0x9e3779b97f4a7c15ull) >> 32) & mask();
+    }
+
+    void grow()
+    {
+        std::vector<slot> old(slots.size() * 2);
+        old.swap(slots);
+        for (auto &s: old) {
+            if (s.key == 0)
+                continue;
+            size_t i = hash(s.key);
+            while (slots[i].key != 0)
+                i = (i + 1) & mask();
+            slots[i].key = s.key;
+            slots[i].value = std::move(s.value);
+        }
+    }
+
+    std::vector<slot> slots;
+    slot zero{0, V()};
+    bool has_zero = false;
+    size_t count = 0;
+};
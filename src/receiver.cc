@@ -0,0 +1,551 @@
+#include "receiver.hh"
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+
+#include "common.hh"
+
+// Loaded first after the modules of already seen drop PCs.
+static bool is_network_module(const char *name)
+{
+    static const char *const prefixes[] = {
+        "kernel", "nf_", "nft_", "nfnetlink", "xt_", "ip_", "ip6", "iptable_", "ipt_", "ipip",
+        "ipvlan", "ebt", "arp", "sch_", "cls_", "act_",
+        "tcp_", "udp", "sctp", "l2tp", "ppp", "8021q", "bridge", "br_", "bond", "team",
+        "vxlan", "geneve", "tun", "tap", "veth", "macvlan", "macvtap", "wireguard",
+        "openvswitch", "xfrm", "esp", "af_packet", "mac80211", "cfg80211",
+        "virtio_net", "mlx", "ixgbe", "i40e", "ice", "igb", "igc", "e1000", "bnxt",
+        "ena", "r8169", "tg3", "sfc", "nfp", "iwl", "ath", "mt76", "rtw",
+    };
+    for (const auto prefix: prefixes)
+        if (strncmp(name, prefix, strlen(prefix)) == 0)
+            return true;
+    // drivers named like virtio_net; not nfs, ipmi_* or netfs
+    const size_t len = strlen(name);
+    return len > 4 && strcmp(name + len - 4, "_net") == 0;
+}
+
+// Reports kernel and modules to libdwfl, then loads debuginfo in order of
+// relevance: modules that already reported drops, networking modules.
+// Everything else is loaded lazily on first lookup.
+static std::unique_ptr<dwarf_lookup> load_dwarf(const char *debuginfo_path,
+                                                std::shared_ptr<dwarf_hints> hints, self_stats *stats)
+{
+    const uint64_t start = monotonic_ns();
+    auto dwarf = make_unique<dwarf_lookup>(debuginfo_path);
+    if (!*dwarf)
+        return dwarf;
+    const uint64_t reported = monotonic_ns();
+    if (stats)
+        stats->dwfl_report_ns.store(reported - start, std::memory_order_relaxed);
+
+    size_t done = 0;
+    auto preload_hinted = [&dwarf, &hints, &done]() {
+        for (;;) {
+            std::vector<uint64_t> pcs;
+            {
+                std::lock_guard<std::mutex> guard(hints->lock);
+                pcs.assign(std::begin(hints->pcs) + done, std::end(hints->pcs));
+            }
+            if (pcs.empty())
+                return;
+            for (const auto pc: pcs)
+                dwarf->preload(pc);
+            done += pcs.size();
+        }
+    };
+    preload_hinted();
+    dwarf->preload(is_network_module);
+    preload_hinted();
+    if (stats)
+        stats->dwfl_preload_ns.store(monotonic_ns() - reported, std::memory_order_relaxed);
+    return dwarf;
+}
+
+// Name, size and base of each module in /proc/modules, empty if there is
+// none. Refcounts and users change all the time without moving any code.
+static std::string read_modules()
+{
+    std::string text;
+    FILE *f = fopen("/proc/modules", "r");
+    if (!f)
+        return text;
+    // name size refcount users state base [taint]
+    char line[4096];
+    while (fgets(line, sizeof(line), f)) {
+        const char *fields[6];
+        size_t n = 0;
+        for (char *save, *tok = strtok_r(line, " \n", &save); tok && n < 6; tok = strtok_r(nullptr, " \n", &save))
+            fields[n++] = tok;
+        if (n < 6)
+            continue;
+        text.append(fields[0]).append(" ").append(fields[1]).append(" ").append(fields[5]).append("\n");
+    }
+    fclose(f);
+    return text;
+}
+
+// Names of modules loaded, unloaded or reloaded between two layouts.
+static std::vector<std::string> changed_modules(const kernel_layout &before, const kernel_layout &after)
+{
+    auto find = [](const kernel_layout &layout, const std::string &name) -> const kernel_module * {
+        for (const auto &m: layout.modules)
+            if (m.name == name)
+                return &m;
+        return nullptr;
+    };
+    std::vector<std::string> changed;
+    for (const auto &m: before.modules) {
+        const auto now = find(after, m.name);
+        if (!now || !now->same_as(m))
+            changed.push_back(m.name);
+    }
+    for (const auto &m: after.modules)
+        if (!find(before, m.name))
+            changed.push_back(m.name);
+    return changed;
+}
+
+receiver_ctx::receiver_ctx(const receiver_options &opts)
+    : out(opts.format, opts.output_fd), hints(std::make_shared<dwarf_hints>()), ring(opts.ring_size),
+      top_flows(opts.top_flows), print_drops(!opts.quiet && !opts.top_n && !opts.top_flows),
+      metrics(opts.metrics), shm(opts.shm), filter(opts.filter), stats(opts.stats),
+      stats_interval(opts.stats_interval), interval(opts.interval)
+{
+    if (opts.layout) {
+        layout = *opts.layout;
+    } else {
+        dwarf_future = std::async(std::launch::async, load_dwarf, opts.debuginfo_path, hints, stats);
+        layout = kernel_layout::read();
+        watch_modules = true;
+        live = true;
+        modules_text = read_modules();
+    }
+    resolver.set_layout(&layout);
+    if (stats)
+        resolver.set_timing(&stats->kallsyms, &stats->dwarf);
+    if (opts.symcache_path) {
+        symcache = make_unique<symbol_cache>(opts.symcache_path, layout);
+        if (symcache->mapped_entries())
+            fprintf(stderr, "symbol cache: %zu entries, %zu of %zu modules unchanged\n",
+                    symcache->mapped_entries(), symcache->valid_modules(),
+                    layout.modules.size() + 1);
+        resolver.set_symcache(symcache.get());
+    }
+
+    if (opts.top_n)
+        aggregate = make_unique<drop_aggregate>(opts.top_n);
+    if (opts.top_flows) {
+        flows = make_unique<flow_topk>(opts.flow_capacity);
+        flow_ring = make_unique<spsc_ring<flow_key>>(opts.ring_size / 8);
+    }
+}
+
+void receiver_ctx::hint_dwarf(uint64_t pc)
+{
+    if (!dwarf_future.valid())
+        return;             // loaded already, or not loading at all (replay)
+    char &seen = hinted[pc];
+    if (seen)
+        return;
+    seen = 1;
+    std::lock_guard<std::mutex> guard(hints->lock);
+    hints->pcs.push_back(pc);
+}
+
+void receiver_ctx::poll_loaders(std::future<std::unique_ptr<kallsyms_cache>> &kcache_future)
+{
+    auto ready = [](const auto &future) {
+        return future.valid()
+            && future.wait_for(std::chrono::milliseconds(0)) == std::future_status::ready;
+    };
+    bool changed = false;
+    if (!kcache && ready(kcache_future)) {
+        kcache = kcache_future.get();
+        if (kcache && *kcache)
+            resolver.set_kallsyms(kcache.get());
+        if (kcache && stats) {
+            const auto &load = kcache->stats();
+            stats->kallsyms_load_ns.store(std::chrono::nanoseconds(load.read_time + load.parse_time
+                                                                   + load.index_time).count(),
+                                          std::memory_order_relaxed);
+        }
+        changed = true;
+    }
+    if (!dwarf && ready(dwarf_future)) {
+        dwarf = dwarf_future.get();
+        if (dwarf && *dwarf) {
+            if (dwarf_stale)
+                dwarf->report_modules();
+            resolver.set_dwarf(dwarf.get());
+        } else {
+            fprintf(stderr, "dwarf_lookup disabled\n");
+        }
+        hinted.clear();
+        changed = true;
+    }
+    if (changed && kcache && !*kcache && dwarf && !*dwarf) {
+        fprintf(stderr, "kallsyms and dwarf lookup not available. Terminating.");
+        failed.store(true, std::memory_order_release);
+    }
+}
+
+void receiver_ctx::check_modules()
+{
+    if (refresh_future.valid()) {
+        if (refresh_future.wait_for(std::chrono::milliseconds(0)) == std::future_status::ready)
+            apply_refresh(refresh_future.get());
+        return;
+    }
+    // refreshed against the index in use; wait for the initial load
+    if (!kcache)
+        return;
+    std::string text = read_modules();
+    if (text == modules_text)
+        return;
+    modules_text = std::move(text);
+
+    // kcache stays in place until the refresh is applied, so the worker
+    // may share its segments
+    const kallsyms_cache *prev = *kcache ? kcache.get() : nullptr;
+    refresh_future = std::async(std::launch::async, [prev](kernel_layout before) {
+        module_refresh refresh;
+        refresh.layout = kernel_layout::read();
+        refresh.changed = changed_modules(before, refresh.layout);
+        if (prev && !refresh.changed.empty())
+            refresh.kcache = ::make_unique<kallsyms_cache>(*prev, refresh.changed);
+        return refresh;
+    }, layout);
+}
+
+void receiver_ctx::apply_refresh(module_refresh refresh)
+{
+    if (refresh.changed.empty())
+        return;
+
+    // cached results at the old and new addresses of changed modules
+    auto forget = [this](const kernel_layout &l, const std::string &name) {
+        for (const auto &m: l.modules) {
+            if (m.name != name)
+                continue;
+            resolver.forget(m.base, m.base + m.size);
+            if (shm)
+                shm->unresolve(m.base, m.base + m.size);
+        }
+    };
+    for (const auto &name: refresh.changed) {
+        forget(layout, name);
+        forget(refresh.layout, name);
+    }
+
+    layout = std::move(refresh.layout);
+    resolver.set_layout(&layout);
+    if (symcache)
+        symcache->revalidate();
+    if (refresh.kcache) {
+        kcache = std::move(refresh.kcache);
+        resolver.set_kallsyms(kcache.get());
+    }
+    if (filter)
+        filter->reset();
+    if (dwarf && *dwarf)
+        dwarf->report_modules();
+    else if (dwarf_future.valid())
+        dwarf_stale = true;
+
+    std::string names;
+    for (const auto &name: refresh.changed)
+        names += (names.empty() ? "" : ", ") + name;
+    fprintf(stderr, "modules changed (%s): %zu module symbols reloaded in %.1f ms\n", names.c_str(),
+            kcache ? kcache->stats().lines : 0,
+            kcache ? std::chrono::duration<double, std::milli>(kcache->stats().read_time
+                                                               + kcache->stats().parse_time
+                                                               + kcache->stats().index_time).count() : 0.0);
+}
+
+symbol_resolver::result receiver_ctx::resolve_site(uint64_t pc)
+{
+    // hardware drops (devlink traps) carry no PC
+    if (pc == 0)
+        return symbol_resolver::result{nullptr, 0, nullptr, "hardware"};
+    if (!dwarf)
+        hint_dwarf(pc);
+    return resolver.resolve(pc);
+}
+
+drop_filter::subject receiver_ctx::filter_subject(uint64_t pc)
+{
+    drop_filter::subject s{nullptr, nullptr, nullptr, true};
+    if (pc == 0) {
+        s.symbol = "hardware";
+        return s;
+    }
+    const kernel_module *m = layout.module_of(pc);
+    s.module = m ? m->name.c_str() : "vmlinux";
+    if (filter->uses_locations()) {
+        const auto sym = resolve_site(pc);
+        s.symbol = sym.symbol;
+        s.location = sym.location;
+        s.complete = kcache && (sym.location || !dwarf_future.valid());
+        return s;
+    }
+    symbol_cache::entry cached;
+    if (kcache && *kcache)
+        s.symbol = kcache->lookup_symbol(pc).first;
+    else if (symcache && symcache->lookup(pc, cached) && *cached.symbol)
+        s.symbol = cached.symbol;
+    s.complete = kcache != nullptr;
+    return s;
+}
+
+bool receiver_ctx::keep(uint64_t pc, uint64_t count)
+{
+    if (!filter || filter->accept(pc, [this](uint64_t pc) { return filter_subject(pc); }))
+        return true;
+    filtered += count;
+    return false;
+}
+
+void receiver_ctx::rx_callback(const drop_record &rec)
+{
+    if (!keep(rec.pc, rec.count))
+        return;
+    if (metrics)
+        totals[rec.pc] += rec.count;
+    if (shm)
+        shm->add(rec.pc, rec.count, rec.timestamp);
+    if (print_drops) {
+        out.event(rec.timestamp, rec.pc, rec.count, resolve_site(rec.pc));
+        return;
+    }
+    if (aggregate)
+        aggregate->add(rec.pc, rec.count);
+    if (!dwarf)
+        hint_dwarf(rec.pc);
+}
+
+void receiver_ctx::print_interval()
+{
+    const uint64_t now = monotonic_ns();
+    if (aggregate) {
+        const auto report = aggregate->rotate();
+        out.interval(now, report);
+        for (const auto &row: report.top)
+            out.site(now, report, row, resolve_site(row.pc));
+    }
+    if (flows) {
+        const auto report = flows->rotate(top_flows);
+        out.flows(now, report);
+        for (const auto &row: report.top)
+            out.flow(now, row, resolve_site(row.key.pc));
+    }
+    report_losses(now);
+    flush_output();
+}
+
+void receiver_ctx::publish_metrics()
+{
+    metrics_builder page;
+    page.family("drop_monitor_drops_total", "counter", "Packets dropped at a kernel drop site.");
+    totals.for_each([this, &page](uint64_t pc, uint64_t count) {
+        char pc_hex[24], symbol[256];
+        snprintf(pc_hex, sizeof(pc_hex), "0x%" PRIx64, pc);
+        const auto sym = resolve_site(pc);
+        const char *symbol_label = nullptr;
+        if (sym.symbol) {
+            snprintf(symbol, sizeof(symbol), "%s+%zu", sym.symbol, sym.offset);
+            symbol_label = symbol;
+        }
+        const char *module = nullptr;
+        if (pc) {
+            const kernel_module *m = layout.module_of(pc);
+            module = m ? m->name.c_str() : "vmlinux";
+        }
+        page.sample("drop_monitor_drops_total",
+                    {{"pc", pc_hex}, {"symbol", symbol_label}, {"module", module},
+                     {"function", sym.function}, {"location", sym.location}},
+                    count);
+    });
+    page.family("drop_monitor_sites", "gauge", "Drop sites seen since start.");
+    page.sample("drop_monitor_sites", {}, totals.size());
+    page.family("drop_monitor_lost_total", "counter", "Drop reports lost before they were counted.");
+    page.sample("drop_monitor_lost_total", {{"source", "netlink"}}, overruns.load(std::memory_order_relaxed));
+    page.sample("drop_monitor_lost_total", {{"source", "queue"}}, ring_full.load(std::memory_order_relaxed));
+    metrics->publish(std::move(page.text));
+}
+
+void receiver_ctx::resolve_shm_sites()
+{
+    shm->resolve([this](uint64_t pc, std::string &symbol, std::string &location, std::string &function) {
+        const auto sym = resolve_site(pc);
+        if (sym.symbol) {
+            char buf[256];
+            snprintf(buf, sizeof(buf), "%s+%zu", sym.symbol, sym.offset);
+            symbol = buf;
+        }
+        if (sym.location)
+            location = sym.location;
+        if (sym.function)
+            function = sym.function;
+    });
+}
+
+void receiver_ctx::flush_output()
+{
+    if (!stats || out.empty()) {
+        out.flush();
+        return;
+    }
+    const uint64_t start = monotonic_ns();
+    out.flush();
+    stats->write.record(monotonic_ns() - start);
+}
+
+// Reports alerts lost in the socket or in the ring since the last call.
+void receiver_ctx::report_losses(uint64_t timestamp)
+{
+    const auto lost_socket = overruns.load(std::memory_order_relaxed);
+    const auto lost_ring = ring_full.load(std::memory_order_relaxed);
+    if (lost_socket != reported_overruns)
+        out.loss(timestamp, output_loss::netlink, lost_socket - reported_overruns);
+    if (lost_ring != reported_ring_full)
+        out.loss(timestamp, output_loss::queue, lost_ring - reported_ring_full);
+    reported_overruns = lost_socket;
+    reported_ring_full = lost_ring;
+}
+
+void receiver_ctx::run(std::future<std::unique_ptr<kallsyms_cache>> kcache_future)
+{
+    using clock = std::chrono::steady_clock;
+
+    const bool reporting = aggregate || flows;
+    if (print_drops)
+        out.events_header();
+    auto next_report = clock::now() + interval;
+    auto next_publish = clock::now();
+    auto next_stats = clock::now() + stats_interval;
+
+    drop_record batch[256];
+    flow_key flow_batch[64];
+    for (;;) {
+        poll_loaders(kcache_future);
+
+        size_t n = ring.pop(batch, sizeof(batch) / sizeof(batch[0]));
+        if (stats && n) {
+            const uint64_t start = monotonic_ns();
+            // replayed timestamps are from another time, maybe another boot
+            if (live)
+                stats->queue.record(start > batch[0].timestamp ? start - batch[0].timestamp : 0);
+            for (size_t i = 0; i < n; i++)
+                rx_callback(batch[i]);
+            stats->output.record(monotonic_ns() - start);
+        } else {
+            for (size_t i = 0; i < n; i++)
+                rx_callback(batch[i]);
+        }
+        if (flow_ring) {
+            const size_t m = flow_ring->pop(flow_batch, sizeof(flow_batch) / sizeof(flow_batch[0]));
+            for (size_t i = 0; i < m; i++) {
+                if (!keep(flow_batch[i].pc, 0))
+                    continue;
+                if (flow_batch[i].family)
+                    flows->add(flow_batch[i]);
+                else
+                    flows->add_unparsed();
+            }
+            n += m;
+        }
+
+        if (reporting) {
+            const auto now = clock::now();
+            if (now >= next_report) {
+                print_interval();
+                next_report += interval;
+                if (next_report <= now)
+                    next_report = now + interval;
+            }
+        } else if (n) {
+            report_losses(batch[n - 1].timestamp);
+        }
+
+        // once a second, and only with symbols; labels then stay stable
+        // except for DWARF locations filled in later
+        if ((metrics || shm || watch_modules) && kcache) {
+            const auto now = clock::now();
+            if (now >= next_publish) {
+                if (watch_modules)
+                    check_modules();
+                if (metrics)
+                    publish_metrics();
+                if (shm)
+                    resolve_shm_sites();
+                next_publish = now + std::chrono::seconds(1);
+            }
+        }
+
+        if (stats) {
+            const auto now = clock::now();
+            if (now >= next_stats) {
+                stats->print(stderr, false, ring_full.load(std::memory_order_relaxed), resolver.stats());
+                next_stats = now + stats_interval;
+            }
+        }
+
+        if (n == 0) {
+            if (stopping.load(std::memory_order_acquire) && ring.empty()
+                && (!flow_ring || flow_ring->empty()))
+                break;
+            flush_output();
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+
+    if (reporting)
+        print_interval();
+    else
+        report_losses(monotonic_ns());
+    flush_output();
+    if (shm && kcache)
+        resolve_shm_sites();
+
+    if (symcache)
+        save_symbols();
+    print_resolver_stats();
+    if (filter)
+        fprintf(stderr, "%" PRIu64 " drops filtered out\n", filtered);
+    if (stats)
+        stats->print(stderr, true, ring_full.load(std::memory_order_relaxed), resolver.stats());
+}
+
+void receiver_ctx::save_symbols()
+{
+    resolver.for_each([this](uint64_t pc, const char *location, const char *function) {
+        auto kallsym = kcache && *kcache ? kcache->lookup_symbol(pc) : std::make_pair(nullptr, 0);
+        symbol_cache::entry cached;
+        if (!kallsym.first && symcache->lookup(pc, cached))
+            kallsym = std::make_pair(cached.symbol, cached.offset);
+        symcache->add(pc, kallsym.first, kallsym.second, location, function);
+    });
+    if (!symcache->save())
+        fprintf(stderr, "failed to write symbol cache\n");
+}
+
+void receiver_ctx::print_resolver_stats() const
+{
+    const auto &st = resolver.stats();
+    if (!st.lookups)
+        return;
+    fprintf(stderr, "resolver: %" PRIu64 " lookups, %" PRIu64 " hits, %" PRIu64 " negative hits, "
+            "%" PRIu64 " misses (%" PRIu64 " from symbol cache), %zu cached, %" PRIu64 " evicted, "
+            "%zu strings in %zu KiB\n",
+            st.lookups, st.hits, st.negative_hits, st.misses, st.symcache_hits,
+            resolver.size(), st.evictions, resolver.string_count(), resolver.string_bytes() / 1024);
+    if (st.dwarf_lookups || st.breaker_skips)
+        fprintf(stderr, "resolver: %" PRIu64 " dwarf lookups, %" PRIu64 " failed, "
+                "%" PRIu64 " skipped (no debuginfo), avg %.1f us, max %.1f us\n",
+                st.dwarf_lookups, st.dwarf_failures, st.breaker_skips,
+                st.dwarf_lookups ? st.dwarf_ns / 1e3 / st.dwarf_lookups : 0.0,
+                st.dwarf_max_ns / 1e3);
+}
@@ -0,0 +1,199 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "drop_aggregate.hh"
+#include "drop_filter.hh"
+#include "dwarf_lookup.hh"
+#include "flow_topk.hh"
+#include "kallsyms_lookup.hh"
+#include "kernel_layout.hh"
+#include "metrics.hh"
+#include "netlink_dropmon.hh"
+#include "output.hh"
+#include "pc_map.hh"
+#include "self_stats.hh"
+#include "shm_stats.hh"
+#include "spsc_ring.hh"
+#include "symbol_cache.hh"
+#include "symbol_resolver.hh"
+
+// Raw drop report as handed from the receive loop to the output thread.
+struct drop_record {
+    uint64_t timestamp;     // CLOCK_MONOTONIC ns of the receive wakeup
+    uint64_t pc;
+    uint32_t count;
+};
+
+// PCs seen before DWARF was ready, read by the background loader to load
+// the modules that matter first.
+struct dwarf_hints {
+    std::mutex lock;
+    std::vector<uint64_t> pcs;
+};
+
+struct receiver_options {
+    const char *debuginfo_path = nullptr;
+    const char *symcache_path = nullptr;
+    size_t top_n = 0;                       // 0: one line per drop point
+    std::chrono::milliseconds interval{0};
+    size_t ring_size = 64 * 1024;
+    size_t top_flows = 0;                   // heaviest flows per interval, needs packet alerts
+    size_t flow_capacity = 4096;            // counters of the flow sketch
+    // Cumulative per-site counters are rendered into this page.
+    metrics_page *metrics = nullptr;
+    // Per-site counters are kept up to date in this region.
+    shm_stats_writer *shm = nullptr;
+    bool quiet = false;                     // no per-drop lines (exporter only)
+    // Drops at sites this rejects are not counted or shown.
+    drop_filter *filter = nullptr;
+    // Stage timings are recorded here and printed to stderr every
+    // stats_interval and on exit.
+    self_stats *stats = nullptr;
+    std::chrono::seconds stats_interval{10};
+    output_format format = output_format::table;
+    int output_fd = STDOUT_FILENO;
+    // Offline use: symbolize against this layout instead of the running
+    // kernel's, and do not load the running kernel's DWARF.
+    const kernel_layout *layout = nullptr;
+};
+
+// Symbolizes and prints drop reports.
+//
+// The receive loop only push()es raw records; run() consumes them on its
+// own thread, so libdw lookups and stdout never stall the netlink socket.
+// DWARF is loaded in the background; until it is ready, output falls back
+// to kallsyms and later reports pick up DWARF locations.
+struct receiver_ctx {
+    explicit receiver_ctx(const receiver_options &opts);
+
+    // receive side, never blocks
+    void push(uint64_t timestamp, void *loc, size_t count)
+    {
+        if (!try_push(timestamp, loc, count))
+            ring_full.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void push(uint64_t timestamp, const drop_points &points)
+    {
+        for (const auto p: points)
+            if (!ring.push(drop_record{timestamp, p.pc, p.count}))
+                ring_full.fetch_add(1, std::memory_order_relaxed);
+        if (points.packet && !try_push(*points.packet))
+            ring_full.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // for producers that may wait instead of losing records (replay)
+    bool try_push(uint64_t timestamp, void *loc, size_t count)
+    {
+        return ring.push(drop_record{timestamp, reinterpret_cast<uint64_t>(loc),
+                                     static_cast<uint32_t>(count)});
+    }
+
+    // Queues the flow of a packet alert; true if flows are not tracked.
+    bool try_push(const drop_packet &packet)
+    {
+        if (!flow_ring)
+            return true;
+        // family 0 marks a packet without a recognizable flow
+        flow_key key;
+        if (!parse_flow(packet, key))
+            key.family = 0;
+        return flow_ring->push(key);
+    }
+
+    // Output thread body. Returns after stop() once the ring is drained.
+    void run(std::future<std::unique_ptr<kallsyms_cache>> kcache_future);
+    void stop() { stopping.store(true, std::memory_order_release); }
+
+    // Symbolizes pc, queueing it for DWARF preload while that is pending.
+    symbol_resolver::result resolve_site(uint64_t pc);
+
+    // False if the filter rejects pc; the drop is counted as filtered.
+    bool keep(uint64_t pc, uint64_t count);
+    void rx_callback(const drop_record &rec);
+
+    // Prints the top-N tables (sites, flows) of the interval that just
+    // ended. Only the printed sites are symbolized.
+    void print_interval();
+
+    // Stores everything resolved in this session to the symbol cache file.
+    void save_symbols();
+
+    void print_resolver_stats() const;
+
+    // Renders the counters since start into the metrics page.
+    void publish_metrics();
+    // Fills in symbols of new sites in the shared memory region.
+    void resolve_shm_sites();
+
+    std::unique_ptr<dwarf_lookup> dwarf;
+    std::future<std::unique_ptr<dwarf_lookup>> dwarf_future;
+    std::unique_ptr<kallsyms_cache> kcache;
+    std::unique_ptr<drop_aggregate> aggregate;
+    std::unique_ptr<flow_topk> flows;
+    kernel_layout layout;
+    std::unique_ptr<symbol_cache> symcache;
+    symbol_resolver resolver;
+    output_writer out;
+
+    // published by the receive thread
+    std::atomic<uint64_t> overruns{0};
+    std::atomic<uint64_t> ring_full{0};
+    // set by the output thread when no symbol source is left
+    std::atomic<bool> failed{false};
+
+private:
+    // Result of a background symbol refresh after /proc/modules changed.
+    struct module_refresh {
+        kernel_layout layout;
+        std::vector<std::string> changed;           // loaded, unloaded or reloaded
+        std::unique_ptr<kallsyms_cache> kcache;     // null if kallsyms is not in use
+    };
+
+    drop_filter::subject filter_subject(uint64_t pc);
+
+    // Starts a refresh when /proc/modules changed, applies a finished one.
+    void check_modules();
+    void apply_refresh(module_refresh refresh);
+
+    void report_losses(uint64_t timestamp);
+    void flush_output();
+    // Queues pc for the background DWARF loader, once per pc.
+    void hint_dwarf(uint64_t pc);
+    // Picks up kallsyms and DWARF once their loaders finish.
+    void poll_loaders(std::future<std::unique_ptr<kallsyms_cache>> &kcache_future);
+
+    std::shared_ptr<dwarf_hints> hints;
+    pc_map<char> hinted;
+
+    // live only: name, size and base of the modules last seen
+    bool watch_modules = false;
+    bool live = false;          // record timestamps are this boot's monotonic clock
+    std::string modules_text;
+    std::future<module_refresh> refresh_future;
+    bool dwarf_stale = false;   // modules changed while DWARF was loading
+
+    spsc_ring<drop_record> ring;
+    std::unique_ptr<spsc_ring<flow_key>> flow_ring;
+    size_t top_flows;
+    bool print_drops;
+    metrics_page *metrics;
+    shm_stats_writer *shm;
+    drop_filter *filter;
+    uint64_t filtered = 0;                  // drops rejected by filter
+    self_stats *stats;
+    std::chrono::seconds stats_interval;
+    pc_map<uint64_t> totals;                // pc -> drops since start
+    std::atomic<bool> stopping{false};
+    std::chrono::milliseconds interval;
+    uint64_t reported_overruns = 0;
+    uint64_t reported_ring_full = 0;
+};
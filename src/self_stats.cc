@@ -0,0 +1,103 @@
+#include "self_stats.hh"
+
+#include <cinttypes>
+
+#include "common.hh"
+
+static const struct {
+    const char *name;
+    latency_histogram self_stats::*histogram;
+} stages[] = {
+    {"receive", &self_stats::receive},
+    {"parse", &self_stats::parse},
+    {"queue", &self_stats::queue},
+    {"output", &self_stats::output},
+    {"write", &self_stats::write},
+    {"kallsyms", &self_stats::kallsyms},
+    {"dwarf", &self_stats::dwarf},
+};
+static const size_t stage_count = sizeof(stages) / sizeof(stages[0]);
+
+const char *format_duration(char *buf, size_t size, uint64_t ns)
+{
+    if (ns < 1000)
+        snprintf(buf, size, "%" PRIu64 "ns", ns);
+    else if (ns < 1000000)
+        snprintf(buf, size, "%.1fus", ns / 1e3);
+    else if (ns < 1000000000)
+        snprintf(buf, size, "%.1fms", ns / 1e6);
+    else
+        snprintf(buf, size, "%.1fs", ns / 1e9);
+    return buf;
+}
+
+self_stats::self_stats()
+    : last_stages(stage_count)
+{
+    start.timestamp = last.timestamp = monotonic_ns();
+}
+
+void self_stats::set_receive(const drop_mon_stats &stats, uint64_t overruns)
+{
+    datagrams.store(stats.datagrams, std::memory_order_relaxed);
+    alerts.store(stats.alerts, std::memory_order_relaxed);
+    drop_points.store(stats.drop_points, std::memory_order_relaxed);
+    this->overruns.store(overruns, std::memory_order_relaxed);
+}
+
+void self_stats::print(FILE *f, bool total, uint64_t lost_queue, const symbol_resolver::counters &resolver)
+{
+    totals now;
+    now.timestamp = monotonic_ns();
+    now.datagrams = datagrams.load(std::memory_order_relaxed);
+    now.alerts = alerts.load(std::memory_order_relaxed);
+    now.drop_points = drop_points.load(std::memory_order_relaxed);
+    now.overruns = overruns.load(std::memory_order_relaxed);
+    now.lost_queue = lost_queue;
+    now.resolver = resolver;
+    const totals &base = total ? start : last;
+
+    const double seconds = (now.timestamp - base.timestamp) / 1e9;
+    const uint64_t lookups = now.resolver.lookups - base.resolver.lookups;
+    const uint64_t cached = now.resolver.hits + now.resolver.negative_hits
+        - base.resolver.hits - base.resolver.negative_hits;
+    fprintf(f, "stats %s %.1fs: %" PRIu64 " datagrams (%.0f/s), %" PRIu64 " alerts, %" PRIu64 " drop points, "
+            "lost %" PRIu64 " in netlink and %" PRIu64 " in queue, %" PRIu64 " symbol lookups (%.1f%% cached)\n",
+            total ? "total" : "last", seconds, now.datagrams - base.datagrams,
+            seconds > 0 ? (now.datagrams - base.datagrams) / seconds : 0.0,
+            now.alerts - base.alerts, now.drop_points - base.drop_points,
+            now.overruns - base.overruns, now.lost_queue - base.lost_queue,
+            lookups, lookups ? 100.0 * cached / lookups : 0.0);
+
+    const uint64_t kallsyms_ns = kallsyms_load_ns.load(std::memory_order_relaxed);
+    const uint64_t report_ns = dwfl_report_ns.load(std::memory_order_relaxed);
+    const uint64_t preload_ns = dwfl_preload_ns.load(std::memory_order_relaxed);
+    if ((total || !startup_printed) && (kallsyms_ns || report_ns)) {
+        char a[16], b[16], c[16];
+        fprintf(f, "  startup: kallsyms %s, dwfl report %s, preload %s\n",
+                kallsyms_ns ? format_duration(a, sizeof(a), kallsyms_ns) : "-",
+                report_ns ? format_duration(b, sizeof(b), report_ns) : "-",
+                preload_ns ? format_duration(c, sizeof(c), preload_ns) : "-");
+        startup_printed = kallsyms_ns && preload_ns;
+    }
+
+    fprintf(f, "  %-10s %10s %9s %9s %9s %9s %9s %9s\n",
+            "stage", "count", "mean", "p50", "p90", "p99", "p99.9", "max");
+    for (size_t i = 0; i < stage_count; i++) {
+        latency_histogram::snapshot current;
+        (this->*stages[i].histogram).read(current);
+        const latency_histogram::snapshot shown = total ? current : current.since(last_stages[i]);
+        last_stages[i] = current;
+        if (!shown.count)
+            continue;
+        char mean[16], p50[16], p90[16], p99[16], p999[16], max[16];
+        fprintf(f, "  %-10s %10" PRIu64 " %9s %9s %9s %9s %9s %9s\n", stages[i].name, shown.count,
+                format_duration(mean, sizeof(mean), shown.mean()),
+                format_duration(p50, sizeof(p50), shown.percentile(50)),
+                format_duration(p90, sizeof(p90), shown.percentile(90)),
+                format_duration(p99, sizeof(p99), shown.percentile(99)),
+                format_duration(p999, sizeof(p999), shown.percentile(99.9)),
+                format_duration(max, sizeof(max), shown.percentile(100)));
+    }
+    last = now;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+#include "latency_histogram.hh"
+#include "netlink_dropmon.hh"
+#include "symbol_resolver.hh"
+
+// drop_monitor's own pipeline (--stats): a latency histogram per stage and
+// the counters that tell whether it keeps up with the kernel.
+//
+// Every histogram and counter has one writing thread, noted below, so
+// recording takes no locks. Reports are printed by the output thread.
+struct self_stats {
+    // receive thread
+    latency_histogram receive;      // one recvmmsg that returned datagrams
+    latency_histogram parse;        // decoding one datagram
+    std::atomic<uint64_t> datagrams{0};
+    std::atomic<uint64_t> alerts{0};
+    std::atomic<uint64_t> drop_points{0};
+    std::atomic<uint64_t> overruns{0};
+
+    // output thread
+    latency_histogram queue;        // receive to output thread, oldest record of a batch
+    latency_histogram output;       // one batch: filter, count, symbolize, format
+    latency_histogram write;        // one flush of formatted output
+    latency_histogram kallsyms;     // one kallsyms lookup
+    latency_histogram dwarf;        // one DWARF lookup
+
+    // startup phases in ns, 0 until done; kallsyms by the output thread,
+    // dwfl by the DWARF loader
+    std::atomic<uint64_t> kallsyms_load_ns{0};
+    std::atomic<uint64_t> dwfl_report_ns{0};
+    std::atomic<uint64_t> dwfl_preload_ns{0};
+
+    self_stats();
+
+    // receive thread, after each wakeup; overruns include losses upstream
+    void set_receive(const drop_mon_stats &stats, uint64_t overruns);
+
+    // What happened since the previous report, or since start if total.
+    // lost_queue and resolver are the output thread's.
+    void print(FILE *f, bool total, uint64_t lost_queue, const symbol_resolver::counters &resolver);
+
+private:
+    struct totals {
+        uint64_t timestamp;
+        uint64_t datagrams, alerts, drop_points, overruns, lost_queue;
+        symbol_resolver::counters resolver;
+    };
+
+    totals start = {};
+    totals last = {};                                   // previous report
+    std::vector<latency_histogram::snapshot> last_stages;
+    bool startup_printed = false;
+};
+
+// "850ns", "12.3us", "4.5ms", "1.2s"; returns buf
+const char *format_duration(char *buf, size_t size, uint64_t ns);
@@ -0,0 +1,290 @@
+#include "shm_stats.hh"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "common.hh"
+
+static_assert(sizeof(shm_stats_site) == 40, "shm_stats_site is part of the file format");
+static_assert(sizeof(std::atomic<uint64_t>) == sizeof(uint64_t), "atomics must be plain words");
+
+static size_t align_up(size_t n, size_t a)
+{
+    return (n + a - 1) / a * a;
+}
+
+shm_stats_writer::~shm_stats_writer()
+{
+    if (!hdr)
+        return;
+    hdr->writer_pid.store(0, std::memory_order_release);
+    munmap(hdr, size);
+}
+
+bool shm_stats_writer::open(const char *path, uint32_t site_capacity, size_t string_capacity)
+{
+    const size_t sites_offset = align_up(sizeof(shm_stats_header), 64);
+    const size_t strings_offset = align_up(sites_offset + site_capacity * sizeof(shm_stats_site), 4096);
+    size = align_up(strings_offset + string_capacity, 4096);
+
+    // built under a temporary name so readers never map a partial header
+    const std::string tmp = std::string(path) + ".tmp";
+    const int fd = ::open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        fprintf(stderr, "shm stats: cannot create %s: %s\n", tmp.c_str(), strerror(errno));
+        return false;
+    }
+    if (ftruncate(fd, size) == -1) {
+        fprintf(stderr, "shm stats: cannot size %s: %s\n", tmp.c_str(), strerror(errno));
+        close(fd);
+        unlink(tmp.c_str());
+        return false;
+    }
+    void *map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("shm stats: mmap");
+        unlink(tmp.c_str());
+        return false;
+    }
+
+    // a fresh file reads as zeros: all counters and seqs start at 0
+    hdr = static_cast<shm_stats_header *>(map);
+    memcpy(hdr->magic, shm_stats_magic, sizeof(hdr->magic));
+    hdr->version = shm_stats_version;
+    hdr->header_size = sizeof(shm_stats_header);
+    hdr->site_size = sizeof(shm_stats_site);
+    hdr->site_capacity = site_capacity;
+    hdr->sites_offset = sites_offset;
+    hdr->strings_offset = strings_offset;
+    hdr->string_capacity = string_capacity;
+    hdr->start_ns = monotonic_ns();
+    hdr->string_used.store(1, std::memory_order_relaxed);   // id 0: ""
+    hdr->writer_pid.store(getpid(), std::memory_order_release);
+    sites = reinterpret_cast<shm_stats_site *>(static_cast<char *>(map) + sites_offset);
+    strings = static_cast<char *>(map) + strings_offset;
+
+    if (rename(tmp.c_str(), path) == -1) {
+        fprintf(stderr, "shm stats: cannot rename to %s: %s\n", path, strerror(errno));
+        unlink(tmp.c_str());
+        munmap(map, size);
+        hdr = nullptr;
+        return false;
+    }
+    return true;
+}
+
+void shm_stats_writer::set_receive(const shm_stats_receive &stats)
+{
+    if (!hdr)
+        return;
+    uint64_t words[sizeof(stats) / sizeof(uint64_t)];
+    memcpy(words, &stats, sizeof(words));
+    const uint32_t seq = hdr->receive_seq.load(std::memory_order_relaxed);
+    hdr->receive_seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (size_t i = 0; i < sizeof(words) / sizeof(words[0]); i++)
+        hdr->receive[i].store(words[i], std::memory_order_relaxed);
+    hdr->receive_seq.store(seq + 2, std::memory_order_release);
+}
+
+void shm_stats_writer::add(uint64_t pc, uint64_t count, uint64_t timestamp)
+{
+    if (!hdr)
+        return;
+    uint32_t &slot = slots[pc];
+    if (!slot) {
+        const uint32_t n = hdr->site_count.load(std::memory_order_relaxed);
+        if (n == hdr->site_capacity) {
+            hdr->sites_full.fetch_add(count, std::memory_order_relaxed);
+            slots.erase(pc);
+            return;
+        }
+        sites[n].pc.store(pc, std::memory_order_relaxed);
+        sites[n].count.store(count, std::memory_order_relaxed);
+        sites[n].last_ns.store(timestamp, std::memory_order_relaxed);
+        hdr->site_count.store(n + 1, std::memory_order_release);
+        slot = n + 1;
+        return;
+    }
+    shm_stats_site &site = sites[slot - 1];
+    const uint32_t seq = site.seq.load(std::memory_order_relaxed);
+    site.seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    site.count.store(site.count.load(std::memory_order_relaxed) + count, std::memory_order_relaxed);
+    site.last_ns.store(timestamp, std::memory_order_relaxed);
+    site.seq.store(seq + 2, std::memory_order_release);
+}
+
+void shm_stats_writer::unresolve(uint64_t begin, uint64_t end)
+{
+    if (!hdr)
+        return;
+    const uint32_t count = hdr->site_count.load(std::memory_order_relaxed);
+    for (uint32_t i = 0; i < count; i++) {
+        shm_stats_site &site = sites[i];
+        const uint64_t pc = site.pc.load(std::memory_order_relaxed);
+        if (pc < begin || pc >= end)
+            continue;
+        const uint32_t seq = site.seq.load(std::memory_order_relaxed);
+        site.seq.store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        site.symbol.store(0, std::memory_order_relaxed);
+        site.location.store(0, std::memory_order_relaxed);
+        site.function.store(0, std::memory_order_relaxed);
+        site.seq.store(seq + 2, std::memory_order_release);
+    }
+}
+
+uint32_t shm_stats_writer::intern(const std::string &s)
+{
+    auto it = ids.find(s);
+    if (it != ids.end())
+        return it->second;
+    const size_t len = s.size() + 1;
+    const uint64_t used = hdr->string_used.load(std::memory_order_relaxed);
+    if (used + len > hdr->string_capacity)
+        return 0;
+    memcpy(strings + used, s.c_str(), len);
+    // the string is complete before any site can refer to it
+    hdr->string_used.store(used + len, std::memory_order_release);
+    ids.emplace(s, used);
+    return used;
+}
+
+void shm_stats_writer::set_strings(shm_stats_site &site, const std::string &symbol,
+                                   const std::string &location, const std::string &function)
+{
+    const uint32_t symbol_id = !symbol.empty() ? intern(symbol) : site.symbol.load(std::memory_order_relaxed);
+    const uint32_t location_id = !location.empty() ? intern(location) : site.location.load(std::memory_order_relaxed);
+    const uint32_t function_id = !function.empty() ? intern(function) : site.function.load(std::memory_order_relaxed);
+    if (symbol_id == site.symbol.load(std::memory_order_relaxed)
+        && location_id == site.location.load(std::memory_order_relaxed)
+        && function_id == site.function.load(std::memory_order_relaxed))
+        return;
+    const uint32_t seq = site.seq.load(std::memory_order_relaxed);
+    site.seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    site.symbol.store(symbol_id, std::memory_order_relaxed);
+    site.location.store(location_id, std::memory_order_relaxed);
+    site.function.store(function_id, std::memory_order_relaxed);
+    site.seq.store(seq + 2, std::memory_order_release);
+}
+
+// Runs copy() until it ran between two equal, even reads of seq. Fails
+// only if seq stays odd: the writer died in the middle of an update.
+template<typename F>
+static bool seq_read(const std::atomic<uint32_t> &seq, F copy)
+{
+    uint32_t odd = 0;
+    int stuck = 0;
+    for (;;) {
+        const uint32_t before = seq.load(std::memory_order_acquire);
+        if (before & 1) {
+            stuck = before == odd ? stuck + 1 : 0;
+            odd = before;
+            if (stuck == 1000000)
+                return false;
+            std::this_thread::yield();
+            continue;
+        }
+        copy();
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (seq.load(std::memory_order_relaxed) == before)
+            return true;
+    }
+}
+
+shm_stats_reader::~shm_stats_reader()
+{
+    if (hdr)
+        munmap(const_cast<shm_stats_header *>(hdr), size);
+}
+
+bool shm_stats_reader::open(const char *path)
+{
+    const int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        fprintf(stderr, "cannot open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || static_cast<size_t>(st.st_size) < sizeof(shm_stats_header)) {
+        fprintf(stderr, "%s: not a drop_monitor stats file\n", path);
+        close(fd);
+        return false;
+    }
+    size = st.st_size;
+    void *map = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return false;
+    }
+    hdr = static_cast<const shm_stats_header *>(map);
+    if (memcmp(hdr->magic, shm_stats_magic, sizeof(shm_stats_magic)) != 0
+        || hdr->version != shm_stats_version || hdr->site_size != sizeof(shm_stats_site)
+        || hdr->sites_offset + uint64_t(hdr->site_capacity) * hdr->site_size > size
+        || hdr->strings_offset + hdr->string_capacity > size) {
+        fprintf(stderr, "%s: not a drop_monitor stats file of version %u\n", path, shm_stats_version);
+        munmap(map, size);
+        hdr = nullptr;
+        return false;
+    }
+    sites = reinterpret_cast<const shm_stats_site *>(static_cast<const char *>(map) + hdr->sites_offset);
+    strings = static_cast<const char *>(map) + hdr->strings_offset;
+    return true;
+}
+
+const char *shm_stats_reader::string(uint32_t id) const
+{
+    return id < hdr->string_capacity ? strings + id : "";
+}
+
+bool shm_stats_reader::read(snapshot &out) const
+{
+    if (!hdr)
+        return false;
+    out.writer_pid = hdr->writer_pid.load(std::memory_order_acquire);
+    out.start_ns = hdr->start_ns;
+    out.sites_full = hdr->sites_full.load(std::memory_order_relaxed);
+
+    uint64_t words[sizeof(out.receive) / sizeof(uint64_t)];
+    const bool complete = seq_read(hdr->receive_seq, [this, &words]() {
+        for (size_t i = 0; i < sizeof(words) / sizeof(words[0]); i++)
+            words[i] = hdr->receive[i].load(std::memory_order_relaxed);
+    });
+    if (!complete)
+        return false;
+    memcpy(&out.receive, words, sizeof(words));
+
+    const uint32_t count = std::min(hdr->site_count.load(std::memory_order_acquire), hdr->site_capacity);
+    out.sites.resize(count);
+    for (uint32_t i = 0; i < count; i++) {
+        const shm_stats_site &src = sites[i];
+        site &dst = out.sites[i];
+        uint32_t symbol, location, function;
+        const bool complete = seq_read(src.seq, [&]() {
+            dst.pc = src.pc.load(std::memory_order_relaxed);
+            dst.count = src.count.load(std::memory_order_relaxed);
+            dst.last_ns = src.last_ns.load(std::memory_order_relaxed);
+            symbol = src.symbol.load(std::memory_order_relaxed);
+            location = src.location.load(std::memory_order_relaxed);
+            function = src.function.load(std::memory_order_relaxed);
+        });
+        if (!complete)
+            return false;
+        dst.symbol = string(symbol);
+        dst.location = string(location);
+        dst.function = string(function);
+    }
+    return true;
+}
@@ -0,0 +1,176 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "pc_map.hh"
+
+// Live counters in a shared memory file (e.g. /dev/shm/drop_monitor) for
+// local consumers that map it read-only and read it without syscalls.
+//
+// Layout, native endianness, all offsets from the start of the file:
+//
+//   shm_stats_header                       at 0
+//   shm_stats_site[site_capacity]          at sites_offset
+//   char strings[string_capacity]          at strings_offset
+//
+// Two single writers update the region, each under its own seqlock: the
+// receive loop writes the receive counters in the header (receive_seq),
+// the output thread writes the sites (one seq per site). A seq is odd
+// while its data is being written; readers copy the data between two
+// reads of an even, unchanged seq and retry otherwise.
+//
+// Sites are appended and never move; site_count is published after the
+// new site is complete. A site's symbol, location and function are ids
+// into the string table: byte offsets of NUL-terminated strings, 0 for none
+// (the table starts with an empty string). Strings are appended and never
+// change, so an id read under a site's seqlock can be dereferenced
+// without one.
+//
+// A restarted drop_monitor creates a new file and renames it over the old
+// one; readers notice by writer_pid dropping to 0 (or naming a process
+// that is gone) and reopen the path.
+
+static const char shm_stats_magic[8] = {'D', 'M', 'S', 'T', 'A', 'T', 'S', '\0'};
+static const uint32_t shm_stats_version = 1;
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2,
+              "the shared region relies on address-free atomics");
+
+struct shm_stats_receive {
+    uint64_t datagrams;
+    uint64_t bytes;
+    uint64_t alerts;
+    uint64_t drop_points;
+    uint64_t packets;
+    uint64_t hw_drops;
+    uint64_t overruns;      // lost in the netlink socket
+    uint64_t queue_lost;    // lost between the receive loop and the output thread
+};
+
+struct shm_stats_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;   // sizeof(shm_stats_header)
+    uint32_t site_size;     // sizeof(shm_stats_site)
+    uint32_t site_capacity;
+    uint64_t sites_offset;
+    uint64_t strings_offset;
+    uint64_t string_capacity;
+    uint64_t start_ns;      // CLOCK_MONOTONIC when the region was created
+
+    std::atomic<uint32_t> writer_pid;   // 0 once the writer exited
+    std::atomic<uint32_t> site_count;
+    std::atomic<uint64_t> sites_full;   // drops at sites that did not fit
+    std::atomic<uint64_t> string_used;
+
+    std::atomic<uint32_t> receive_seq;
+    uint32_t reserved;
+    // fields are std::atomic<uint64_t> in the region, laid out as shm_stats_receive
+    std::atomic<uint64_t> receive[sizeof(shm_stats_receive) / sizeof(uint64_t)];
+};
+
+struct shm_stats_site {
+    std::atomic<uint32_t> seq;
+    std::atomic<uint32_t> symbol;       // "name+offset", 0 until resolved
+    std::atomic<uint32_t> location;     // "file:line", 0 without DWARF
+    std::atomic<uint32_t> function;     // innermost inlined function, 0 if none
+    std::atomic<uint64_t> pc;
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> last_ns;      // CLOCK_MONOTONIC of the last drop
+};
+
+// Creates and updates the region.
+struct shm_stats_writer {
+    shm_stats_writer() = default;
+    ~shm_stats_writer();
+    shm_stats_writer(const shm_stats_writer &) = delete;
+    shm_stats_writer &operator=(const shm_stats_writer &) = delete;
+
+    bool open(const char *path, uint32_t site_capacity = 16384, size_t string_capacity = 1 << 20);
+    explicit operator bool() const { return hdr != nullptr; }
+
+    // receive loop
+    void set_receive(const shm_stats_receive &stats);
+
+    // output thread
+    void add(uint64_t pc, uint64_t count, uint64_t timestamp);
+    // Calls f(pc, symbol, location, function) for sites that still lack a
+    // symbol or location; f fills in the strings it has, empty ones leave
+    // the site as it is.
+    template<typename F>
+    void resolve(F f);
+    // Clears symbols of sites in [begin, end) so resolve() looks them up again.
+    void unresolve(uint64_t begin, uint64_t end);
+
+private:
+    uint32_t intern(const std::string &s);
+    void set_strings(shm_stats_site &site, const std::string &symbol, const std::string &location,
+                     const std::string &function);
+
+    shm_stats_header *hdr = nullptr;
+    size_t size = 0;
+    shm_stats_site *sites = nullptr;
+    char *strings = nullptr;
+    pc_map<uint32_t> slots;                         // pc -> site index + 1
+    std::unordered_map<std::string, uint32_t> ids;  // string -> id
+};
+
+template<typename F>
+void shm_stats_writer::resolve(F f)
+{
+    if (!hdr)
+        return;
+    std::string symbol, location, function;
+    const uint32_t count = hdr->site_count.load(std::memory_order_relaxed);
+    for (uint32_t i = 0; i < count; i++) {
+        shm_stats_site &site = sites[i];
+        if (site.symbol.load(std::memory_order_relaxed) && site.location.load(std::memory_order_relaxed))
+            continue;
+        symbol.clear();
+        location.clear();
+        function.clear();
+        f(site.pc.load(std::memory_order_relaxed), symbol, location, function);
+        set_strings(site, symbol, location, function);
+    }
+}
+
+// Maps a region read-only and takes consistent copies of it.
+struct shm_stats_reader {
+    struct site {
+        uint64_t pc;
+        uint64_t count;
+        uint64_t last_ns;
+        const char *symbol;     // "" if none
+        const char *location;
+        const char *function;
+    };
+
+    struct snapshot {
+        uint32_t writer_pid;
+        uint64_t start_ns;
+        uint64_t sites_full;
+        shm_stats_receive receive;
+        std::vector<site> sites;
+    };
+
+    shm_stats_reader() = default;
+    ~shm_stats_reader();
+    shm_stats_reader(const shm_stats_reader &) = delete;
+    shm_stats_reader &operator=(const shm_stats_reader &) = delete;
+
+    bool open(const char *path);
+    bool read(snapshot &out) const;
+
+private:
+    const char *string(uint32_t id) const;
+
+    const shm_stats_header *hdr = nullptr;
+    size_t size = 0;
+    const shm_stats_site *sites = nullptr;
+    const char *strings = nullptr;
+};
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+// Bounded lock-free single-producer/single-consumer ring.
+//
+// push() and pop() never block; a full ring makes push() fail so the
+// producer can account for the loss. Each side keeps a cached copy of the
+// other side's index and only reloads it when the ring looks full/empty.
+template<typename T>
+struct spsc_ring {
+    explicit spsc_ring(size_t capacity)
+        : buf(round_up(capacity))
+    {}
+
+    // producer side
+    bool push(const T &v)
+    {
+        const size_t head = prod.index.load(std::memory_order_relaxed);
+        if (head - prod.cached == buf.size()) {
+            prod.cached = cons.index.load(std::memory_order_acquire);
+            if (head - prod.cached == buf.size())
+                return false;
+        }
+        buf[head & (buf.size() - 1)] = v;
+        prod.index.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    // consumer side: moves up to max elements to out, returns the count
+    size_t pop(T *out, size_t max)
+    {
+        const size_t tail = cons.index.load(std::memory_order_relaxed);
+        if (cons.cached == tail) {
+            cons.cached = prod.index.load(std::memory_order_acquire);
+            if (cons.cached == tail)
+                return 0;
+        }
+        size_t n = cons.cached - tail;
+        n = n < max ? n : max;
+        for (size_t i = 0; i < n; i++)
+            out[i] = buf[(tail + i) & (buf.size() - 1)];
+        cons.index.store(tail + n, std::memory_order_release);
+        return n;
+    }
+
+    bool empty() const
+    {
+        return cons.index.load(std::memory_order_acquire) == prod.index.load(std::memory_order_acquire);
+    }
+
+    size_t capacity() const { return buf.size(); }
+
+private:
+    static size_t round_up(size_t n)
+    {
+        size_t cap = 2;
+        while (cap < n)
+            cap <<= 1;
+        return cap;
+    }
+
+    // one cache line per side, so producer and consumer do not share lines
+    struct side {
+        std::atomic<size_t> index{0};
+        size_t cached = 0;
+        char pad[64 - sizeof(std::atomic<size_t>) - sizeof(size_t)];
+    };
+
+    side prod;
+    side cons;
+    std::vector<T> buf;
+};
@@ -0,0 +1,389 @@
+// End-to-end load test of the receive path, without a kernel or privileges.
+//
+//   stress [--format summary|packet|hw] [--rate ALERTS] [--entries N] [--sites N]
+//          [--seconds S] [--sndbuf BYTES] [--top N] [--sweep]
+//
+// A generator thread plays NET_DM: it sends well-formed alerts, one per
+// datagram, over a socketpair at a fixed rate (0: as fast as it can). The
+// other end is drop_monitor's live path: drop_mon_t::try_rx() into
+// receiver_ctx, which symbolizes against a synthetic kallsyms table and
+// formats into /dev/null. Like the kernel's multicast, the generator never
+// waits: an alert that does not fit the socket buffer is lost, and the
+// receiver is told with an NLMSG_OVERRUN. Reports the drop point rate the
+// receiver sustained, the receive lag (send to recvmmsg) and the losses.
+//
+// --sweep doubles the rate each round until alerts are lost and reports
+// the highest rate handled without loss. It also stops when the generator
+// cannot keep up with the rate it was asked for.
+
+#include <arpa/inet.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <future>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <linux/genetlink.h>
+#include <linux/net_dropmon.h>
+#include <linux/netlink.h>
+
+#include "common.hh"
+#include "genl_message.hh"
+#include "kallsyms_lookup.hh"
+#include "latency_histogram.hh"
+#include "netlink_dropmon.hh"
+#include "receiver.hh"
+#include "self_stats.hh"
+
+static const int family = GENL_MIN_ID + 7;
+static const uint64_t text_base = 0xffffffff81000000ull;
+static const uint64_t site_stride = 256;    // bytes of text per synthetic function
+
+enum class alert_format { summary, packet, hw };
+
+struct options {
+    alert_format format = alert_format::summary;
+    uint64_t rate = 100000;     // alerts per second, 0 = unpaced
+    uint32_t entries = 8;       // drop points per summary, traps per hw summary
+    uint32_t sites = 1000;      // distinct drop sites
+    double seconds = 5;
+    int sndbuf = 0;             // generator socket buffer, 0 = default
+    size_t top_n = 0;
+    bool sweep = false;
+};
+
+// "ffffffff81000000 t site_0" ..., one function per drop site
+static std::vector<char> synthetic_kallsyms(uint32_t sites)
+{
+    std::vector<char> text;
+    char line[64];
+    for (uint32_t i = 0; i < sites; i++) {
+        const int len = snprintf(line, sizeof line, "%016" PRIx64 " t site_%u\n",
+                                 text_base + i * site_stride, i);
+        text.insert(text.end(), line, line + len);
+    }
+    return text;
+}
+
+static uint64_t site_pc(uint64_t n, uint32_t sites)
+{
+    return text_base + (n % sites) * site_stride + 0x10 + n % 0x40;
+}
+
+// Alert number n, as the kernel would send it.
+static genl_message make_alert(const options &o, uint64_t n)
+{
+    if (o.format == alert_format::summary) {
+        genl_message m(family, NET_DM_CMD_ALERT);
+        m.alert_msg(o.entries, [&o, n](uint32_t i) {
+            return std::make_pair(site_pc(n * o.entries + i, o.sites), 1 + i % 3);
+        });
+        return m;
+    }
+    if (o.format == alert_format::hw) {
+        genl_message m(family, NET_DM_CMD_ALERT);
+        const size_t entries = m.nest();
+        for (uint32_t i = 0; i < o.entries; i++) {
+            char name[32];
+            snprintf(name, sizeof(name), "trap_%" PRIu64, (n * o.entries + i) % o.sites);
+            const size_t entry = m.nest();
+            m.put(NET_DM_ATTR_HW_TRAP_NAME, name);
+            m.put<uint32_t>(NET_DM_ATTR_HW_TRAP_COUNT, 1 + i % 3);
+            m.nest(entry, NET_DM_ATTR_HW_ENTRY);
+        }
+        m.nest(entries, NET_DM_ATTR_HW_ENTRIES);
+        return m;
+    }
+
+    // an IPv4/UDP packet, so flows can be parsed too
+    unsigned char payload[64] = {0x45, 0x00, 0x00, 0x40, 0, 0, 0x40, 0, 0x40, 17};
+    const uint32_t saddr = htonl(0x0a000000 | (n % 4096)), daddr = htonl(0x0a010001);
+    memcpy(payload + 12, &saddr, 4);
+    memcpy(payload + 16, &daddr, 4);
+    const uint16_t sport = htons(1024 + n % 1000), dport = htons(53);
+    memcpy(payload + 20, &sport, 2);
+    memcpy(payload + 22, &dport, 2);
+
+    genl_message m(family, NET_DM_CMD_PACKET_ALERT);
+    m.put<uint64_t>(NET_DM_ATTR_PC, site_pc(n, o.sites));
+    m.put(NET_DM_ATTR_SYMBOL, "site+0x10/0x100");
+    const size_t port = m.nest();
+    m.put<uint32_t>(NET_DM_ATTR_PORT_NETDEV_IFINDEX, 2);
+    m.put(NET_DM_ATTR_PORT_NETDEV_NAME, "eth0");
+    m.nest(port, NET_DM_ATTR_IN_PORT);
+    m.put<uint64_t>(NET_DM_ATTR_TIMESTAMP, n);
+    m.put<uint16_t>(NET_DM_ATTR_PROTO, 0x0800);
+    m.put<uint16_t>(NET_DM_ATTR_ORIGIN, NET_DM_ORIGIN_SW);
+    m.put<uint32_t>(NET_DM_ATTR_ORIG_LEN, 1500);
+    m.put(NET_DM_ATTR_REASON, "NO_SOCKET");
+    m.attr(NET_DM_ATTR_PAYLOAD, payload, sizeof(payload));
+    return m;
+}
+
+// Drop points the parser reports for one alert.
+static uint32_t points_per_alert(const options &o)
+{
+    return o.format == alert_format::packet ? 1 : o.entries;
+}
+
+struct generator {
+    int fd;
+    std::vector<genl_message> alerts;    // sent round robin
+    uint64_t rate;
+    uint64_t duration_ns;
+
+    uint64_t sent = 0;
+    uint64_t lost = 0;              // did not fit the socket buffer
+    uint64_t elapsed_ns = 0;
+    std::atomic<bool> done{false};
+
+    void run()
+    {
+        nlmsghdr overrun{sizeof(nlmsghdr), NLMSG_OVERRUN, 0, 0, 0};
+        bool overrun_pending = false;
+        const uint64_t start = monotonic_ns();
+        for (uint64_t now = start; now - start < duration_ns; now = monotonic_ns()) {
+            // what is due, in bursts of at most 64 so the deadline is seen;
+            // double, as (now - start) * rate overflows at high rates
+            const uint64_t due = rate ? static_cast<uint64_t>((now - start) / 1e9 * rate) : UINT64_MAX;
+            const uint64_t burst = std::min(due, sent + lost + 64);
+            for (uint64_t n = sent + lost; n < burst; n++) {
+                if (overrun_pending && ::send(fd, &overrun, sizeof(overrun), MSG_DONTWAIT) != -1)
+                    overrun_pending = false;
+                // the kernel leaves nlmsg_seq and nlmsg_pid 0 in multicast
+                // alerts; they carry the send time here
+                auto &buf = alerts[n % alerts.size()].buf;
+                auto nlh = reinterpret_cast<nlmsghdr *>(buf.data());
+                const uint64_t t = monotonic_ns();
+                nlh->nlmsg_seq = static_cast<uint32_t>(t);
+                nlh->nlmsg_pid = static_cast<uint32_t>(t >> 32);
+                if (::send(fd, buf.data(), buf.size(), MSG_DONTWAIT) != -1) {
+                    sent++;
+                } else if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+                    lost++;
+                    overrun_pending = true;
+                } else if (errno != EINTR) {
+                    perror("send");
+                    done.store(true, std::memory_order_release);
+                    return;
+                }
+            }
+            if (rate && sent + lost >= due)
+                std::this_thread::sleep_for(std::chrono::microseconds(50));
+        }
+        elapsed_ns = monotonic_ns() - start;
+        // the receiver is draining, this send does not wait long
+        if (overrun_pending && ::send(fd, &overrun, sizeof(overrun), 0) == -1)
+            perror("send");
+        done.store(true, std::memory_order_release);
+    }
+};
+
+struct round_result {
+    uint64_t sent = 0;
+    uint64_t lost = 0;              // in the socket
+    uint64_t overruns = 0;          // losses the receiver was told about
+    uint64_t ring_full = 0;         // lost between receive and output thread
+    uint64_t points = 0;            // parsed by the receiver
+    uint64_t expected = 0;          // points in the alerts that were sent
+    double seconds = 0;
+    double offered = 0;             // alerts per second the generator got out
+    latency_histogram::snapshot lag;
+};
+
+static round_result run_round(const options &o, uint64_t rate, const std::vector<char> &kallsyms, int null_fd)
+{
+    round_result r;
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0, fds) == -1) {
+        perror("socketpair");
+        exit(1);
+    }
+    if (o.sndbuf && setsockopt(fds[1], SOL_SOCKET, SO_SNDBUF, &o.sndbuf, sizeof(o.sndbuf)) == -1)
+        perror("setsockopt(SO_SNDBUF)");
+
+    generator gen;
+    gen.fd = fds[1];
+    gen.rate = rate;
+    gen.duration_ns = o.seconds * 1e9;
+    for (uint64_t n = 0; n < 256; n++)
+        gen.alerts.push_back(make_alert(o, n));
+
+    const kernel_layout layout;
+    receiver_options opts;
+    opts.layout = &layout;
+    opts.output_fd = null_fd;
+    opts.top_n = o.top_n;
+    opts.interval = std::chrono::seconds(1);
+    opts.top_flows = o.format == alert_format::packet && o.top_n ? o.top_n : 0;
+    receiver_ctx rx_ctx(opts);
+    std::promise<std::unique_ptr<kallsyms_cache>> kcache;
+    kcache.set_value(make_unique<kallsyms_cache>(kallsyms.data(), kallsyms.size()));
+    std::thread output(&receiver_ctx::run, &rx_ctx, kcache.get_future());
+
+    std::unique_ptr<latency_histogram> lag(new latency_histogram);
+    drop_mon_t dropmon(drop_mon_t::callback_t(), family, fds[0]);
+    dropmon.set_rx_hook([&lag](const void *buf, size_t len) {
+        if (len < sizeof(nlmsghdr))
+            return;
+        nlmsghdr nlh;
+        memcpy(&nlh, buf, sizeof(nlh));
+        if (nlh.nlmsg_type != family)
+            return;
+        const uint64_t sent = uint64_t(nlh.nlmsg_pid) << 32 | nlh.nlmsg_seq;
+        const uint64_t now = monotonic_ns();
+        lag->record(now > sent ? now - sent : 0);
+    });
+    uint64_t rx_time = 0;
+    auto push = [&rx_ctx, &rx_time, &r](const drop_points &points) {
+        r.points += points.size();
+        rx_ctx.push(rx_time, points);
+    };
+
+    std::thread sender(&generator::run, &gen);
+    // the last try_rx() after the generator is done drains the socket
+    for (bool last = false; !last; ) {
+        last = gen.done.load(std::memory_order_acquire);
+        pollfd pfd{fds[0], POLLIN, 0};
+        if (!last && poll(&pfd, 1, 100) <= 0)
+            continue;
+        rx_time = monotonic_ns();
+        uint64_t before;
+        do {
+            before = dropmon.stats().datagrams;
+            if (!dropmon.try_rx(push))
+                exit(1);
+        } while (last && dropmon.stats().datagrams != before);
+        rx_ctx.overruns.store(dropmon.stats().overruns, std::memory_order_relaxed);
+    }
+    sender.join();
+    rx_ctx.stop();
+    output.join();
+    close(fds[0]);
+    close(fds[1]);
+
+    r.sent = gen.sent;
+    r.lost = gen.lost;
+    r.overruns = dropmon.stats().overruns;
+    r.ring_full = rx_ctx.ring_full.load(std::memory_order_relaxed);
+    r.expected = gen.sent * points_per_alert(o);
+    r.seconds = gen.elapsed_ns / 1e9;
+    r.offered = r.seconds > 0 ? (gen.sent + gen.lost) / r.seconds : 0;
+    lag->read(r.lag);
+    return r;
+}
+
+static void print_round(uint64_t rate, const round_result &r)
+{
+    char p50[16], p99[16], max[16];
+    printf("rate %10" PRIu64 "/s (%.0f/s offered): %10" PRIu64 " alerts in %.1fs, %10.0f points/s, lost %" PRIu64
+           " in socket (%" PRIu64 " overruns seen), %" PRIu64 " in queue, lag p50 %s p99 %s max %s\n",
+           rate, r.offered, r.sent, r.seconds, r.seconds > 0 ? r.points / r.seconds : 0.0, r.lost, r.overruns,
+           r.ring_full, format_duration(p50, sizeof(p50), r.lag.percentile(50)),
+           format_duration(p99, sizeof(p99), r.lag.percentile(99)),
+           format_duration(max, sizeof(max), r.lag.percentile(100)));
+    fflush(stdout);
+}
+
+static void usage(const char *comm)
+{
+    printf("%s: [--format summary|packet|hw] [--rate ALERTS] [--entries N] [--sites N]\n"
+           "    [--seconds S] [--sndbuf BYTES] [--top N] [--sweep]\n", comm);
+}
+
+int main(int argc, char *argv[])
+{
+    options o;
+    for (int i = 1; i < argc; i++) {
+        const bool arg = i + 1 < argc;
+        if (strcmp(argv[i], "--format") == 0 && arg) {
+            const char *f = argv[++i];
+            if (strcmp(f, "summary") == 0) {
+                o.format = alert_format::summary;
+            } else if (strcmp(f, "packet") == 0) {
+                o.format = alert_format::packet;
+            } else if (strcmp(f, "hw") == 0) {
+                o.format = alert_format::hw;
+            } else {
+                fprintf(stderr, "unknown alert format \"%s\"\n", f);
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--rate") == 0 && arg) {
+            o.rate = strtoull(argv[++i], nullptr, 0);
+        } else if (strcmp(argv[i], "--entries") == 0 && arg) {
+            o.entries = strtoul(argv[++i], nullptr, 0);
+        } else if (strcmp(argv[i], "--sites") == 0 && arg) {
+            o.sites = strtoul(argv[++i], nullptr, 0);
+        } else if (strcmp(argv[i], "--seconds") == 0 && arg) {
+            o.seconds = strtod(argv[++i], nullptr);
+        } else if (strcmp(argv[i], "--sndbuf") == 0 && arg) {
+            o.sndbuf = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--top") == 0 && arg) {
+            o.top_n = strtoul(argv[++i], nullptr, 0);
+        } else if (strcmp(argv[i], "--sweep") == 0) {
+            o.sweep = true;
+        } else {
+            usage(argv[0]);
+            return strcmp(argv[i], "--help") == 0 ? 0 : -1;
+        }
+    }
+    if (!o.entries || !o.sites || o.seconds <= 0 || (o.sweep && !o.rate)) {
+        fprintf(stderr, "entries, sites, seconds and, with --sweep, rate must be positive\n");
+        return -1;
+    }
+
+    const auto kallsyms = synthetic_kallsyms(o.sites);
+    const int null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (null_fd == -1) {
+        perror("/dev/null");
+        return -1;
+    }
+
+    int status = 0;
+    double best = 0;
+    for (uint64_t rate = o.rate; ; rate *= 2) {
+        const round_result r = run_round(o, rate, kallsyms, null_fd);
+        print_round(rate, r);
+        if (r.points != r.expected) {
+            fprintf(stderr, "parsed %" PRIu64 " drop points, sent %" PRIu64 "\n", r.points, r.expected);
+            status = 1;
+            break;
+        }
+        if (r.lost && !r.overruns) {
+            fprintf(stderr, "%" PRIu64 " alerts lost without an overrun\n", r.lost);
+            status = 1;
+            break;
+        }
+        if (!o.sweep)
+            break;
+        const bool loss = r.lost || r.ring_full;
+        // more than 5% short: the receiver was not what limited the round
+        const bool generator_bound = r.offered < rate * 0.95;
+        if (!loss)
+            best = r.offered;
+        if (loss || generator_bound || rate > UINT64_MAX / 2) {
+            if (generator_bound && !loss)
+                printf("generator-bound at %.0f alerts/s, %.0f drop points/s, without loss; "
+                       "the receiver keeps up with at least that\n", best, best * points_per_alert(o));
+            else if (best)
+                printf("sustained %.0f alerts/s, %.0f drop points/s, without loss\n",
+                       best, best * points_per_alert(o));
+            else
+                printf("loss already at %.0f alerts/s\n", r.offered);
+            break;
+        }
+    }
+    close(null_fd);
+    return status;
+}
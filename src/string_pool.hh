@@ -0,0 +1,126 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Deduplicated, append-only strings for long-lived caches.
+//
+// Strings are stored once, NUL-terminated, in 64 KiB arena blocks and
+// never move or go away, so get() pointers stay valid for the life of the
+// pool. Callers keep 32-bit ids; 0 is the empty string. The set of source
+// files and functions in a kernel is finite, so a pool fed from symbol
+// lookups stops growing once the drop sites have been seen.
+//
+// The id table is open-addressing with linear probing like pc_map; each
+// slot keeps the upper hash bits next to the id so most mismatches are
+// rejected without touching the string.
+struct string_pool {
+    string_pool()
+        : table(64)
+    {
+        strings.push_back("");
+        lengths.push_back(0);
+    }
+
+    string_pool(const string_pool &) = delete;
+    string_pool &operator=(const string_pool &) = delete;
+
+    uint32_t intern(const char *s, size_t len)
+    {
+        if (len == 0)
+            return 0;
+        const uint64_t h = hash(s, len);
+        const uint32_t tag = static_cast<uint32_t>(h >> 32);
+        size_t i = h & mask();
+        for (; table[i].id; i = (i + 1) & mask()) {
+            const slot &sl = table[i];
+            if (sl.tag == tag && lengths[sl.id] == len && memcmp(strings[sl.id], s, len) == 0)
+                return sl.id;
+        }
+        const uint32_t id = static_cast<uint32_t>(strings.size());
+        strings.push_back(store(s, len));
+        lengths.push_back(static_cast<uint32_t>(len));
+        table[i] = slot{id, tag};
+        if (2 * strings.size() > table.size())
+            grow();
+        return id;
+    }
+
+    uint32_t intern(const char *s) { return s ? intern(s, strlen(s)) : 0; }
+    uint32_t intern(const std::string &s) { return intern(s.data(), s.size()); }
+
+    const char *get(uint32_t id) const { return strings[id]; }
+    size_t length(uint32_t id) const { return lengths[id]; }
+
+    // distinct strings, including the empty one
+    size_t size() const { return strings.size(); }
+    size_t arena_bytes() const { return arena_size; }
+
+private:
+    static const size_t block_size = 64 * 1024;
+
+    struct slot {
+        uint32_t id;    // 0: empty
+        uint32_t tag;   // upper hash bits
+    };
+
+    static uint64_t hash(const char *s, size_t len)
+    {
+        // FNV-1a, then a multiply so the low bits depend on every byte
+        uint64_t h = 0xcbf29ce484222325ull;
+        for (size_t i = 0; i < len; i++)
+            h = (h ^ static_cast<unsigned char>(s[i])) * 0x100000001b3ull;
+        return h * 0x9e3779b97f4a7c15ull;
+    }
+
+    size_t mask() const { return table.size() - 1; }
+
+    const char *store(const char *s, size_t len)
+    {
+        char *p;
+        if (len + 1 > block_size / 4) {
+            // long strings get a block of their own
+            blocks.emplace_back(new char[len + 1]);
+            arena_size += len + 1;
+            p = blocks.back().get();
+        } else {
+            if (!current || block_fill + len + 1 > block_size) {
+                blocks.emplace_back(new char[block_size]);
+                current = blocks.back().get();
+                block_fill = 0;
+                arena_size += block_size;
+            }
+            p = current + block_fill;
+            block_fill += len + 1;
+        }
+        memcpy(p, s, len);
+        p[len] = '\0';
+        return p;
+    }
+
+    void grow()
+    {
+        std::vector<slot> old(table.size() * 2);
+        old.swap(table);
+        for (const auto &sl: old) {
+            if (!sl.id)
+                continue;
+            size_t i = hash(strings[sl.id], lengths[sl.id]) & mask();
+            while (table[i].id)
+                i = (i + 1) & mask();
+            table[i] = sl;
+        }
+    }
+
+    std::vector<std::unique_ptr<char[]>> blocks;
+    char *current = nullptr;    // block being filled
+    size_t block_fill = 0;
+    size_t arena_size = 0;
+    std::vector<const char *> strings;  // by id
+    std::vector<uint32_t> lengths;
+    std::vector<slot> table;
+};
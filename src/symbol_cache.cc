@@ -0,0 +1,212 @@
+#include "symbol_cache.hh"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <unordered_map>
+
+static const char symcache_magic[8] = {'D', 'M', 'S', 'Y', 'M', 'C', '\n', '\0'};
+static const uint32_t symcache_version = 2;    // 2: inline chains joined by " -> "
+
+symbol_cache::symbol_cache(const char *path, const kernel_layout &layout)
+    : path(path), layout(layout)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        if (errno != ENOENT)
+            perror("open");
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < static_cast<off_t>(sizeof(file_header))) {
+        close(fd);
+        return;
+    }
+    map_size = st.st_size;
+    map = mmap(nullptr, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        map = nullptr;
+        return;
+    }
+
+    const auto hdr = static_cast<const file_header *>(map);
+    const size_t expect = sizeof(file_header)
+        + size_t(hdr->module_count) * sizeof(file_module)
+        + size_t(hdr->entry_count) * sizeof(file_entry)
+        + hdr->string_size;
+    if (memcmp(hdr->magic, symcache_magic, sizeof(symcache_magic)) != 0 ||
+        hdr->version != symcache_version || expect != map_size ||
+        hdr->string_size == 0) {
+        fprintf(stderr, "%s: not a symbol cache or wrong version, ignored\n", path);
+        munmap(map, map_size);
+        map = nullptr;
+        return;
+    }
+    const char *base = static_cast<const char *>(map);
+    module_count = hdr->module_count;
+    entry_count = hdr->entry_count;
+    string_size = hdr->string_size;
+    modules = reinterpret_cast<const file_module *>(base + sizeof(file_header));
+    entries = reinterpret_cast<const file_entry *>(&modules[module_count]);
+    strings = reinterpret_cast<const char *>(&entries[entry_count]);
+    if (strings[string_size - 1] != '\0') {
+        munmap(map, map_size);
+        map = nullptr;
+        module_count = entry_count = string_size = 0;
+        return;
+    }
+
+    revalidate();
+}
+
+void symbol_cache::revalidate()
+{
+    module_valid.assign(module_count, 0);
+    for (uint32_t i = 0; i < module_count; i++) {
+        kernel_module stored;
+        stored.name = string_at(modules[i].name);
+        stored.build_id = string_at(modules[i].build_id);
+        stored.base = modules[i].base;
+        stored.size = modules[i].size;
+        if (i == 0) {
+            module_valid[i] = stored.same_as(layout.kernel);
+            continue;
+        }
+        const auto cur = layout.module_of(stored.base);
+        module_valid[i] = cur && stored.same_as(*cur);
+    }
+}
+
+symbol_cache::~symbol_cache()
+{
+    if (map)
+        munmap(map, map_size);
+}
+
+const char *symbol_cache::string_at(uint32_t off) const
+{
+    return off < string_size ? &strings[off] : "";
+}
+
+size_t symbol_cache::valid_modules() const
+{
+    return std::count(std::begin(module_valid), std::end(module_valid), 1);
+}
+
+bool symbol_cache::lookup(uint64_t pc, entry &out) const
+{
+    const auto end = entries + entry_count;
+    const auto it = std::lower_bound(entries, end, pc,
+                                     [](const file_entry &e, uint64_t pc) { return e.pc < pc; });
+    if (it == end || it->pc != pc || it->module >= module_count || !module_valid[it->module])
+        return false;
+    out.symbol = string_at(it->symbol);
+    out.offset = it->offset;
+    out.location = string_at(it->location);
+    out.function = string_at(it->function);
+    return true;
+}
+
+void symbol_cache::add(uint64_t pc, const char *symbol, uint64_t offset,
+                       const std::string &location, const std::string &function)
+{
+    added[pc] = added_entry{symbol ? symbol : "", offset, location, function};
+}
+
+bool symbol_cache::save() const
+{
+    // module record index of pc in the layout being written
+    auto module_index = [this](uint64_t pc) -> uint32_t {
+        const auto mod = layout.module_of(pc);
+        return mod ? static_cast<uint32_t>(mod - layout.modules.data()) + 1 : 0;
+    };
+
+    std::vector<char> strtab(1, '\0');
+    std::unordered_map<std::string, uint32_t> interned;
+    auto intern = [&strtab, &interned](const char *s) -> uint32_t {
+        if (!*s)
+            return 0;
+        auto it = interned.find(s);
+        if (it != std::end(interned))
+            return it->second;
+        const uint32_t off = strtab.size();
+        strtab.insert(std::end(strtab), s, s + strlen(s) + 1);
+        interned.emplace(s, off);
+        return off;
+    };
+
+    std::vector<file_module> mods;
+    auto add_module = [&mods, &intern](const kernel_module &m) {
+        mods.push_back(file_module{m.base, m.size, intern(m.name.c_str()), intern(m.build_id.c_str())});
+    };
+    add_module(layout.kernel);
+    for (const auto &m: layout.modules)
+        add_module(m);
+
+    std::vector<file_entry> out;
+    out.reserve(entry_count + added.size());
+    for (uint32_t i = 0; i < entry_count; i++) {
+        const auto &e = entries[i];
+        if (e.module >= module_count || !module_valid[e.module] || added.count(e.pc))
+            continue;
+        out.push_back(file_entry{e.pc, e.offset, module_index(e.pc), intern(string_at(e.symbol)),
+                                 intern(string_at(e.location)), intern(string_at(e.function))});
+    }
+    for (const auto &a: added)
+        out.push_back(file_entry{a.first, a.second.offset, module_index(a.first),
+                                 intern(a.second.symbol.c_str()), intern(a.second.location.c_str()),
+                                 intern(a.second.function.c_str())});
+    std::sort(std::begin(out), std::end(out),
+              [](const file_entry &a, const file_entry &b) { return a.pc < b.pc; });
+
+    file_header hdr;
+    memcpy(hdr.magic, symcache_magic, sizeof(hdr.magic));
+    hdr.version = symcache_version;
+    hdr.module_count = mods.size();
+    hdr.entry_count = out.size();
+    hdr.string_size = strtab.size();
+
+    const std::string tmp = path + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        perror("open");
+        return false;
+    }
+    const std::pair<const void *, size_t> parts[] = {
+        {&hdr, sizeof(hdr)},
+        {mods.data(), mods.size() * sizeof(file_module)},
+        {out.data(), out.size() * sizeof(file_entry)},
+        {strtab.data(), strtab.size()},
+    };
+    for (const auto &part: parts) {
+        const char *p = static_cast<const char *>(part.first);
+        size_t left = part.second;
+        while (left) {
+            const ssize_t n = write(fd, p, left);
+            if (n == -1 && errno == EINTR)
+                continue;
+            if (n <= 0) {
+                perror("write");
+                close(fd);
+                unlink(tmp.c_str());
+                return false;
+            }
+            p += n;
+            left -= n;
+        }
+    }
+    if (close(fd) == -1 || rename(tmp.c_str(), path.c_str()) == -1) {
+        perror("rename");
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
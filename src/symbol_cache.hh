@@ -0,0 +1,102 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "kernel_layout.hh"
+
+// Persistent PC -> (symbol+offset, source location, function) cache.
+//
+// The file is mapped read-only and looked up in place. Every entry belongs
+// to a module record (the core kernel is record 0) holding the build-id and
+// load address it was resolved against. Entries of records that do not
+// match the running kernel_layout are ignored, so a reboot with a new KASLR
+// offset or a reloaded module invalidates exactly the affected entries.
+//
+// File layout, native endianness:
+//   file_header
+//   file_module[module_count]
+//   file_entry[entry_count]      sorted by pc
+//   char strings[string_size]    NUL-terminated, offset 0 is ""
+struct symbol_cache {
+    struct entry {
+        const char *symbol;     // kallsyms name, "" if unknown
+        uint64_t offset;
+        const char *location;   // file:line[:col]
+        const char *function;   // DWARF function and inline chain
+    };
+
+    // Maps path if it exists and matches the current layout.
+    symbol_cache(const char *path, const kernel_layout &layout);
+    ~symbol_cache();
+    symbol_cache(const symbol_cache &) = delete;
+    symbol_cache &operator=(const symbol_cache &) = delete;
+
+    bool lookup(uint64_t pc, entry &out) const;
+
+    // Re-checks the mapped module records after the layout changed.
+    void revalidate();
+
+    // Remembers a result for the next save().
+    void add(uint64_t pc, const char *symbol, uint64_t offset,
+             const std::string &location, const std::string &function);
+
+    // Writes valid mapped entries plus added ones; replaces the file atomically.
+    bool save() const;
+
+    size_t mapped_entries() const { return entry_count; }
+    size_t valid_modules() const;
+
+    struct file_header {
+        char magic[8];
+        uint32_t version;
+        uint32_t module_count;
+        uint32_t entry_count;
+        uint32_t string_size;
+    };
+
+    struct file_module {
+        uint64_t base;
+        uint64_t size;
+        uint32_t name;
+        uint32_t build_id;
+    };
+
+    struct file_entry {
+        uint64_t pc;
+        uint64_t offset;
+        uint32_t module;
+        uint32_t symbol;
+        uint32_t location;
+        uint32_t function;
+    };
+
+private:
+    struct added_entry {
+        std::string symbol;
+        uint64_t offset;
+        std::string location;
+        std::string function;
+    };
+
+    const char *string_at(uint32_t off) const;
+
+    std::string path;
+    const kernel_layout &layout;
+
+    void *map = nullptr;
+    size_t map_size = 0;
+    const file_module *modules = nullptr;
+    const file_entry *entries = nullptr;
+    const char *strings = nullptr;
+    uint32_t module_count = 0;
+    uint32_t entry_count = 0;
+    uint32_t string_size = 0;
+    // per mapped module record: matches the running layout
+    std::vector<char> module_valid;
+
+    std::map<uint64_t, added_entry> added;
+};
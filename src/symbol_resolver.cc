@@ -0,0 +1,161 @@
+#include "symbol_resolver.hh"
+
+#include <algorithm>
+#include <chrono>
+
+#include "common.hh"
+
+symbol_resolver::symbol_resolver(size_t max_entries)
+    : index(max_entries), max_entries(std::max<size_t>(max_entries, 1)), breakers(1)
+{
+    entries.reserve(std::min<size_t>(this->max_entries, 4096));
+}
+
+void symbol_resolver::set_layout(const kernel_layout *layout)
+{
+    this->layout = layout;
+    breakers.assign(layout ? layout->modules.size() + 1 : 1, breaker());
+}
+
+void symbol_resolver::set_dwarf(dwarf_lookup *dwarf)
+{
+    this->dwarf = dwarf;
+    for (auto &e: entries) {
+        if (e.state != NEGATIVE)
+            continue;
+        index.erase(e.pc);
+        e = entry();
+        free_slots.push_back(&e - entries.data());
+    }
+    breakers.assign(breakers.size(), breaker());
+}
+
+void symbol_resolver::forget(uint64_t begin, uint64_t end)
+{
+    for (auto &e: entries) {
+        if (e.state == FREE || e.pc < begin || e.pc >= end)
+            continue;
+        index.erase(e.pc);
+        e = entry();
+        free_slots.push_back(&e - entries.data());
+    }
+}
+
+symbol_resolver::breaker &symbol_resolver::module_breaker(uint64_t pc)
+{
+    const auto mod = layout ? layout->module_of(pc) : nullptr;
+    return breakers[mod ? mod - layout->modules.data() + 1 : 0];
+}
+
+// Reuses a free slot, grows up to max_entries, then evicts with CLOCK.
+symbol_resolver::entry &symbol_resolver::insert(uint64_t pc)
+{
+    size_t slot = entries.size();
+    if (!free_slots.empty()) {
+        slot = free_slots.back();
+        free_slots.pop_back();
+    } else if (entries.size() < max_entries) {
+        entries.emplace_back();
+    } else {
+        for (;;) {
+            auto &e = entries[hand];
+            if (e.state == FREE || !e.referenced)
+                break;
+            e.referenced = 0;
+            hand = (hand + 1) % entries.size();
+        }
+        slot = hand;
+        hand = (hand + 1) % entries.size();
+        if (entries[slot].state != FREE) {
+            index.erase(entries[slot].pc);
+            count.evictions++;
+        }
+        entries[slot] = entry();
+    }
+    index[pc] = slot;
+    auto &e = entries[slot];
+    e.pc = pc;
+    e.referenced = 1;
+    return e;
+}
+
+symbol_resolver::result symbol_resolver::resolve(uint64_t pc)
+{
+    count.lookups++;
+    result r{nullptr, 0, nullptr, nullptr};
+    if (kcache) {
+        const uint64_t start = kallsyms_timing ? monotonic_ns() : 0;
+        const auto kallsym = kcache->lookup_symbol(pc);
+        if (kallsyms_timing)
+            kallsyms_timing->record(monotonic_ns() - start);
+        r.symbol = kallsym.first;
+        r.offset = kallsym.second;
+    }
+    symbol_cache::entry cached;
+    const bool in_symcache = symcache && symcache->lookup(pc, cached);
+    if (!r.symbol && in_symcache && *cached.symbol) {
+        r.symbol = cached.symbol;
+        r.offset = cached.offset;
+    }
+
+    if (const auto slot = index.find(pc)) {
+        auto &e = entries[*slot];
+        e.referenced = 1;
+        if (e.state == POSITIVE) {
+            count.hits++;
+            r.location = strings.get(e.location);
+            r.function = strings.get(e.function);
+        } else {
+            count.negative_hits++;
+        }
+        return r;
+    }
+    count.misses++;
+
+    if (in_symcache && *cached.function) {
+        count.symcache_hits++;
+        auto &e = insert(pc);
+        e.state = POSITIVE;
+        e.location = strings.intern(cached.location);
+        e.function = strings.intern(cached.function);
+        r.location = strings.get(e.location);
+        r.function = strings.get(e.function);
+        return r;
+    }
+
+    // without DWARF nothing is cached, so the PC is retried once it arrives
+    if (!dwarf)
+        return r;
+
+    auto &brk = module_breaker(pc);
+    if (brk.open()) {
+        count.breaker_skips++;
+        insert(pc).state = NEGATIVE;
+        return r;
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    auto sym = dwarf->lookup(pc);
+    const uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    count.dwarf_lookups++;
+    count.dwarf_ns += ns;
+    count.dwarf_max_ns = std::max(count.dwarf_max_ns, ns);
+    if (dwarf_timing)
+        dwarf_timing->record(ns);
+
+    auto &e = insert(pc);
+    if (sym.second.empty()) {
+        count.dwarf_failures++;
+        brk.failures++;
+        e.state = NEGATIVE;
+        return r;
+    }
+    brk.successes++;
+    e.state = POSITIVE;
+    e.location = strings.intern(sym.first);
+    e.function = strings.intern(sym.second);
+    r.location = strings.get(e.location);
+    r.function = strings.get(e.function);
+    return r;
+}
@@ -0,0 +1,122 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "dwarf_lookup.hh"
+#include "kallsyms_lookup.hh"
+#include "kernel_layout.hh"
+#include "latency_histogram.hh"
+#include "pc_map.hh"
+#include "string_pool.hh"
+#include "symbol_cache.hh"
+
+// Single entry point for PC symbolization.
+//
+// kallsyms answers sym+off directly. Source locations come from the
+// symbol cache file or from DWARF, and both positive and negative DWARF
+// results are cached, so a PC that failed once costs a hash probe from
+// then on. The number of cached PCs is bounded; CLOCK picks the victims.
+// Locations and functions are interned, so an entry is a PC and two ids
+// and the many PCs in one file or function share a single copy.
+// Modules that keep failing (no debuginfo installed) trip a per-module
+// breaker and are not asked again.
+struct symbol_resolver {
+    struct result {
+        const char *symbol;             // nullptr if unknown
+        size_t offset;
+        const char *location;           // nullptr if no DWARF result (yet)
+        const char *function;           // nullptr if none
+    };
+
+    struct counters {
+        uint64_t lookups = 0;
+        uint64_t hits = 0;              // cached positive
+        uint64_t negative_hits = 0;     // cached failure, DWARF skipped
+        uint64_t misses = 0;
+        uint64_t symcache_hits = 0;
+        uint64_t dwarf_lookups = 0;
+        uint64_t dwarf_failures = 0;
+        uint64_t breaker_skips = 0;     // module breaker open, DWARF skipped
+        uint64_t evictions = 0;
+        uint64_t dwarf_ns = 0;          // total time spent in dwarf_lookup
+        uint64_t dwarf_max_ns = 0;
+    };
+
+    explicit symbol_resolver(size_t max_entries = 64 * 1024);
+
+    // Sources can be attached as their loaders finish. Attaching DWARF
+    // forgets negative entries and breakers from before.
+    void set_kallsyms(const kallsyms_cache *kcache) { this->kcache = kcache; }
+    void set_symcache(const symbol_cache *symcache) { this->symcache = symcache; }
+    void set_layout(const kernel_layout *layout);
+    void set_dwarf(dwarf_lookup *dwarf);
+    // Records each kallsyms and DWARF lookup (--stats); either may be nullptr.
+    void set_timing(latency_histogram *kallsyms, latency_histogram *dwarf)
+    {
+        kallsyms_timing = kallsyms;
+        dwarf_timing = dwarf;
+    }
+
+    // Drops cached results for PCs in [begin, end), e.g. of a module that
+    // was unloaded or reloaded.
+    void forget(uint64_t begin, uint64_t end);
+
+    // Returned location and function stay valid for the resolver's life.
+    result resolve(uint64_t pc);
+
+    // Calls f(pc, location, function) for every cached DWARF result.
+    template<typename F>
+    void for_each(F f) const
+    {
+        for (const auto &e: entries)
+            if (e.state == POSITIVE)
+                f(e.pc, strings.get(e.location), strings.get(e.function));
+    }
+
+    const counters &stats() const { return count; }
+    size_t size() const { return index.size(); }
+    // distinct locations and functions, bytes held for them
+    size_t string_count() const { return strings.size() - 1; }
+    size_t string_bytes() const { return strings.arena_bytes(); }
+
+private:
+    enum : uint8_t { FREE, NEGATIVE, POSITIVE };
+
+    struct entry {
+        uint64_t pc = 0;
+        uint32_t location = 0;          // string ids
+        uint32_t function = 0;
+        uint8_t state = FREE;
+        uint8_t referenced = 0;
+    };
+
+    struct breaker {
+        uint32_t failures = 0;
+        uint32_t successes = 0;
+        bool open() const { return successes == 0 && failures >= threshold; }
+        static const uint32_t threshold = 16;
+    };
+
+    entry &insert(uint64_t pc);
+    breaker &module_breaker(uint64_t pc);
+
+    const kallsyms_cache *kcache = nullptr;
+    const symbol_cache *symcache = nullptr;
+    const kernel_layout *layout = nullptr;
+    dwarf_lookup *dwarf = nullptr;
+    latency_histogram *kallsyms_timing = nullptr;
+    latency_histogram *dwarf_timing = nullptr;
+
+    std::vector<entry> entries;
+    std::vector<uint32_t> free_slots;   // emptied by forget() and set_dwarf()
+    pc_map<uint32_t> index;
+    string_pool strings;
+    size_t max_entries;
+    size_t hand = 0;
+    // [0] core kernel, [i + 1] layout->modules[i]
+    std::vector<breaker> breakers;
+    counters count;
+};
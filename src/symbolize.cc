@@ -0,0 +1,269 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <future>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "common.hh"
+#include "dwarf_lookup.hh"
+#include "kallsyms_lookup.hh"
+#include "kernel_layout.hh"
+#include "string_pool.hh"
+
+// sorted unique addresses handed to a worker at a time
+static const size_t chunk_size = 256;
+
+static void usage(const char *comm)
+{
+    fprintf(stderr, "USAGE:\n"
+            "  %s [-j THREADS] [-d PATH] [-k] [-t] [FILE]\n"
+            "resolve the kernel addresses in FILE (default: stdin), the first hex word of\n"
+            "each line, to symbol, source location and function; one tab-separated line\n"
+            "per address in input order\n"
+            "options:\n"
+            "  -j THREADS     workers, each with its own libdwfl session (default: CPUs)\n"
+            "  -d PATH        search path for separate debuginfo files\n"
+            "  -k             kallsyms only, no DWARF\n"
+            "  -t             report counts and times on stderr\n", comm);
+}
+
+// What a unique address resolved to. Strings are kallsyms' or interned in
+// the pool of the worker that resolved the address.
+struct resolved {
+    const char *symbol = nullptr;
+    size_t offset = 0;
+    const char *location = nullptr;
+    const char *function = nullptr;
+};
+
+// Sorted unique addresses [begin, end), all in one module.
+struct chunk {
+    size_t begin;
+    size_t end;
+};
+
+struct worker_args {
+    const std::vector<uint64_t> *addrs;
+    const std::vector<chunk> *chunks;
+    std::atomic<size_t> *next;
+    const kallsyms_cache *kcache;       // nullptr without usable kallsyms
+    const char *debuginfo_path;
+    bool dwarf;
+    std::vector<resolved> *results;
+};
+
+static bool read_addresses(FILE *f, const char *name, std::vector<uint64_t> &out)
+{
+    std::vector<char> text;
+    char buf[64 * 1024];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+        text.insert(text.end(), buf, buf + n);
+    if (ferror(f)) {
+        perror(name);
+        return false;
+    }
+    text.push_back('\0');
+
+    size_t line = 0;
+    for (char *p = text.data(); *p; ) {
+        line++;
+        char *eol = strchr(p, '\n');
+        if (eol)
+            *eol = '\0';
+        while (*p == ' ' || *p == '\t')
+            p++;
+        if (*p && *p != '#' && *p != '\r') {
+            char *end;
+            errno = 0;
+            const uint64_t addr = strtoull(p, &end, 16);
+            if (errno || end == p || (*end && !strchr(" \t\r", *end))) {
+                fprintf(stderr, "%s:%zu: not an address: %s\n", name, line, p);
+                return false;
+            }
+            out.push_back(addr);
+        }
+        if (!eol)
+            break;
+        p = eol + 1;
+    }
+    return true;
+}
+
+// Splits the sorted unique addresses into chunks that stay within one
+// module, so a small module is loaded by a single worker.
+static std::vector<chunk> make_chunks(const std::vector<uint64_t> &addrs, const kernel_layout &layout)
+{
+    std::vector<chunk> chunks;
+    const kernel_module *current = nullptr;
+    for (size_t i = 0; i < addrs.size(); i++) {
+        const kernel_module *m = layout.module_of(addrs[i]);
+        if (chunks.empty() || m != current || i - chunks.back().begin == chunk_size) {
+            if (!chunks.empty())
+                chunks.back().end = i;
+            chunks.push_back(chunk{i, addrs.size()});
+            current = m;
+        }
+    }
+    return chunks;
+}
+
+// Resolves chunks until none are left. Each worker has its own libdwfl
+// session: Dwfl handles are not thread-safe.
+static void resolve_chunks(worker_args args, string_pool &pool)
+{
+    std::unique_ptr<dwarf_lookup> dwarf;
+    if (args.dwarf) {
+        dwarf = make_unique<dwarf_lookup>(args.debuginfo_path);
+        if (!*dwarf)
+            dwarf.reset();
+    }
+    const auto &addrs = *args.addrs;
+    auto &results = *args.results;
+    for (;;) {
+        const size_t c = args.next->fetch_add(1, std::memory_order_relaxed);
+        if (c >= args.chunks->size())
+            return;
+        for (size_t i = (*args.chunks)[c].begin; i < (*args.chunks)[c].end; i++) {
+            resolved &r = results[i];
+            if (args.kcache) {
+                const auto sym = args.kcache->lookup_symbol(addrs[i]);
+                r.symbol = sym.first;
+                r.offset = sym.second;
+                // not kernel text; libdwfl would only complain about it
+                if (!r.symbol)
+                    continue;
+            }
+            if (!dwarf)
+                continue;
+            const auto line = dwarf->lookup(addrs[i]);
+            if (line.second.empty())
+                continue;
+            r.location = pool.get(pool.intern(line.first));
+            r.function = pool.get(pool.intern(line.second));
+        }
+    }
+}
+
+static double ms_since(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+    const char *debuginfo_path = nullptr;
+    bool use_dwarf = true;
+    bool report_time = false;
+    const char *path = nullptr;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+            usage(argv[0]);
+            return 0;
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            threads = std::strtoul(argv[++i], nullptr, 0);
+            if (!threads) {
+                fprintf(stderr, "invalid thread count \"%s\"\n", argv[i]);
+                return -1;
+            }
+        } else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+            debuginfo_path = argv[++i];
+        } else if (strcmp(argv[i], "-k") == 0) {
+            use_dwarf = false;
+        } else if (strcmp(argv[i], "-t") == 0) {
+            report_time = true;
+        } else if (argv[i][0] == '-' && argv[i][1]) {
+            usage(argv[0]);
+            return -1;
+        } else {
+            path = argv[i];
+        }
+    }
+
+    using clock = std::chrono::steady_clock;
+    auto start = clock::now();
+    FILE *in = stdin;
+    if (path && strcmp(path, "-") != 0) {
+        in = fopen(path, "re");
+        if (!in) {
+            perror(path);
+            return -1;
+        }
+    }
+    std::vector<uint64_t> inputs;
+    const bool read_ok = read_addresses(in, path ? path : "stdin", inputs);
+    if (in != stdin)
+        fclose(in);
+    if (!read_ok)
+        return -1;
+    const double read_ms = ms_since(start);
+
+    // kallsyms loads while the addresses are sorted
+    start = clock::now();
+    auto kcache_future = std::async(std::launch::async, []() { return make_unique<kallsyms_cache>(); });
+    const kernel_layout layout = kernel_layout::read();
+    std::vector<uint64_t> addrs(inputs);
+    std::sort(addrs.begin(), addrs.end());
+    addrs.erase(std::unique(addrs.begin(), addrs.end()), addrs.end());
+    const auto chunks = make_chunks(addrs, layout);
+    const auto kcache = kcache_future.get();
+    const bool have_kallsyms = *kcache && !kcache->stats().hidden;
+    if (!have_kallsyms) {
+        if (!use_dwarf) {
+            fprintf(stderr, "kallsyms not available\n");
+            return -1;
+        }
+        fprintf(stderr, "kallsyms not available, resolving with DWARF only\n");
+    }
+    const double prepare_ms = ms_since(start);
+
+    start = clock::now();
+    threads = std::min<size_t>(threads, std::max<size_t>(chunks.size(), 1));
+    std::vector<resolved> results(addrs.size());
+    std::vector<string_pool> pools(threads);
+    std::atomic<size_t> next{0};
+    const worker_args args{&addrs, &chunks, &next, have_kallsyms ? kcache.get() : nullptr,
+                           debuginfo_path, use_dwarf, &results};
+    std::vector<std::thread> workers;
+    for (unsigned i = 1; i < threads; i++)
+        workers.emplace_back(resolve_chunks, args, std::ref(pools[i]));
+    resolve_chunks(args, pools[0]);
+    for (auto &w: workers)
+        w.join();
+    const double resolve_ms = ms_since(start);
+
+    start = clock::now();
+    static char iobuf[1 << 20];
+    setvbuf(stdout, iobuf, _IOFBF, sizeof(iobuf));
+    for (const auto addr: inputs) {
+        const auto &r = results[std::lower_bound(addrs.begin(), addrs.end(), addr) - addrs.begin()];
+        printf("%" PRIx64 "\t", addr);
+        if (r.symbol)
+            printf("%s+0x%zx", r.symbol, r.offset);
+        else
+            fputs("??", stdout);
+        printf("\t%s\t%s\n", r.location ? r.location : "??", r.function ? r.function : "??");
+    }
+    fflush(stdout);
+    const double write_ms = ms_since(start);
+
+    if (report_time) {
+        size_t with_location = 0;
+        for (const auto &r: results)
+            with_location += r.location != nullptr;
+        fprintf(stderr, "%zu addresses, %zu unique in %zu chunks, %zu with a source location\n",
+                inputs.size(), addrs.size(), chunks.size(), with_location);
+        fprintf(stderr, "read %.1f ms, kallsyms and sort %.1f ms, resolve %.1f ms (%u threads, %.0f/s), "
+                "write %.1f ms\n", read_ms, prepare_ms, resolve_ms, threads,
+                resolve_ms > 0 ? addrs.size() / resolve_ms * 1000 : 0.0, write_ms);
+    }
+    return 0;
+}
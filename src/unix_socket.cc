@@ -0,0 +1,68 @@
+#include "unix_socket.hh"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+bool unix_address(const char *what, const char *path, sockaddr_un &sun)
+{
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sun.sun_path)) {
+        fprintf(stderr, "%s socket path too long: %s\n", what, path);
+        return false;
+    }
+    strcpy(sun.sun_path, path);
+    return true;
+}
+
+// 0 if something accepts connections on sun, else the errno of connect().
+static int connect_error(const sockaddr_un &sun)
+{
+    const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        return errno;
+    const int err = connect(fd, reinterpret_cast<const sockaddr *>(&sun), sizeof(sun)) == 0 ? 0 : errno;
+    close(fd);
+    return err;
+}
+
+int unix_listen(const char *what, const char *path, int backlog)
+{
+    sockaddr_un sun;
+    if (!unix_address(what, path, sun))
+        return -1;
+    // a socket left behind by an earlier run, but nothing else: only a
+    // refused connection tells that its server is gone
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        const int err = connect_error(sun);
+        if (err == 0) {
+            fprintf(stderr, "%s: %s is already served by another process\n", what, path);
+            return -1;
+        }
+        if (err == ECONNREFUSED)
+            unlink(path);
+    }
+    const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        perror("socket");
+        return -1;
+    }
+    if (bind(fd, reinterpret_cast<sockaddr *>(&sun), sizeof(sun)) == -1) {
+        fprintf(stderr, "%s: bind %s: %s\n", what, path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    if (listen(fd, backlog) == -1) {
+        perror("listen");
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+    return fd;
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <sys/un.h>
+
+// UNIX stream sockets shared by the collector and the metrics endpoint.
+// what names the user in messages ("collector", "metrics").
+
+// False, with a message, if path does not fit in sun_path.
+bool unix_address(const char *what, const char *path, sockaddr_un &sun);
+
+// A non-blocking, close-on-exec listening socket bound to path, or -1.
+// A socket file left behind by a dead process is replaced; one that still
+// accepts connections, or any other file, is left alone and fails the bind.
+int unix_listen(const char *what, const char *path, int backlog);